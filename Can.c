@@ -350,6 +350,9 @@ PHP_MINIT_FUNCTION(can)
         & PHP_MINIT(can_server_route)(INIT_FUNC_ARGS_PASSTHRU)
         & PHP_MINIT(can_server_websocket)(INIT_FUNC_ARGS_PASSTHRU)
         & PHP_MINIT(can_server_request)(INIT_FUNC_ARGS_PASSTHRU)
+        & PHP_MINIT(can_server_middleware)(INIT_FUNC_ARGS_PASSTHRU)
+        & PHP_MINIT(can_server_ratelimit)(INIT_FUNC_ARGS_PASSTHRU)
+        & PHP_MINIT(can_server_cors)(INIT_FUNC_ARGS_PASSTHRU)
     ;
 }
 PHP_MSHUTDOWN_FUNCTION(can)
@@ -360,6 +363,9 @@ PHP_MSHUTDOWN_FUNCTION(can)
         & PHP_MSHUTDOWN(can_server_route)(INIT_FUNC_ARGS_PASSTHRU)
         & PHP_MSHUTDOWN(can_server_websocket)(INIT_FUNC_ARGS_PASSTHRU)
         & PHP_MSHUTDOWN(can_server_request)(INIT_FUNC_ARGS_PASSTHRU)
+        & PHP_MSHUTDOWN(can_server_middleware)(INIT_FUNC_ARGS_PASSTHRU)
+        & PHP_MSHUTDOWN(can_server_ratelimit)(INIT_FUNC_ARGS_PASSTHRU)
+        & PHP_MSHUTDOWN(can_server_cors)(INIT_FUNC_ARGS_PASSTHRU)
     ;
 }
 
@@ -371,6 +377,9 @@ PHP_RINIT_FUNCTION(can)
         & PHP_RINIT(can_server_route)(INIT_FUNC_ARGS_PASSTHRU)
         & PHP_RINIT(can_server_websocket)(INIT_FUNC_ARGS_PASSTHRU)
         & PHP_RINIT(can_server_request)(INIT_FUNC_ARGS_PASSTHRU)
+        & PHP_RINIT(can_server_middleware)(INIT_FUNC_ARGS_PASSTHRU)
+        & PHP_RINIT(can_server_ratelimit)(INIT_FUNC_ARGS_PASSTHRU)
+        & PHP_RINIT(can_server_cors)(INIT_FUNC_ARGS_PASSTHRU)
     ;
 }
 PHP_RSHUTDOWN_FUNCTION(can)
@@ -381,6 +390,9 @@ PHP_RSHUTDOWN_FUNCTION(can)
         & PHP_RSHUTDOWN(can_server_route)(INIT_FUNC_ARGS_PASSTHRU)
         & PHP_RSHUTDOWN(can_server_websocket)(INIT_FUNC_ARGS_PASSTHRU)
         & PHP_RSHUTDOWN(can_server_request)(INIT_FUNC_ARGS_PASSTHRU)
+        & PHP_RSHUTDOWN(can_server_middleware)(INIT_FUNC_ARGS_PASSTHRU)
+        & PHP_RSHUTDOWN(can_server_ratelimit)(INIT_FUNC_ARGS_PASSTHRU)
+        & PHP_RSHUTDOWN(can_server_cors)(INIT_FUNC_ARGS_PASSTHRU)
     ;
 }
 
@@ -28,14 +28,23 @@ extern ZEND_DECLARE_MODULE_GLOBALS(can)
 #include <evhttp.h>
 #include <signal.h>
 #include <sys/time.h>
+#include <sys/socket.h>
+#include <zlib.h>
 
 static zend_bool request_counter_used = 0;
 static long request_counter = 0;
 
+/* server currently dispatching requests */
+static struct php_can_server *active_server = NULL;
+
 zend_class_entry *ce_can_server;
 static zend_object_handlers server_obj_handlers;
 
-void php_can_parse_multipart(const char* content_type, struct evbuffer* buffer, zval* post, zval** files TSRMLS_DC);
+/* serializations of handler results */
+#define ENCODE_JSON    1
+#define ENCODE_MSGPACK 2
+
+void php_can_parse_query(const char *data, size_t len, int arg, zval *target TSRMLS_DC);
 void server_websocket_route_handle_request(zval *zroute, zval *zrequest, zval *params TSRMLS_DC);
 static void server_dtor(void *object TSRMLS_DC);
 
@@ -85,6 +94,19 @@ static void server_dtor(void *object TSRMLS_DC)
         server->logfile = NULL;
     }
 
+    if (server->pending) {
+        zend_hash_destroy(server->pending);
+        FREE_HASHTABLE(server->pending);
+    }
+
+    php_can_server_access_free(&server->access);
+    php_can_server_file_cache_free(&server->file_cache);
+
+    if (server->compression.types) {
+        zend_hash_destroy(server->compression.types);
+        FREE_HASHTABLE(server->compression.types);
+    }
+
     if (server->router) {
         zval_ptr_dtor(&server->router);
     }
@@ -263,370 +285,1352 @@ static void forward_request(const char *url, zval *zrequest, struct php_can_serv
     }
 }
 
-/**
- * Remove null byte from any string value
- */
-static int cleanUp(zval **item TSRMLS_DC)
+static int drop_connection_pending(void *data, void *arg TSRMLS_DC)
 {
-    /* TODO: do we need stripslashes in PHP 5.4+ ?
-    if (Z_TYPE_PP(item) == IS_STRING) {
-        char *str = estrndup(Z_STRVAL_PP(item), Z_STRLEN_PP(item));
-        int str_len = Z_STRLEN_PP(item);
-        php_stripslashes(str, &str_len TSRMLS_CC);
-        efree(Z_STRVAL_PP(item));
-        Z_STRVAL_PP(item) = estrndup(str, str_len);
-        Z_STRLEN_PP(item) = str_len;
-        efree(str);
+    struct php_can_server_pending *pending = *(struct php_can_server_pending **)data;
+
+    if (pending == NULL || pending->evcon != (struct evhttp_connection *)arg) {
+        return ZEND_HASH_APPLY_KEEP;
     }
-    */
-    if (Z_TYPE_PP(item) == IS_STRING) {
-        int new_value_len, count = 0;
-        char *new_value = php_str_to_str_ex(Z_STRVAL_PP(item), Z_STRLEN_PP(item),
-                "\0", 1, "", 0, &new_value_len, 0, &count);
-        if (count > 0) {
-            efree(Z_STRVAL_PP(item));
-            Z_STRVAL_PP(item) = estrndup(new_value, new_value_len);
-            Z_STRLEN_PP(item) = new_value_len;
+    // libevent detaches requests failing in the middle of the body and
+    // leaves them to us, it frees the others with the connection
+    if (evhttp_request_get_connection(pending->req) == NULL) {
+        if (pending->zrequest) {
+            ((struct php_can_server_request *)zend_object_store_get_object(
+                    pending->zrequest TSRMLS_CC))->req = NULL;
         }
-        efree(new_value);
+        evhttp_request_free(pending->req);
     }
-
-    return ZEND_HASH_APPLY_KEEP;
+    return ZEND_HASH_APPLY_REMOVE;
 }
 
-static void parse_cookies(const char *cookie, zval **array_ptr TSRMLS_DC)
+/**
+ * Forget a connection going away, drop its requests whose body was not
+ * complete and release its slot in the connection count of the client.
+ * Close callbacks replacing the one of the server call this themselves.
+ */
+void php_can_server_connection_closed(struct evhttp_connection *evcon)
 {
-    char *str, *var, *val, *strtok_buf = NULL;
-    str = (char *) estrdup(cookie);
-    var = php_strtok_r(str, ";\0", &strtok_buf);
-    while (var) {
+    TSRMLS_FETCH();
 
-        val = strchr(var, '=');
+    if (active_server == NULL) {
+        return;
+    }
+    if (active_server->pending != NULL) {
+        zend_hash_apply_with_argument(active_server->pending, drop_connection_pending, evcon TSRMLS_CC);
+    }
+    php_can_server_access_close(&active_server->access, evcon);
+}
 
-        /* Remove leading spaces from cookie names,
-           needed for multi-cookie header where ; can be
-           followed by a space */
-        while (isspace(*var)) {
-            var++;
-        }
+static void connection_closed(struct evhttp_connection *evcon, void *arg)
+{
+    php_can_server_connection_closed(evcon);
+}
 
-        if (var == val || *var == '\0') {
-            goto next_cookie;
-        }
+/**
+ * Admit the connection of the request on its first request, refused
+ * connections get the status they are answered with
+ */
+static int admit_connection(struct php_can_server *server, struct evhttp_request *req)
+{
+    struct evhttp_connection *evcon = evhttp_request_get_connection(req);
+    int code = php_can_server_access_open(&server->access, evcon);
 
-        if (val) { /* have a value */
-            int val_len;
-            unsigned int new_val_len;
+    if (code == 0) {
+        evhttp_connection_set_closecb(evcon, connection_closed, server);
+    }
+    return code;
+}
 
-            *val++ = '\0';
-            php_url_decode(var, strlen(var));
-            val_len = php_url_decode(val, strlen(val));
-            val = estrndup(val, val_len);
-            add_assoc_stringl(*array_ptr, var, val, val_len, 1);
-            efree(val);
-        } else {
-            int val_len;
-            unsigned int new_val_len;
-
-            php_url_decode(var, strlen(var));
-            val_len = 0;
-            val = STR_EMPTY_ALLOC();
-            add_assoc_stringl(*array_ptr, var, val, val_len, 1);
-            efree(val);
-        }
-next_cookie:
-        var = php_strtok_r(NULL, ";\0", &strtok_buf);
+/**
+ * Reason phrase of the statuses requests are rejected with early
+ */
+static const char *reason_phrase(int code)
+{
+    switch (code) {
+        case 400: return "Bad Request";
+        case 401: return "Unauthorized";
+        case 403: return "Forbidden";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 413: return "Request Entity Too Large";
+        case 431: return "Request Header Fields Too Large";
+        case 429: return "Too Many Requests";
+        case 500: return "Internal Server Error";
+        case 503: return "Service Unavailable";
     }
+    return "Error";
+}
 
-    efree(str);
+static void free_json_stream_ctx(struct php_can_json_stream_ctx *ctx)
+{
+    zval_ptr_dtor(&ctx->value);
+    zval_ptr_dtor(&ctx->zrequest);
+    free(ctx);
 }
 
-static void request_handler(struct evhttp_request *req, void *arg)
+static void log_json_stream(struct php_can_json_stream_ctx *ctx, struct php_can_server_request *request)
+{
+    if (ctx->server->logformat_len) {
+        struct php_can_server_logentry *logentry;
+        LOGENTRY_CTOR(logentry, request);
+        LOGENTRY_LOG(logentry, ctx->server, ctx->request_id);
+        LOGENTRY_DTOR(logentry);
+    }
+}
+
+/**
+ * Client went away in the middle of a streamed JSON response
+ */
+static void json_stream_closed(struct evhttp_connection *evcon, void *arg)
 {
     TSRMLS_FETCH();
+    struct php_can_json_stream_ctx *ctx = (struct php_can_json_stream_ctx *)arg;
 
-    if (request_counter_used) {
-        if (request_counter == (LONG_MAX - 1)) {
-            request_counter = 0;
-        }
-        request_counter++;
+    struct php_can_server_request *request = (struct php_can_server_request*)
+        zend_object_store_get_object(ctx->zrequest TSRMLS_CC);
+
+    if (request->error == NULL) {
+        spprintf(&request->error, 0, "%s", "Connection closed while streaming response");
     }
+    log_json_stream(ctx, request);
 
-    zval *zrequest, *args[2];
-    struct php_can_server *server = (struct php_can_server*)arg;
-    struct php_can_server_request *request;
-    struct php_can_server_router *router;
-    struct php_can_server_route *route = NULL;
-    const char *cookie = NULL, *content_type = NULL, *content_length = NULL;
-    long content_len = 0, buffer_len = 0;
-    zval retval, *params;
-    struct timeval tp = {0};
-    long routeIndex = -1;
+    // libevent leaves unfinished requests of failed connections to us
+    if (evhttp_request_get_connection(request->req) == NULL) {
+        evhttp_request_free(request->req);
+    }
+    request->status = PHP_CAN_SERVER_RESPONSE_STATUS_SENT;
+    free_json_stream_ctx(ctx);
+    php_can_server_connection_closed(evcon);
+}
+
+/**
+ * Previous chunk of a streamed JSON response was written to the
+ * client, encode and send the next one
+ */
+static void json_stream_chunk_sent(struct evhttp_connection *evcon, void *arg)
+{
+    TSRMLS_FETCH();
+    struct php_can_json_stream_ctx *ctx = (struct php_can_json_stream_ctx *)arg;
+
+    struct php_can_server_request *request = (struct php_can_server_request*)
+        zend_object_store_get_object(ctx->zrequest TSRMLS_CC);
 
     struct evbuffer *buffer = evbuffer_new();
+    int more = php_can_json_encode_slice(buffer, Z_ARRVAL_P(ctx->value), &ctx->pos, ctx->object,
+            &ctx->first, PHP_CAN_SERVER_JSON_CHUNK_SIZE TSRMLS_CC);
 
-    // create request object
-    MAKE_STD_ZVAL(zrequest);
-    object_init_ex(zrequest, ce_can_server_request);
-    Z_SET_REFCOUNT_P(zrequest, 1);
-    request = (struct php_can_server_request *)zend_object_store_get_object(zrequest TSRMLS_CC);
-    request->req = req;
+    // the connection may go away as soon as the response is done
+    if (more <= 0) {
+        evhttp_connection_set_closecb(evcon, connection_closed, ctx->server);
+        request->status = PHP_CAN_SERVER_RESPONSE_STATUS_SENT;
+    }
 
-    // set request time
-    if(gettimeofday(&tp, NULL) == 0 ) {
-        request->time = (double)(tp.tv_sec + tp.tv_usec / 1000000.00);
+    if (more < 0) {
+        // headers are out already, drop the connection so that the
+        // client does not take the truncated document as complete
+        if (request->error == NULL) {
+            spprintf(&request->error, 0, "%s", EG(exception)
+                    ? "Uncaught exception while streaming JSON response"
+                    : "Unable to encode response as JSON");
+        }
+        if (EG(exception)) {
+            zend_clear_exception(TSRMLS_C);
+        }
+        evbuffer_free(buffer);
+        log_json_stream(ctx, request);
+        free_json_stream_ctx(ctx);
+        evhttp_connection_free(evcon);
+        return;
     }
 
-    const char * uri_path = evhttp_uri_get_path(req->uri_elems);
-    if (uri_path == NULL) {
-        // Bad request
-        request->response_code = 400;
-        spprintf(&request->error, 0, "Cannot determine path of the uri");
+    if (more == 0) {
+        evbuffer_add(buffer, ctx->object ? "}" : "]", 1);
+    }
+    request->response_len += evbuffer_get_length(buffer);
+    php_can_server_compress_chunk(request, buffer);
 
+    if (more) {
+        evhttp_send_reply_chunk_with_cb(request->req, buffer, json_stream_chunk_sent, ctx);
+        evbuffer_free(buffer);
     } else {
+        evhttp_send_reply_chunk(request->req, buffer);
+        evbuffer_free(buffer);
+        log_json_stream(ctx, request);
+        php_can_server_compress_end(request);
+        evhttp_send_reply_end(request->req);
+        free_json_stream_ctx(ctx);
+    }
+}
 
-        MAKE_STD_ZVAL(params);
-        array_init(params);
+/**
+ * JSON encode an array returned by the request handler. Documents
+ * larger than one chunk are sent as chunked response if allowed,
+ * every next chunk is encoded only after the previous one has been
+ * written to the client, so the encoded document never sits in
+ * memory as a whole
+ */
+static int json_respond_array(struct php_can_server *server, zval *zrequest, zval *retval,
+        struct evbuffer *buffer, int stream TSRMLS_DC)
+{
+    struct php_can_server_request *request = (struct php_can_server_request*)
+        zend_object_store_get_object(zrequest TSRMLS_CC);
+    struct php_can_json_stream_ctx *ctx = NULL;
+    HashTable *ht = Z_ARRVAL_P(retval);
+    HashPosition pos;
+    int first = 1, object = !php_can_json_is_list(ht), more;
+
+    zend_hash_internal_pointer_reset_ex(ht, &pos);
+    evbuffer_add(buffer, object ? "{" : "[", 1);
+    more = php_can_json_encode_slice(buffer, ht, &pos, object, &first,
+            stream ? PHP_CAN_SERVER_JSON_CHUNK_SIZE : (size_t)-1 TSRMLS_CC);
+
+    if (more > 0 && (ctx = calloc(1, sizeof(*ctx))) == NULL) {
+        // cannot stream, encode the rest at once
+        more = php_can_json_encode_slice(buffer, ht, &pos, object, &first, (size_t)-1 TSRMLS_CC);
+    }
+    if (more < 0) {
+        return FAILURE;
+    }
+    if (more == 0) {
+        evbuffer_add(buffer, object ? "}" : "]", 1);
+        request->response_len = evbuffer_get_length(buffer);
+        return SUCCESS;
+    }
 
-        // try to find route handler
-        router = (struct php_can_server_router *)zend_object_store_get_object(server->router TSRMLS_CC);
-        char *method = php_can_method_name(req->type);
-        zval **method_routes;
-        if (FAILURE != zend_hash_find(Z_ARRVAL_P(router->method_routes), method, strlen(method) + 1, (void **)&method_routes)) {
-            zval **item;
-            if (FAILURE != zend_hash_find(Z_ARRVAL_PP(method_routes), uri_path, strlen(uri_path) + 1, (void **)&item)) {
-                // static route
-                routeIndex = Z_LVAL_PP(item);
-            } else {
-                // dynamic routes, apply regexp to the URI
-                PHP_CAN_FOREACH(*method_routes, item) {
-                    if (strkey[0] == '\1') {
-                        pcre_cache_entry *pce;
-                        // TODO: cache compiled pce
-                        if (NULL != (pce = pcre_get_compiled_regex_cache(strkey, strlen(strkey) TSRMLS_CC))) {
-                            zval *subpats = NULL;
-                            zval *res = NULL;
-                            ALLOC_INIT_ZVAL(subpats);
-                            ALLOC_INIT_ZVAL(res);
-                            php_pcre_match_impl(pce, (char *)uri_path, strlen(uri_path), res, subpats, 0, 0, 0, 0 TSRMLS_CC);
-                            if(Z_LVAL_P(res) > 0) {
-                                routeIndex = Z_LVAL_PP(item);
-                                zval **match;
-                                PHP_CAN_FOREACH(subpats, match) {
-                                    if (keytype == HASH_KEY_IS_STRING) {
-                                        char * param = estrndup(Z_STRVAL_PP(match), Z_STRLEN_PP(match));
-                                        int param_len = php_url_decode(param, Z_STRLEN_PP(match));
-                                        add_assoc_stringl(params, strkey, param, param_len, 0);
-                                    }
-                                }
-                            }
-                            zval_ptr_dtor(&subpats);
-                            zval_ptr_dtor(&res);
-                            if (routeIndex >= 0) {
-                                break;
-                            }
-                        }
-                    }
+    // take over the array, the handler's return value is left NULL
+    MAKE_STD_ZVAL(ctx->value);
+    *ctx->value = *retval;
+    INIT_PZVAL(ctx->value);
+    ZVAL_NULL(retval);
+
+    Z_ADDREF_P(zrequest);
+    ctx->zrequest = zrequest;
+    ctx->request_id = request_counter;
+    ctx->server = server;
+    ctx->pos = pos;
+    ctx->object = object;
+    ctx->first = first;
+    ctx->evcon = evhttp_request_get_connection(request->req);
+
+    evhttp_connection_set_closecb(ctx->evcon, json_stream_closed, ctx);
+    request->compress = php_can_server_compress_start(request->compression, request->req, &request->headers,
+            request->response_code, -1);
+    evhttp_send_reply_start(request->req, request->response_code, NULL);
+    request->status = PHP_CAN_SERVER_RESPONSE_STATUS_STREAMING;
+    request->response_len = evbuffer_get_length(buffer);
+    php_can_server_compress_chunk(request, buffer);
+    evhttp_send_reply_chunk_with_cb(request->req, buffer, json_stream_chunk_sent, ctx);
+
+    return SUCCESS;
+}
+
+/**
+ * Check whether the Accept request header asks for MessagePack,
+ * media ranges with q=0 do not count
+ */
+static int accepts_msgpack(const char *accept)
+{
+    const char *p = accept, *end, *type;
+    int len;
+
+    while (p && *p) {
+        while (*p == ' ' || *p == '\t' || *p == ',') {
+            p++;
+        }
+        type = p;
+        while (*p && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') {
+            p++;
+        }
+        len = p - type;
+        end = strchr(p, ',');
+        if (end == NULL) {
+            end = p + strlen(p);
+        }
+        if ((len == sizeof("application/msgpack") - 1
+                    && strncasecmp(type, "application/msgpack", len) == 0)
+                || (len == sizeof("application/x-msgpack") - 1
+                    && strncasecmp(type, "application/x-msgpack", len) == 0)) {
+            const char *q = p;
+            while ((q = memchr(q, ';', end - q)) != NULL) {
+                q++;
+                while (*q == ' ' || *q == '\t') {
+                    q++;
+                }
+                if ((*q == 'q' || *q == 'Q') && q[1] == '=') {
+                    return zend_strtod(q + 2, NULL) > 0;
                 }
             }
+            return 1;
         }
+        p = end;
+    }
+    return 0;
+}
 
-        zval **zroute;
-        if (routeIndex == -1 || FAILURE == zend_hash_index_find(Z_ARRVAL_P(router->routes), routeIndex, (void **)&zroute)) {
-            // there is definitely no such route for requested HTTP method
-            // we search through route_methods to determine what HTTP response we send back
-            zval **item;
-            zend_bool found = 0;
-            if (FAILURE != zend_hash_find(Z_ARRVAL_P(router->route_methods), uri_path, strlen(uri_path) + 1, (void **)&item)) {
-                found = 1;
-            } else {
-                PHP_CAN_FOREACH(router->route_methods, item) {
-                    if (strkey[0] == '\1') {
-                        pcre_cache_entry *pce;
-                        // TODO: cache compiled pce
-                        if (NULL != (pce = pcre_get_compiled_regex_cache(strkey, strlen(strkey) TSRMLS_CC))) {
-                            zval *subpats = NULL;
-                            zval *res = NULL;
-                            ALLOC_INIT_ZVAL(subpats);
-                            ALLOC_INIT_ZVAL(res);
-                            php_pcre_match_impl(pce, (char *)uri_path, strlen(uri_path), res, subpats, 0, 0, 0, 0 TSRMLS_CC);
-                            if(Z_LVAL_P(res) > 0) {
-                                // route exists, so we send 405
-                                found = 1;
-                            }
-                            zval_ptr_dtor(&subpats);
-                            zval_ptr_dtor(&res);
-                            if (found) {
-                                break;
-                            }
-                        }
-                    }
-                }
-            }
-            request->response_code = found ? 405 : 404;
-            spprintf(&request->error, 0, "Cannot determine route for the path '%s'", uri_path);
+/**
+ * Log request answered before the request object was created
+ */
+static void log_early_reply(struct php_can_server *server, struct evhttp_request *req, int code,
+        const char *error, double request_time TSRMLS_DC)
+{
+    if (server->logformat_len) {
+        const char *query = evhttp_uri_get_query(req->uri_elems);
+        struct php_can_server_logentry *logentry = ecalloc(1, sizeof(*logentry));
+        logentry->request_time = request_time;
+        logentry->request_type = req->type;
+        logentry->request_uri = (char *)evhttp_request_uri(req);
+        logentry->uri = estrdup(evhttp_uri_get_path(req->uri_elems));
+        logentry->query = estrdup(query ? query : "-");
+        logentry->remote_host = req->remote_host;
+        logentry->remote_port = req->remote_port;
+        logentry->response_code = code;
+        logentry->error = estrdup(error);
+        LOGENTRY_LOG(logentry, server, request_counter);
+        LOGENTRY_DTOR(logentry);
+    }
+}
 
-        } else {
+/**
+ * Take a token from the router and route rate limits of the client,
+ * returns 0 or the seconds the client has to wait. Without a route
+ * only the router limit applies.
+ */
+static long ratelimit_retry(struct php_can_server_router_table *table, zval *zroute,
+        struct evhttp_request *req, HashTable **headers, double request_time TSRMLS_DC)
+{
+    struct php_can_server_route *route = zroute == NULL ? NULL
+        : (struct php_can_server_route *)zend_object_store_get_object(zroute TSRMLS_CC);
+    long retry_after = 0;
 
-            if (instanceof_function(Z_OBJCE_PP(zroute), ce_can_server_websocket_route TSRMLS_CC)) {
+    if (table->ratelimit != NULL) {
+        retry_after = php_can_server_ratelimit_take((struct php_can_server_ratelimit *)
+                zend_object_store_get_object(table->ratelimit TSRMLS_CC), req, headers, request_time);
+    }
+    if (retry_after == 0 && route != NULL && route->ratelimit != NULL) {
+        retry_after = php_can_server_ratelimit_take((struct php_can_server_ratelimit *)
+                zend_object_store_get_object(route->ratelimit TSRMLS_CC), req, headers, request_time);
+    }
+    return retry_after;
+}
 
-                server_websocket_route_handle_request(*zroute, zrequest, params TSRMLS_CC);
+/**
+ * Check router and route rate limits of the client, a throttled
+ * client is answered with 429 right away and nothing else is done
+ */
+static int rate_limited(struct php_can_server *server, struct php_can_server_router_table *table,
+        zval *zroute, struct evhttp_request *req, HashTable **headers, double request_time TSRMLS_DC)
+{
+    long retry_after = ratelimit_retry(table, zroute, req, headers, request_time TSRMLS_CC);
+    char retry[MAX_LENGTH_OF_LONG + 1];
 
-            } else {
+    if (retry_after == 0) {
+        return 0;
+    }
 
-                // set route
-                route = (struct php_can_server_route *)zend_object_store_get_object(*zroute TSRMLS_CC);
+    snprintf(retry, sizeof(retry), "%ld", retry_after);
+    evhttp_add_header(req->output_headers, "Retry-After", retry);
+    evhttp_send_reply(req, 429, "Too Many Requests", NULL);
+    log_early_reply(server, req, 429, "Rate limit exceeded", request_time TSRMLS_CC);
+    return 1;
+}
 
-                // check if we must cast params
-                if (zend_hash_num_elements(Z_ARRVAL_P(route->casts))) {
-                    zval **item, **param;
-                    PHP_CAN_FOREACH(route->casts, item) {
-                        if (FAILURE != zend_hash_find(Z_ARRVAL_P(params), strkey, strlen(strkey) + 1, (void **)&param)) {
-                            if (Z_LVAL_PP(item) == IS_LONG) {
-                                convert_to_long_ex(param);
-                            } else if (Z_LVAL_PP(item) == IS_DOUBLE) {
-                                convert_to_double_ex(param);
-                            } else if (Z_LVAL_PP(item) == IS_PATH) {
-                                if (CHECK_ZVAL_NULL_PATH(*param)) {
-                                    request->response_code = 400;
-                                    spprintf(&request->error, 0, "Detected invalid characters in the URI.");
-                                    break;
-                                }
-                            }
-                        }
-                    }
-                }
+/**
+ * Answer CORS preflight request of a route with a CORS policy
+ */
+static int cors_preflight(struct php_can_server *server, struct php_can_server_router_table *table,
+        struct evhttp_request *req, HashTable **headers, const char *path, double request_time TSRMLS_DC)
+{
+    int method = php_can_server_cors_request_method(req, headers), status;
+    zval **zroute, *cors;
 
-                // parse cookies
-                cookie = evhttp_find_header(request->req->input_headers, "Cookie");
-                if (cookie != NULL) {
-                    MAKE_STD_ZVAL(request->cookies);
-                    array_init(request->cookies);
-                    parse_cookies(cookie, &request->cookies TSRMLS_CC);
-                    // remove null bytes from cookies
-                    zend_hash_apply(Z_ARRVAL_P(request->cookies), (apply_func_t) cleanUp TSRMLS_CC);
-                }
+    if (method == 0 || 200 != php_can_server_router_match(table, method, evhttp_request_get_host(req),
+            path, &zroute, NULL TSRMLS_CC)) {
+        return 0;
+    }
 
-                // set query and parse GET parameters
-                request->uri = estrdup(uri_path);
-                const char *query = evhttp_uri_get_query(req->uri_elems);
-                if (query != NULL) {
-                    request->query = estrdup(query);
-                    MAKE_STD_ZVAL(request->get);
-                    array_init(request->get);
-                    char *q = estrdup(query); // will be freed within php_default_treat_data()
-                    php_default_treat_data(PARSE_STRING, q, request->get TSRMLS_CC);
-                    // remove null bytes from get params
-                    zend_hash_apply(Z_ARRVAL_P(request->get), (apply_func_t) cleanUp TSRMLS_CC);
-                }
+    struct php_can_server_route *route = (struct php_can_server_route *)
+        zend_object_store_get_object(*zroute TSRMLS_CC);
+    cors = route->cors ? route->cors : table->cors;
+    if (cors == NULL) {
+        return 0;
+    }
 
-                // parse POST parameters
-                if (request->req->type == EVHTTP_REQ_POST) {
+    status = php_can_server_cors_preflight((struct php_can_server_cors *)
+            zend_object_store_get_object(cors TSRMLS_CC), req, headers, method);
+    evhttp_send_reply(req, status, status == 204 ? "No Content" : "Forbidden", NULL);
+    log_early_reply(server, req, status, status == 204 ? "-" : "CORS preflight rejected", request_time TSRMLS_CC);
+    return 1;
+}
 
-                    buffer_len = EVBUFFER_LENGTH(request->req->input_buffer);
-                    content_length = evhttp_find_header(request->req->input_headers, "Content-Length");
-                    if (content_length != NULL) {
-                        content_len = atol(content_length);
-                    }
+/**
+ * libevent takes -1 for no limit or timeout
+ */
+static ev_ssize_t unlimited(long value)
+{
+    return value > 0 ? (ev_ssize_t)value : -1;
+}
 
-                    if (buffer_len > content_len) {
-                        request->response_code = 400;
-                        spprintf(&request->error, 0, "Actual POST length %ld does not match Content-Length %ld",
-                                buffer_len, content_len);
-                    } else {
-                        content_type = evhttp_find_header(request->req->input_headers, "Content-Type");
-                        if (content_type != NULL) {
-                            MAKE_STD_ZVAL(request->post);
-                            array_init(request->post);
-                            if (NULL != strstr(content_type, "multipart/form-data")) {
-                                php_can_parse_multipart(content_type, request->req->input_buffer, request->post, &request->files TSRMLS_CC);
-                            } else if (NULL != strstr(content_type, "application/x-www-form-urlencoded")) {
-                                php_default_treat_data(PARSE_STRING,
-                                    estrndup(EVBUFFER_DATA( request->req->input_buffer ), buffer_len),
-                                    request->post TSRMLS_CC
-                                );
-                            }
-                            // remove null bytes from post params
-                            zend_hash_apply(Z_ARRVAL_P(request->post), (apply_func_t) cleanUp TSRMLS_CC);
-                        }
-                    }
-                }
+/**
+ * Compress the buffered response if the client accepts it, the body
+ * is what after hooks left in the output buffer followed by the buffer
+ */
+static void compress_response(struct php_can_server_request *request, struct evbuffer *buffer)
+{
+    struct evhttp_request *req = request->req;
+    struct php_can_compress *c;
+    struct evbuffer *out;
+    long len = (long)(evbuffer_get_length(req->output_buffer) + evbuffer_get_length(buffer));
 
-                if (request->response_code == 0) {
+    if (len == 0 || (c = php_can_server_compress_start(request->compression, req, &request->headers,
+            request->response_code, len)) == NULL) {
+        return;
+    }
+    evbuffer_prepend_buffer(buffer, req->output_buffer);
+    out = evbuffer_new();
+    if (php_can_compress_data(c, buffer, out, Z_FINISH) == SUCCESS) {
+        evbuffer_add_buffer(buffer, out);
+    } else {
+        evbuffer_drain(buffer, evbuffer_get_length(buffer));
+        evhttp_remove_header(req->output_headers, "Content-Encoding");
+        request->response_code = 500;
+        spprintf(&request->error, 0, "Unable to compress response");
+    }
+    evbuffer_free(out);
+    php_can_compress_free(c);
+}
 
-                    // call handler
-                    args[0] = zrequest;
-                    args[1] = params;
+/**
+ * Create the request object
+ */
+static zval *request_new(struct php_can_server *server, struct evhttp_request *req, double request_time,
+        HashTable *headers TSRMLS_DC)
+{
+    zval *zrequest;
+    struct php_can_server_request *request;
 
-                    Z_ADDREF_P(args[0]);
-                    Z_ADDREF_P(args[1]);
+    MAKE_STD_ZVAL(zrequest);
+    object_init_ex(zrequest, ce_can_server_request);
+    Z_SET_REFCOUNT_P(zrequest, 1);
+    request = (struct php_can_server_request *)zend_object_store_get_object(zrequest TSRMLS_CC);
+    request->req = req;
+    request->time = request_time;
+    request->headers = headers;
+    request->compression = &server->compression;
+    request->file_cache = &server->file_cache;
+    return zrequest;
+}
 
-                    if (call_user_function(EG(function_table), NULL, route->handler, &retval, 2, args TSRMLS_CC) == SUCCESS) {
-                        if (request->status == PHP_CAN_SERVER_RESPONSE_STATUS_NONE) {
-                            if (request->response_code == 0) {
-                                request->response_code = 200;
-                            }
-                            if (request->response_code >= 200 && request->response_code < 300) {
-                                if (Z_TYPE(retval) == IS_STRING) {
-                                    if (Z_STRLEN(retval) > 0) {
-                                        request->response_len = Z_STRLEN(retval);
-                                        evbuffer_add(buffer, Z_STRVAL(retval), Z_STRLEN(retval));
-                                    }
-                                } else if (Z_TYPE(retval) == IS_NULL) {
-                                    // empty response
-                                } else {
+/**
+ * Parse cookies, path and GET parameters of the request once
+ */
+static void request_parse_uri(struct php_can_server_request *request, const char *uri_path TSRMLS_DC)
+{
+    const char *cookie, *query;
 
-                                    if (Z_TYPE(retval) == IS_OBJECT &&  instanceof_function(Z_OBJCE(retval), ce_can_HTTPForward TSRMLS_CC)) {
+    if (request->uri != NULL) {
+        return;
+    }
+    cookie = PHP_CAN_REQUEST_HEADER(request, COOKIE);
+    if (cookie != NULL) {
+        MAKE_STD_ZVAL(request->cookies);
+        array_init(request->cookies);
+        php_can_parse_query(cookie, strlen(cookie), PARSE_COOKIE, request->cookies TSRMLS_CC);
+    }
 
-                                        zval *url = PHP_CAN_READ_PROPERTY(&retval, "url");
-                                        zval *headers = PHP_CAN_READ_PROPERTY(&retval, "headers");
-                                        zval *callback = PHP_CAN_READ_PROPERTY(&retval, "callback");
-                                        zval *merge = PHP_CAN_READ_PROPERTY(&retval, "merge_headers");
-                                        forward_request((const char *)Z_STRVAL_P(url), zrequest, server, headers, callback, Z_BVAL_P(merge));
+    request->uri = estrdup(uri_path);
+    query = evhttp_uri_get_query(request->req->uri_elems);
+    if (query != NULL) {
+        request->query = estrdup(query);
+        MAKE_STD_ZVAL(request->get);
+        array_init(request->get);
+        php_can_parse_query(query, strlen(query), PARSE_GET, request->get TSRMLS_CC);
+    }
+}
 
-                                    } else {
+/**
+ * Whether the request exceeds the header or body limit of the route,
+ * the response status is set then
+ */
+static int route_limits_exceeded(struct php_can_server_route *route, struct php_can_server_request *request)
+{
+    size_t body_len = evbuffer_get_length(request->req->input_buffer);
+
+    if (route->max_header_size > 0 && request->req->headers_size > (size_t)route->max_header_size) {
+        request->response_code = 431;
+        spprintf(&request->error, 0, "Headers of %ld bytes exceed the limit of %ld",
+                (long)request->req->headers_size, route->max_header_size);
+    } else if (route->max_body_size > 0 && body_len > (size_t)route->max_body_size) {
+        request->response_code = 413;
+        spprintf(&request->error, 0, "Body of %ld bytes exceeds the limit of %ld",
+                (long)body_len, route->max_body_size);
+    }
+    return request->response_code != 0;
+}
 
-    #ifdef HAVE_JSON
-                                        // check for existance of Content-Type response header and it's value
-                                        // if the value is ``application/json`` we will try to JSON encode it
-                                        int foundHeader = 0;
-                                        const char *contentType =evhttp_find_header(req->output_headers, "Content-Type");
-                                        if (contentType && strcmp(contentType, "application/json") == 0) {
-                                            foundHeader = 1;
-                                        }
+/**
+ * Turn the pending exception into the status and error of the request
+ * and clear it. HTTPError gives its code, anything else or a code out
+ * of range is a 500. Returns the status.
+ */
+static long exception_status(struct php_can_server_request *request, const char *where TSRMLS_DC)
+{
+    zval *code = NULL, *error = NULL, *file = NULL, *line = NULL;
 
-                                        zend_class_entry **cep;
-                                        if (Z_TYPE(retval) == IS_OBJECT
-                                                && zend_lookup_class("\\JsonSerializable", sizeof("\\JsonSerializable") - 1, &cep TSRMLS_CC) == SUCCESS
-                                                && instanceof_function(Z_OBJCE(retval), *cep TSRMLS_CC)
-                                        ) {
-                                            // implements JsonSerializable, so just json_encode it
-                                            smart_str encoded = {0};
-                                            php_json_encode(&encoded, &retval, 0 TSRMLS_CC);
-                                            if (foundHeader || -1 != evhttp_add_header(request->req->output_headers, "Content-Type",
-                                                    "application/json")) {
-                                                request->response_len = encoded.len;
-                                                evbuffer_add(buffer, encoded.c, encoded.len);
+    if (request->error) {
+        efree(request->error);
+        request->error = NULL;
+    }
+    error = zend_read_property(Z_OBJCE_P(EG(exception)), EG(exception), "message", sizeof("message")-1, 1 TSRMLS_CC);
+    if (instanceof_function(Z_OBJCE_P(EG(exception)), ce_can_HTTPError TSRMLS_CC)) {
+        code = zend_read_property(Z_OBJCE_P(EG(exception)), EG(exception), "code", sizeof("code")-1, 1 TSRMLS_CC);
+        request->response_code = code && Z_TYPE_P(code) == IS_LONG && Z_LVAL_P(code) >= 100 && Z_LVAL_P(code) < 600
+            ? Z_LVAL_P(code) : 500;
+        spprintf(&request->error, 0, "%s", error && Z_TYPE_P(error) == IS_STRING ? Z_STRVAL_P(error) : "Unknown");
+    } else {
+        file = zend_read_property(Z_OBJCE_P(EG(exception)), EG(exception), "file", sizeof("file")-1, 1 TSRMLS_CC);
+        line = zend_read_property(Z_OBJCE_P(EG(exception)), EG(exception), "line", sizeof("line")-1, 1 TSRMLS_CC);
+        request->response_code = 500;
+        spprintf(&request->error, 0, "Uncaught exception '%s' within %s thrown in %s on line %d \"%s\"",
+                Z_OBJCE_P(EG(exception))->name, where,
+                file && Z_TYPE_P(file) == IS_STRING ? Z_STRVAL_P(file) : "unknown",
+                line && Z_TYPE_P(line) == IS_LONG ? (int)Z_LVAL_P(line) : 0,
+                error && Z_TYPE_P(error) == IS_STRING ? Z_STRVAL_P(error) : ""
+        );
+    }
+    zend_clear_exception(TSRMLS_C);
+    return request->response_code;
+}
+
+/**
+ * Run the beforeBody hook of the route, returns the status the request
+ * is rejected with or 0 if it may go on
+ */
+static int before_body(struct php_can_server_route *route, zval *zrequest, zval *params TSRMLS_DC)
+{
+    struct php_can_server_request *request = (struct php_can_server_request *)
+        zend_object_store_get_object(zrequest TSRMLS_CC);
+    zval retval, *args[2];
+
+    args[0] = zrequest;
+    args[1] = params;
+    Z_ADDREF_P(args[0]);
+    Z_ADDREF_P(args[1]);
+    if (call_user_function(EG(function_table), NULL, route->before_body, &retval, 2, args TSRMLS_CC) == SUCCESS) {
+        zval_dtor(&retval);
+    }
+    Z_DELREF_P(args[0]);
+    Z_DELREF_P(args[1]);
+
+    if (EG(exception)) {
+        exception_status(request, "beforeBody hook" TSRMLS_CC);
+    }
+    return request->response_code;
+}
+
+/**
+ * Turn an exception thrown by a body or upload handler into the
+ * response status, the rest of the body is discarded then
+ */
+static void body_handler_failed(struct php_can_server_request *request TSRMLS_DC)
+{
+    exception_status(request, "body handler" TSRMLS_CC);
+}
+
+/**
+ * Hand the data of the buffer to the body handler of the route,
+ * the buffer is drained
+ */
+static void deliver_body(zval *handler, zval *zrequest, struct evbuffer *buffer TSRMLS_DC)
+{
+    struct php_can_server_request *request = (struct php_can_server_request *)
+        zend_object_store_get_object(zrequest TSRMLS_CC);
+    size_t len = evbuffer_get_length(buffer);
+    zval retval, *args[2];
+    char *data;
+
+    if (len == 0 || request->response_code != 0) {
+        evbuffer_drain(buffer, len);
+        return;
+    }
+
+    data = emalloc(len + 1);
+    evbuffer_remove(buffer, data, len);
+    data[len] = '\0';
+
+    args[0] = zrequest;
+    Z_ADDREF_P(args[0]);
+    MAKE_STD_ZVAL(args[1]);
+    ZVAL_STRINGL(args[1], data, len, 0);
+
+    if (call_user_function(EG(function_table), NULL, handler, &retval, 2, args TSRMLS_CC) == SUCCESS) {
+        zval_dtor(&retval);
+    }
+    Z_DELREF_P(args[0]);
+    zval_ptr_dtor(&args[1]);
+
+    if (EG(exception)) {
+        body_handler_failed(request TSRMLS_CC);
+    }
+}
+
+/**
+ * Whether a body of the given length goes to a temporary file, bodies
+ * parsed into post parameters are always kept in memory
+ */
+static int spills_body(struct php_can_server *server, struct evhttp_request *req, HashTable **headers, size_t len)
+{
+    const char *content_type;
+
+    if (server->body_file_threshold <= 0 || len <= (size_t)server->body_file_threshold) {
+        return 0;
+    }
+    if (req->type == EVHTTP_REQ_POST
+            && (content_type = php_can_server_header(headers, req->input_headers, PHP_CAN_HEADER_CONTENT_TYPE)) != NULL
+            && (strstr(content_type, "multipart/form-data") != NULL
+                || strstr(content_type, "application/x-www-form-urlencoded") != NULL)) {
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Append the buffer to the body file and drain it, returns FAILURE
+ * if the file cannot be written
+ */
+static int body_file_write(int fd, struct evbuffer *buffer)
+{
+    while (evbuffer_get_length(buffer) > 0) {
+        if (evbuffer_write(buffer, fd) <= 0) {
+            return FAILURE;
+        }
+    }
+    return SUCCESS;
+}
+
+/**
+ * Open the temporary file a request body is spilled to
+ */
+static int body_file_open(char **tmp_name TSRMLS_DC)
+{
+    int fd = php_open_temporary_fd_ex(PG(upload_tmp_dir), "phpcan", tmp_name, 1 TSRMLS_CC);
+
+    if (fd == -1) {
+        php_error_docref(NULL TSRMLS_CC, E_WARNING,
+            "Request body error - unable to create a temporary file");
+    }
+    return fd;
+}
+
+/**
+ * Write the buffered body to a temporary file and hand it to the request
+ */
+static void spill_buffered_body(struct php_can_server_request *request TSRMLS_DC)
+{
+    struct evbuffer *input = request->req->input_buffer;
+    long len = evbuffer_get_length(input);
+    char *tmp_name = NULL;
+    int fd = body_file_open(&tmp_name TSRMLS_CC);
+
+    if (fd == -1) {
+        return;
+    }
+    if (body_file_write(fd, input) == FAILURE) {
+        php_error_docref(NULL TSRMLS_CC, E_WARNING,
+            "Request body error - unable to write to a temporary file");
+        close(fd);
+        VCWD_UNLINK(tmp_name);
+    } else {
+        request->body_file = php_can_body_file(tmp_name, fd, len TSRMLS_CC);
+    }
+    efree(tmp_name);
+}
+
+static void pending_free(struct php_can_server_pending *pending TSRMLS_DC)
+{
+    if (pending->multipart) {
+        php_can_multipart_free(pending->multipart TSRMLS_CC);
+    }
+    if (pending->body_file) {
+        if (pending->body_fd != -1) {
+            close(pending->body_fd);
+        }
+        VCWD_UNLINK(pending->body_file);
+        efree(pending->body_file);
+    }
+    php_can_server_header_index_free(&pending->headers);
+    if (pending->params) {
+        zval_ptr_dtor(&pending->params);
+    }
+    if (pending->zrequest) {
+        zval_ptr_dtor(&pending->zrequest);
+    }
+    if (pending->table) {
+        php_can_server_router_table_release(pending->table TSRMLS_CC);
+    }
+    efree(pending);
+}
+
+/**
+ * Take the request routed on arrival of its headers, if any
+ */
+static struct php_can_server_pending *take_pending(struct php_can_server *server, struct evhttp_request *req)
+{
+    struct php_can_server_pending **slot, *pending;
+
+    if (server->pending == NULL
+            || zend_hash_index_find(server->pending, (ulong)req, (void **)&slot) == FAILURE) {
+        return NULL;
+    }
+    pending = *slot;
+    *slot = NULL;
+    zend_hash_index_del(server->pending, (ulong)req);
+    return pending;
+}
+
+static void pending_dtor(void *data)
+{
+    TSRMLS_FETCH();
+
+    if (*(struct php_can_server_pending **)data != NULL) {
+        pending_free(*(struct php_can_server_pending **)data TSRMLS_CC);
+    }
+}
+
+#ifdef HAVE_EVHTTP_SET_NEWREQCB
+
+/* seconds an early reply may take to reach the client */
+#define PHP_CAN_SERVER_EARLY_REPLY_TIMEOUT 10
+
+static void early_reply_discard(struct bufferevent *bev, void *arg)
+{
+    struct evbuffer *input = bufferevent_get_input(bev);
+
+    evbuffer_drain(input, evbuffer_get_length(input));
+}
+
+static void early_reply_written(struct bufferevent *bev, void *arg)
+{
+    if (evbuffer_get_length(bufferevent_get_output(bev)) == 0) {
+        bufferevent_free(bev);
+    }
+}
+
+static void early_reply_failed(struct bufferevent *bev, short what, void *arg)
+{
+    bufferevent_free(bev);
+}
+
+/**
+ * libevent detaches a request failed by its header hook and leaves
+ * it to us, it is freed once the connection is gone
+ */
+static void early_reply_request_free(evutil_socket_t fd, short what, void *arg)
+{
+    evhttp_request_free((struct evhttp_request *)arg);
+}
+
+/**
+ * Refuse a request before its body is read. The reply carries the
+ * headers set on the request so far and is queued behind any output
+ * still pending on the connection. libevent frees the connection once
+ * the header hook returns, so the queued output moves to a duplicate
+ * of its socket which stays open until all of it is written. The
+ * pending request is freed, returns the value for the header hook.
+ */
+static int reject_early(struct php_can_server *server, struct php_can_server_pending *pending, int code,
+        const char *error TSRMLS_DC)
+{
+    struct evhttp_request *req = pending->req;
+    struct bufferevent *bev = evhttp_connection_get_bufferevent(evhttp_request_get_connection(req)), *out;
+    struct evbuffer *output = bufferevent_get_output(bev);
+    struct timeval timeout = {PHP_CAN_SERVER_EARLY_REPLY_TIMEOUT, 0}, now = {0, 0};
+    struct evkeyval *header;
+    evutil_socket_t fd;
+
+    evhttp_remove_header(req->output_headers, "Content-Length");
+    evhttp_remove_header(req->output_headers, "Connection");
+    evhttp_remove_header(req->output_headers, "Transfer-Encoding");
+    evbuffer_add_printf(output, "HTTP/%d.%d %d %s\r\n", req->major, req->minor, code, reason_phrase(code));
+    for (header = req->output_headers->tqh_first; header; header = header->next.tqe_next) {
+        evbuffer_add_printf(output, "%s: %s\r\n", header->key, header->value);
+    }
+    evbuffer_add_printf(output, "Content-Length: 0\r\nConnection: close\r\n\r\n");
+
+    if ((fd = dup(bufferevent_getfd(bev))) != -1) {
+        if ((out = bufferevent_socket_new(CAN_G(can_event_base), fd, BEV_OPT_CLOSE_ON_FREE)) != NULL) {
+            evbuffer_add_buffer(bufferevent_get_output(out), output);
+            bufferevent_setcb(out, early_reply_discard, early_reply_written, early_reply_failed, NULL);
+            bufferevent_set_timeouts(out, &timeout, &timeout);
+            bufferevent_enable(out, EV_READ | EV_WRITE);
+        } else {
+            close(fd);
+        }
+    }
+    log_early_reply(server, req, code, error, pending->time TSRMLS_CC);
+
+    // the request object may outlive the request held by libevent
+    if (pending->zrequest) {
+        ((struct php_can_server_request *)zend_object_store_get_object(
+                pending->zrequest TSRMLS_CC))->req = NULL;
+    }
+    pending_free(pending TSRMLS_CC);
+    event_base_once(CAN_G(can_event_base), -1, EV_TIMEOUT, early_reply_request_free, req, &now);
+    return -1;
+}
+
+/**
+ * Whether the client waits for 100 Continue before it sends the body
+ */
+static int expects_continue(struct evhttp_request *req, HashTable **headers)
+{
+    const char *expect = php_can_server_find_header(headers, req->input_headers, "expect", sizeof("expect") - 1);
+
+    return expect != NULL && strcasecmp(expect, "100-continue") == 0;
+}
+
+static int headers_received(struct evhttp_request *req, void *arg);
+static void body_received(struct evhttp_request *req, void *arg);
+
+/**
+ * Hook into every new request before any of it is read
+ */
+static int new_request(struct evhttp_request *req, void *arg)
+{
+    // refused connections are dropped before a single byte is read
+    if (admit_connection((struct php_can_server *)arg, req) != 0) {
+        return -1;
+    }
+    evhttp_request_set_header_cb(req, headers_received);
+    return 0;
+}
+
+/**
+ * Route the request as soon as its headers are parsed. Requests to
+ * routes with a body handler are set up to stream their body, large
+ * bodies are set up to go to a temporary file and multipart bodies
+ * to be parsed as they arrive. The beforeBody hook of the route and
+ * unknown routes of clients expecting 100-continue reject a request
+ * before its body is sent, all others are buffered and routed by the
+ * request handler as usual.
+ */
+static int headers_received(struct evhttp_request *req, void *arg)
+{
+    struct php_can_server *server = active_server;
+    struct php_can_server_router *router;
+    struct php_can_server_pending *pending;
+    struct php_can_server_route *route;
+    struct php_can_server_request *request;
+    struct timeval tp = {0};
+    const char *uri_path, *length, *content_type = NULL;
+    size_t body_len = 0;
+    zval **zroute = NULL;
+    struct evhttp_connection *evcon;
+    long retry_after, max_body_size;
+    int code;
+    TSRMLS_FETCH();
+
+    if (server == NULL || server->http != (struct evhttp *)arg) {
+        return 0;
+    }
+    // limits of the server unless the route has its own, a connection
+    // kept alive would go on with those of its previous request else
+    evcon = evhttp_request_get_connection(req);
+    evhttp_connection_set_max_body_size(evcon, unlimited(server->max_body_size));
+    evhttp_connection_set_timeout(evcon, server->body_timeout);
+
+    if (req->type == EVHTTP_REQ_OPTIONS || (uri_path = evhttp_uri_get_path(req->uri_elems)) == NULL) {
+        return 0;
+    }
+    router = (struct php_can_server_router *)zend_object_store_get_object(server->router TSRMLS_CC);
+    if (router->table == NULL) {
+        return 0;
+    }
+
+    pending = ecalloc(1, sizeof(*pending));
+    pending->req = req;
+    pending->evcon = evhttp_request_get_connection(req);
+    pending->body_fd = -1;
+    if (gettimeofday(&tp, NULL) == 0) {
+        pending->time = (double)(tp.tv_sec + tp.tv_usec / 1000000.00);
+    }
+    MAKE_STD_ZVAL(pending->params);
+    array_init(pending->params);
+    pending->table = router->table;
+    pending->table->refcount++;
+    pending->status = php_can_server_router_match(pending->table, req->type, evhttp_request_get_host(req),
+            uri_path, &zroute, pending->params TSRMLS_CC);
+
+    if (pending->status != 200 && expects_continue(req, &pending->headers)) {
+        // refuse the upload instead of letting the client send it for nothing,
+        // a throttled client learns when to come back instead
+        retry_after = ratelimit_retry(pending->table, NULL, req, &pending->headers, pending->time TSRMLS_CC);
+        if (retry_after > 0) {
+            char retry[MAX_LENGTH_OF_LONG];
+            snprintf(retry, sizeof(retry), "%ld", retry_after);
+            evhttp_add_header(req->output_headers, "Retry-After", retry);
+            return reject_early(server, pending, 429, "Rate limit exceeded" TSRMLS_CC);
+        }
+        return reject_early(server, pending, pending->status, "Cannot determine route before the body" TSRMLS_CC);
+    }
+    if (pending->status != 200 || instanceof_function(Z_OBJCE_PP(zroute), ce_can_server_websocket_route TSRMLS_CC)) {
+        pending_free(pending TSRMLS_CC);
+        return 0;
+    }
+    route = (struct php_can_server_route *)zend_object_store_get_object(*zroute TSRMLS_CC);
+
+    // libevent refuses a larger body itself, a chunked one as it arrives
+    if ((length = php_can_server_header(&pending->headers, req->input_headers, PHP_CAN_HEADER_CONTENT_LENGTH)) != NULL) {
+        body_len = (size_t)atol(length);
+    }
+    max_body_size = route->max_body_size > 0 ? route->max_body_size : server->max_body_size;
+    if (route->max_header_size > 0 && req->headers_size > (size_t)route->max_header_size) {
+        code = 431;
+    } else if (max_body_size > 0 && body_len > (size_t)max_body_size) {
+        code = 413;
+    } else {
+        code = 0;
+    }
+    if (code != 0) {
+        return reject_early(server, pending, code, "Request exceeds the limits of the route" TSRMLS_CC);
+    }
+    if (route->max_body_size > 0) {
+        evhttp_connection_set_max_body_size(evcon, (ev_ssize_t)route->max_body_size);
+    }
+    if (route->body_timeout > 0) {
+        evhttp_connection_set_timeout(evcon, route->body_timeout);
+    }
+
+    pending->streaming = 1;
+    if (route->body_handler == NULL) {
+        // a chunked body is of unknown length, so it counts as large
+        if (length == NULL && php_can_server_find_header(&pending->headers, req->input_headers,
+                "transfer-encoding", sizeof("transfer-encoding") - 1) != NULL) {
+            body_len = (size_t)-1;
+        }
+        if (req->type == EVHTTP_REQ_POST
+                && (content_type = php_can_server_header(&pending->headers, req->input_headers,
+                        PHP_CAN_HEADER_CONTENT_TYPE)) != NULL
+                && strstr(content_type, "multipart/form-data") == NULL) {
+            content_type = NULL;
+        }
+        if (content_type == NULL && !spills_body(server, req, &pending->headers, body_len)) {
+            pending->streaming = 0;
+        }
+    }
+    if (!pending->streaming && route->before_body == NULL) {
+        pending_free(pending TSRMLS_CC);
+        return 0;
+    }
+    pending->zroute = *zroute;
+
+    // throttle before a single byte of the body is accepted
+    retry_after = ratelimit_retry(pending->table, pending->zroute, req, &pending->headers, pending->time TSRMLS_CC);
+    if (retry_after > 0) {
+        char retry[MAX_LENGTH_OF_LONG];
+        snprintf(retry, sizeof(retry), "%ld", retry_after);
+        evhttp_add_header(req->output_headers, "Retry-After", retry);
+        return reject_early(server, pending, 429, "Rate limit exceeded" TSRMLS_CC);
+    }
+
+    pending->zrequest = request_new(server, req, pending->time, pending->headers TSRMLS_CC);
+    pending->headers = NULL;
+    request = (struct php_can_server_request *)zend_object_store_get_object(pending->zrequest TSRMLS_CC);
+
+    // the hook decides on the headers alone, before 100 Continue is sent
+    if (route->before_body != NULL) {
+        request_parse_uri(request, uri_path TSRMLS_CC);
+        if ((code = before_body(route, pending->zrequest, pending->params TSRMLS_CC)) != 0) {
+            return reject_early(server, pending, code, request->error ? request->error : "-" TSRMLS_CC);
+        }
+    }
+
+    if (!pending->streaming) {
+        // buffered as usual, the request handler picks up the request
+    } else if (content_type != NULL) {
+        MAKE_STD_ZVAL(request->post);
+        array_init(request->post);
+        MAKE_STD_ZVAL(request->files);
+        array_init(request->files);
+        if ((pending->multipart = php_can_multipart_new(content_type, request->post,
+                request->files, server->upload_memory_threshold TSRMLS_CC)) == NULL) {
+            // the buffered body gets the error of the parser then
+            zend_clear_exception(TSRMLS_C);
+            zval_ptr_dtor(&request->post);
+            zval_ptr_dtor(&request->files);
+            request->post = request->files = NULL;
+            pending->streaming = 0;
+        } else if (route->upload_handler != NULL) {
+            php_can_multipart_set_handler(pending->multipart, route->upload_handler, pending->zrequest);
+        }
+    } else if (route->body_handler == NULL
+            && (pending->body_fd = body_file_open(&pending->body_file TSRMLS_CC)) == -1) {
+        // spilled once complete instead
+        pending->streaming = 0;
+    }
+    if (pending->streaming) {
+        evhttp_request_set_chunked_cb(req, body_received);
+    }
+
+    if (server->pending == NULL) {
+        ALLOC_HASHTABLE(server->pending);
+        zend_hash_init(server->pending, 8, NULL, pending_dtor, 0);
+    }
+    zend_hash_index_update(server->pending, (ulong)req, &pending, sizeof(pending), NULL);
+    return 0;
+}
+
+/**
+ * Body data of a streamed request arrived, it is passed on to the
+ * body handler at once or appended to the body file. Nothing is read
+ * from the client while the handler runs, so a slow handler slows
+ * down the upload instead of letting the body pile up in memory.
+ */
+static void body_received(struct evhttp_request *req, void *arg)
+{
+    struct php_can_server_pending **slot, *pending;
+    TSRMLS_FETCH();
+
+    if (active_server == NULL || active_server->pending == NULL
+            || zend_hash_index_find(active_server->pending, (ulong)req, (void **)&slot) == FAILURE
+            || *slot == NULL) {
+        return;
+    }
+    pending = *slot;
+    if (pending->multipart != NULL) {
+        php_can_multipart_feed(pending->multipart, req->input_buffer TSRMLS_CC);
+        if (EG(exception)) {
+            // the upload handler failed, the rest of the body is dropped
+            body_handler_failed((struct php_can_server_request *)
+                    zend_object_store_get_object(pending->zrequest TSRMLS_CC) TSRMLS_CC);
+        }
+        return;
+    }
+    if (pending->body_file != NULL) {
+        // after a failed write the rest of the body is discarded
+        pending->body_size += evbuffer_get_length(req->input_buffer);
+        if (pending->body_fd == -1) {
+            evbuffer_drain(req->input_buffer, evbuffer_get_length(req->input_buffer));
+        } else if (body_file_write(pending->body_fd, req->input_buffer) == FAILURE) {
+            php_error_docref(NULL TSRMLS_CC, E_WARNING,
+                "Request body error - unable to write to a temporary file");
+            evbuffer_drain(req->input_buffer, evbuffer_get_length(req->input_buffer));
+            close(pending->body_fd);
+            pending->body_fd = -1;
+        }
+        return;
+    }
+    deliver_body(((struct php_can_server_route *)zend_object_store_get_object((*slot)->zroute TSRMLS_CC))->body_handler,
+            (*slot)->zrequest, req->input_buffer TSRMLS_CC);
+}
+
+#endif
+
+static void request_handler(struct evhttp_request *req, void *arg)
+{
+    TSRMLS_FETCH();
+
+    if (request_counter_used) {
+        if (request_counter == (LONG_MAX - 1)) {
+            request_counter = 0;
+        }
+        request_counter++;
+    }
+
+    zval *zrequest = NULL, *args[2];
+    struct php_can_server *server = (struct php_can_server*)arg;
+    struct php_can_server_pending *pending = take_pending(server, req);
+    struct php_can_server_request *request;
+    struct php_can_server_router *router;
+    struct php_can_server_router_table *table = NULL;
+    struct php_can_server_route *route = NULL;
+    const char *content_type = NULL, *content_length = NULL;
+    long content_len = 0, buffer_len = 0;
+    int entered = 0;
+    zval retval, *params;
+    struct timeval tp = {0};
+    double now = 0.0;
+    HashTable *headers = NULL;
+    zval **zroute = NULL, *routed;
+    int status = 400, streamed = 0, routed_early = 0;
+
+#ifndef HAVE_EVHTTP_SET_NEWREQCB
+    // without a hook on new requests connections are admitted here
+    int refused = admit_connection(server, req);
+    if (refused != 0) {
+        evhttp_add_header(req->output_headers, "Connection", "close");
+        evhttp_send_reply(req, refused, reason_phrase(refused), NULL);
+        return;
+    }
+#endif
+
+    // the connection waits for the next request once this one is in
+    evhttp_connection_set_timeout(evhttp_request_get_connection(req), server->keepalive_timeout);
+
+    if (pending != NULL) {
+        // routed and throttled on arrival of the headers already
+        now = pending->time;
+        table = pending->table;
+        params = pending->params;
+        routed = pending->zroute;
+        zroute = &routed;
+        status = pending->status;
+        zrequest = pending->zrequest;
+        routed_early = 1;
+        streamed = pending->streaming;
+        if (pending->body_file != NULL) {
+            request = (struct php_can_server_request *)zend_object_store_get_object(zrequest TSRMLS_CC);
+            if (pending->body_fd == -1) {
+                request->response_code = 500;
+                spprintf(&request->error, 0, "Unable to write the request body to a temporary file");
+            } else {
+                request->body_file = php_can_body_file(pending->body_file, pending->body_fd,
+                        pending->body_size TSRMLS_CC);
+                efree(pending->body_file);
+                pending->body_file = NULL;
+            }
+        }
+        if (pending->multipart != NULL) {
+            // a part cut off by the end of the body is dropped here
+            php_can_multipart_free(pending->multipart TSRMLS_CC);
+            pending->multipart = NULL;
+        }
+        pending->table = NULL;
+        pending->params = NULL;
+        pending->zrequest = NULL;
+        pending_free(pending TSRMLS_CC);
+
+    // set request time
+    } else if(gettimeofday(&tp, NULL) == 0 ) {
+        now = (double)(tp.tv_sec + tp.tv_usec / 1000000.00);
+    }
+
+    const char * uri_path = evhttp_uri_get_path(req->uri_elems);
+    if (uri_path != NULL && !routed_early) {
+
+        MAKE_STD_ZVAL(params);
+        array_init(params);
+
+        // try to find route handler, the table stays referenced until
+        // the request is done even if the router is swapped meanwhile
+        router = (struct php_can_server_router *)zend_object_store_get_object(server->router TSRMLS_CC);
+        status = 404;
+        if (router->table != NULL) {
+            table = router->table;
+            table->refcount++;
+            status = php_can_server_router_match(table, req->type, evhttp_request_get_host(req),
+                    uri_path, &zroute, params TSRMLS_CC);
+
+            // throttle before anything is allocated for the request, requests without
+            // a route and preflights count against the router limit too, then answer
+            // CORS preflight without entering PHP
+            if (rate_limited(server, table, status == 200 ? *zroute : NULL, req, &headers, now TSRMLS_CC)
+                    || (req->type == EVHTTP_REQ_OPTIONS
+                        && cors_preflight(server, table, req, &headers, uri_path, now TSRMLS_CC))) {
+                php_can_server_header_index_free(&headers);
+                zval_ptr_dtor(&params);
+                php_can_server_router_table_release(table TSRMLS_CC);
+                return;
+            }
+        }
+    }
+
+    struct evbuffer *buffer = evbuffer_new();
+
+    // create request object
+    if (zrequest == NULL) {
+        zrequest = request_new(server, req, now, headers TSRMLS_CC);
+    }
+    request = (struct php_can_server_request *)zend_object_store_get_object(zrequest TSRMLS_CC);
+
+    if (uri_path == NULL) {
+        // Bad request
+        request->response_code = 400;
+        spprintf(&request->error, 0, "Cannot determine path of the uri");
+
+    } else {
+
+        if (status == 400) {
+            request->response_code = status;
+            spprintf(&request->error, 0, "Detected invalid characters in the URI.");
+
+        } else if (status != 200) {
+            request->response_code = status;
+            spprintf(&request->error, 0, "Cannot determine route for the path '%s'", uri_path);
+
+        } else {
+
+            if (instanceof_function(Z_OBJCE_PP(zroute), ce_can_server_websocket_route TSRMLS_CC)) {
+
+                server_websocket_route_handle_request(*zroute, zrequest, params TSRMLS_CC);
+
+            } else {
+
+                // set route
+                route = (struct php_can_server_route *)zend_object_store_get_object(*zroute TSRMLS_CC);
+
+                // parse cookies, query and GET parameters unless done for the beforeBody hook
+                request_parse_uri(request, uri_path TSRMLS_CC);
+
+                // without early routing limits and hook apply to the buffered request
+                if (!routed_early && route_limits_exceeded(route, request)) {
+                    // refused, the body is left alone
+
+                } else if (!routed_early && route->before_body != NULL
+                        && before_body(route, zrequest, params TSRMLS_CC) != 0) {
+                    // rejected, the body is left alone
+
+                } else if (route->body_handler != NULL) {
+                    // without early routing the body was buffered, so it comes as one chunk
+                    if (!streamed) {
+                        deliver_body(route->body_handler, zrequest, req->input_buffer TSRMLS_CC);
+                    }
+
+                // without early routing a large body is spilled once it is complete
+                } else if (!streamed && spills_body(server, req, &request->headers,
+                        evbuffer_get_length(req->input_buffer))) {
+                    spill_buffered_body(request TSRMLS_CC);
+
+                // parse POST parameters, unless done while the body arrived
+                } else if (!streamed && request->req->type == EVHTTP_REQ_POST) {
+
+                    buffer_len = EVBUFFER_LENGTH(request->req->input_buffer);
+                    content_length = PHP_CAN_REQUEST_HEADER(request, CONTENT_LENGTH);
+                    if (content_length != NULL) {
+                        content_len = atol(content_length);
+                    }
+
+                    if (buffer_len > content_len) {
+                        request->response_code = 400;
+                        spprintf(&request->error, 0, "Actual POST length %ld does not match Content-Length %ld",
+                                buffer_len, content_len);
+                    } else {
+                        content_type = PHP_CAN_REQUEST_HEADER(request, CONTENT_TYPE);
+                        if (content_type != NULL) {
+                            MAKE_STD_ZVAL(request->post);
+                            array_init(request->post);
+                            if (NULL != strstr(content_type, "multipart/form-data")) {
+                                php_can_parse_multipart(content_type, request->req->input_buffer, request->post, &request->files,
+                                        server->upload_memory_threshold, route->upload_handler, zrequest TSRMLS_CC);
+                                if (route->upload_handler != NULL && EG(exception)) {
+                                    body_handler_failed(request TSRMLS_CC);
+                                }
+                            } else if (NULL != strstr(content_type, "application/x-www-form-urlencoded")) {
+                                php_can_parse_query((const char *)EVBUFFER_DATA(request->req->input_buffer), buffer_len,
+                                    PARSE_POST, request->post TSRMLS_CC);
+                            }
+                        }
+                    }
+                }
+
+                // CORS headers of the actual request
+                if (route->cors != NULL || table->cors != NULL) {
+                    php_can_server_cors_simple((struct php_can_server_cors *)zend_object_store_get_object(
+                            route->cors ? route->cors : table->cors TSRMLS_CC), req, &request->headers);
+                }
+
+                // run middlewares, any of them may answer the request itself
+                int answered = 0;
+                if (request->response_code == 0) {
+                    answered = php_can_server_middleware_before(table->middlewares, zrequest, params,
+                            &entered TSRMLS_CC);
+                    if (answered > 0) {
+                        request->response_code = answered;
+                    } else if (answered < 0 && !EG(exception) && request->status == PHP_CAN_SERVER_RESPONSE_STATUS_NONE) {
+                        // hook failed without throwing or sending anything
+                        request->response_code = 500;
+                        spprintf(&request->error, 0, "%s", "Middleware failed");
+                    }
+                }
+
+                if (request->response_code == 0 && answered == 0) {
+
+                    // call handler
+                    args[0] = zrequest;
+                    args[1] = params;
+
+                    Z_ADDREF_P(args[0]);
+                    Z_ADDREF_P(args[1]);
+
+                    if (call_user_function(EG(function_table), NULL, route->handler, &retval, 2, args TSRMLS_CC) == SUCCESS) {
+                        if (request->status == PHP_CAN_SERVER_RESPONSE_STATUS_NONE) {
+                            if (request->response_code == 0) {
+                                request->response_code = 200;
+                            }
+                            if (request->response_code >= 200 && request->response_code < 300) {
+                                if (Z_TYPE(retval) == IS_STRING) {
+                                    if (Z_STRLEN(retval) > 0) {
+                                        request->response_len = Z_STRLEN(retval);
+                                        evbuffer_add(buffer, Z_STRVAL(retval), Z_STRLEN(retval));
+                                    }
+                                } else if (Z_TYPE(retval) == IS_NULL) {
+                                    // empty response
+                                } else {
+
+                                    if (Z_TYPE(retval) == IS_OBJECT &&  instanceof_function(Z_OBJCE(retval), ce_can_HTTPForward TSRMLS_CC)) {
+
+                                        zval *url = PHP_CAN_READ_PROPERTY(&retval, "url");
+                                        zval *headers = PHP_CAN_READ_PROPERTY(&retval, "headers");
+                                        zval *callback = PHP_CAN_READ_PROPERTY(&retval, "callback");
+                                        zval *merge = PHP_CAN_READ_PROPERTY(&retval, "merge_headers");
+                                        forward_request((const char *)Z_STRVAL_P(url), zrequest, server, headers, callback, Z_BVAL_P(merge));
+
+                                    } else {
+
+                                        // JsonSerializable results and any result with ``application/json``
+                                        // Content-Type response header are JSON encoded, ``application/msgpack``
+                                        // selects MessagePack, so does the Accept header if no Content-Type is set
+                                        int format = php_can_json_serializable(&retval TSRMLS_CC) ? ENCODE_JSON : 0;
+                                        const char *contentType = evhttp_find_header(req->output_headers, "Content-Type");
+                                        if (contentType) {
+                                            if (strcmp(contentType, "application/json") == 0) {
+                                                format = ENCODE_JSON;
+                                            } else if (strcmp(contentType, "application/msgpack") == 0) {
+                                                format = ENCODE_MSGPACK;
                                             }
-                                            smart_str_free(&encoded);
-
-                                        } else if (foundHeader) {
-                                            smart_str encoded = {0};
-                                            php_json_encode(&encoded, &retval, 0 TSRMLS_CC);
-                                            request->response_len = encoded.len;
-                                            evbuffer_add(buffer, encoded.c, encoded.len);
-                                            smart_str_free(&encoded);
+                                        } else if (Z_TYPE(retval) == IS_ARRAY || Z_TYPE(retval) == IS_OBJECT) {
+                                            // Accept picked the format, caches have to key on it
+                                            php_can_server_add_vary(req->output_headers, "Accept");
+                                            if (accepts_msgpack(PHP_CAN_REQUEST_HEADER(request, ACCEPT))) {
+                                                format = ENCODE_MSGPACK;
+                                                evhttp_add_header(req->output_headers, "Content-Type", "application/msgpack");
+                                            } else if (format) {
+                                                evhttp_add_header(req->output_headers, "Content-Type", "application/json");
+                                            }
+                                        } else if (format) {
+                                            evhttp_add_header(req->output_headers, "Content-Type", "application/json");
                                         }
-    #endif
 
-                                        if (request->response_len == 0) {
+                                        if (format) {
+                                            int encoded;
+                                            if (format == ENCODE_MSGPACK) {
+                                                encoded = php_can_msgpack_encode(buffer, &retval TSRMLS_CC);
+                                                request->response_len = evbuffer_get_length(buffer);
+                                            } else if (Z_TYPE(retval) == IS_ARRAY) {
+                                                // after hooks need the whole body, so no streaming then
+                                                encoded = json_respond_array(server, zrequest, &retval, buffer,
+                                                        entered == 0 && req->type != EVHTTP_REQ_HEAD TSRMLS_CC);
+                                            } else {
+                                                encoded = php_can_json_encode(buffer, &retval TSRMLS_CC);
+                                                request->response_len = evbuffer_get_length(buffer);
+                                            }
+                                            if (encoded == FAILURE) {
+                                                evbuffer_drain(buffer, evbuffer_get_length(buffer));
+                                                request->response_len = 0;
+                                                if (!EG(exception)) {
+                                                    request->response_code = 500;
+                                                    spprintf(&request->error, 0, "Unable to encode response as %s",
+                                                            format == ENCODE_MSGPACK ? "MessagePack" : "JSON");
+                                                }
+                                            }
+                                        } else {
                                             request->response_code = 500;
                                             spprintf(&request->error, 0, "Request handler must return a string instead of %s",
                                                 Z_TYPE(retval) == IS_ARRAY ? "array" :
                                                     Z_TYPE(retval) == IS_OBJECT ? "object" :
                                                         Z_TYPE(retval) == IS_LONG ? "integer" :
                                                             Z_TYPE(retval) == IS_DOUBLE ? "double" :
-                                                                Z_TYPE(retval) == IS_BOOL ? "boolean‚" :
+                                                                Z_TYPE(retval) == IS_BOOL ? "boolean" :
                                                                     Z_TYPE(retval) == IS_RESOURCE ? "resource" : "unknown"
                                             );
                                         }
@@ -645,15 +1649,7 @@ static void request_handler(struct evhttp_request *req, void *arg)
     }
 
     if(EG(exception)) {
-        if (instanceof_function(Z_OBJCE_P(EG(exception)), ce_can_HTTPError TSRMLS_CC)) {
-
-            zval *code = NULL, *error = NULL;
-            code  = zend_read_property(Z_OBJCE_P(EG(exception)), EG(exception), "code", sizeof("code")-1, 1 TSRMLS_CC);
-            error = zend_read_property(Z_OBJCE_P(EG(exception)), EG(exception), "message", sizeof("message")-1, 1 TSRMLS_CC);
-            request->response_code = code ? Z_LVAL_P(code) : 500;
-            spprintf(&request->error, 0, "%s", error ? Z_STRVAL_P(error) : "Unknown");
-
-        } else if (instanceof_function(Z_OBJCE_P(EG(exception)), ce_can_HTTPForward TSRMLS_CC)) {
+        if (instanceof_function(Z_OBJCE_P(EG(exception)), ce_can_HTTPForward TSRMLS_CC)) {
 
             zval *url = zend_read_property(Z_OBJCE_P(EG(exception)), EG(exception),
                     "url", sizeof("url")-1, 1 TSRMLS_CC);
@@ -664,30 +1660,41 @@ static void request_handler(struct evhttp_request *req, void *arg)
             zval *merge = zend_read_property(Z_OBJCE_P(EG(exception)), EG(exception),
                 "merge_headers", sizeof("merge_headers")-1, 1 TSRMLS_CC);
             forward_request((const char *)Z_STRVAL_P(url), zrequest, server, headers, callback, Z_BVAL_P(merge));
+            zend_clear_exception(TSRMLS_C);
 
         } else {
-            zval *file = NULL, *line = NULL, *error = NULL;
-            file = zend_read_property(Z_OBJCE_P(EG(exception)), EG(exception), "file", sizeof("file")-1, 1 TSRMLS_CC);
-            line = zend_read_property(Z_OBJCE_P(EG(exception)), EG(exception), "line", sizeof("line")-1, 1 TSRMLS_CC);
-            error = zend_read_property(Z_OBJCE_P(EG(exception)), EG(exception), "message", sizeof("message")-1, 1 TSRMLS_CC);
+            exception_status(request, "request handler" TSRMLS_CC);
+        }
+    }
+
+    if (entered > 0 && request->status == PHP_CAN_SERVER_RESPONSE_STATUS_NONE) {
+        // let after hooks see the whole response body
+        evbuffer_add_buffer(req->output_buffer, buffer);
+        php_can_server_middleware_after(table->middlewares, entered, zrequest TSRMLS_CC);
+        if (EG(exception)) {
             request->response_code = 500;
-            spprintf(&request->error, 0, "Uncaught exception '%s' within request handler thrown in %s on line %d \"%s\"",
-                    Z_OBJCE_P(EG(exception))->name,
-                    file ? Z_STRVAL_P(file) : NULL,
-                    line ? (int)Z_LVAL_P(line) : 0,
-                    error ? Z_STRVAL_P(error) : ""
-            );
+            if (request->error) {
+                efree(request->error);
+            }
+            spprintf(&request->error, 0, "Uncaught exception '%s' within middleware",
+                    Z_OBJCE_P(EG(exception))->name);
+            zend_clear_exception(TSRMLS_C);
         }
-        zend_clear_exception(TSRMLS_C);
+    }
+
+    if (table != NULL) {
+        php_can_server_router_table_release(table TSRMLS_CC);
     }
 
     int write_log = 0;
     if (request->status == PHP_CAN_SERVER_RESPONSE_STATUS_NONE) {
         // send response
+        compress_response(request, buffer);
         evhttp_send_reply(request->req, request->response_code, NULL, buffer);
         write_log = 1;
     } else if (request->status == PHP_CAN_SERVER_RESPONSE_STATUS_SENDING) {
         // stop sending unfinished chunk response
+        php_can_server_compress_end(request);
         evhttp_send_reply_end(request->req);
         write_log = 1;
     } else if (request->status == PHP_CAN_SERVER_RESPONSE_STATUS_SENT) {
@@ -706,6 +1713,27 @@ static void request_handler(struct evhttp_request *req, void *arg)
     zval_ptr_dtor(&zrequest);
 }
 
+/**
+ * Use router for subsequent requests, routes added to the router
+ * since its last commit are compiled before the switch
+ */
+static void set_router(struct php_can_server *server, zval *zrouter TSRMLS_DC)
+{
+    struct php_can_server_router *router = (struct php_can_server_router*)
+        zend_object_store_get_object(zrouter TSRMLS_CC);
+
+    if (router->routes != NULL && (router->dirty || router->table == NULL)) {
+        php_can_server_router_commit(router TSRMLS_CC);
+    }
+
+    zval *old = server->router;
+    zval_add_ref(&zrouter);
+    server->router = zrouter;
+    if (old) {
+        zval_ptr_dtor(&old);
+    }
+}
+
 /**
  * Constructor
  *
@@ -769,8 +1797,18 @@ static PHP_METHOD(CanServer, __construct)
         EVHTTP_REQ_PATCH
     );
 
-    // set timeout to a reasonably short value for performance
-    evhttp_set_timeout(server->http, 10);
+    // set timeouts to a reasonably short value for performance
+    server->header_timeout = server->body_timeout = server->keepalive_timeout = 10;
+    evhttp_set_timeout(server->http, server->header_timeout);
+
+    // keep the hot files of sendFile() open
+    server->file_cache.max_entries = 128;
+    server->file_cache.revalidate = 2;
+
+#ifdef HAVE_EVHTTP_SET_NEWREQCB
+    // route requests as soon as the headers are in to stream their body
+    evhttp_set_newreqcb(server->http, new_request, server);
+#endif
 
     server->addr = estrndup(Z_STRVAL_P(addr), Z_STRLEN_P(addr));
     server->port = Z_LVAL_P(port);
@@ -830,13 +1868,317 @@ static PHP_METHOD(CanServer, start)
     struct php_can_server *server = (struct php_can_server*)
         zend_object_store_get_object(getThis() TSRMLS_CC);
 
-    zval_add_ref(&zrouter);
-    server->router = zrouter;
+    set_router(server, zrouter TSRMLS_CC);
     server->running = 1;
 
     evhttp_set_gencb(server->http, request_handler, (void*)server);
 
+    active_server = server;
     event_base_dispatch(CAN_G(can_event_base));
+    active_server = NULL;
+}
+
+/**
+ * Replace the router, takes effect with the next request
+ */
+static PHP_METHOD(CanServer, setRouter)
+{
+    zval *zrouter = NULL;
+
+    if (FAILURE == zend_parse_parameters_ex(ZEND_PARSE_PARAMS_QUIET, ZEND_NUM_ARGS() TSRMLS_CC,
+            "O", &zrouter, ce_can_server_router)) {
+        zchar *space, *class_name = get_active_class_name(&space TSRMLS_CC);
+        php_can_throw_exception(
+            ce_can_InvalidParametersException TSRMLS_CC,
+            "%s%s%s(Router $router)",
+            class_name, space, get_active_function_name(TSRMLS_C)
+        );
+        return;
+    }
+
+    struct php_can_server *server = (struct php_can_server*)
+        zend_object_store_get_object(getThis() TSRMLS_CC);
+
+    set_router(server, zrouter TSRMLS_CC);
+}
+
+/**
+ * Write request bodies larger than the given number of bytes to a
+ * temporary file exposed as Request::$bodyFile, 0 disables it
+ */
+static PHP_METHOD(CanServer, setBodyFileThreshold)
+{
+    long threshold = 0;
+
+    if (FAILURE == zend_parse_parameters_ex(ZEND_PARSE_PARAMS_QUIET, ZEND_NUM_ARGS() TSRMLS_CC,
+            "l", &threshold) || threshold < 0) {
+        zchar *space, *class_name = get_active_class_name(&space TSRMLS_CC);
+        php_can_throw_exception(
+            ce_can_InvalidParametersException TSRMLS_CC,
+            "%s%s%s(int $bytes)",
+            class_name, space, get_active_function_name(TSRMLS_C)
+        );
+        return;
+    }
+
+    struct php_can_server *server = (struct php_can_server*)
+        zend_object_store_get_object(getThis() TSRMLS_CC);
+
+    server->body_file_threshold = threshold;
+}
+
+/**
+ * Keep uploaded files up to the given number of bytes in memory, they
+ * are passed as the content key of Request::$files then. 0 disables it.
+ */
+static PHP_METHOD(CanServer, setUploadMemoryThreshold)
+{
+    long threshold = 0;
+
+    if (FAILURE == zend_parse_parameters_ex(ZEND_PARSE_PARAMS_QUIET, ZEND_NUM_ARGS() TSRMLS_CC,
+            "l", &threshold) || threshold < 0) {
+        zchar *space, *class_name = get_active_class_name(&space TSRMLS_CC);
+        php_can_throw_exception(
+            ce_can_InvalidParametersException TSRMLS_CC,
+            "%s%s%s(int $bytes)",
+            class_name, space, get_active_function_name(TSRMLS_C)
+        );
+        return;
+    }
+
+    struct php_can_server *server = (struct php_can_server*)
+        zend_object_store_get_object(getThis() TSRMLS_CC);
+
+    server->upload_memory_threshold = threshold;
+}
+
+/**
+ * Limit the header block and the body of requests in bytes, 0 for no
+ * limit. Larger requests are refused with 431 and 413 before they are
+ * read completely.
+ */
+static PHP_METHOD(CanServer, setLimits)
+{
+    long max_header_size = 0, max_body_size = 0;
+
+    if (FAILURE == zend_parse_parameters_ex(ZEND_PARSE_PARAMS_QUIET, ZEND_NUM_ARGS() TSRMLS_CC,
+            "ll", &max_header_size, &max_body_size) || max_header_size < 0 || max_body_size < 0) {
+        zchar *space, *class_name = get_active_class_name(&space TSRMLS_CC);
+        php_can_throw_exception(
+            ce_can_InvalidParametersException TSRMLS_CC,
+            "%s%s%s(int $maxHeaderSize, int $maxBodySize)",
+            class_name, space, get_active_function_name(TSRMLS_C)
+        );
+        return;
+    }
+
+    struct php_can_server *server = (struct php_can_server*)
+        zend_object_store_get_object(getThis() TSRMLS_CC);
+
+    server->max_header_size = max_header_size;
+    server->max_body_size = max_body_size;
+    if (server->http != NULL) {
+        evhttp_set_max_headers_size(server->http, unlimited(max_header_size));
+        evhttp_set_max_body_size(server->http, unlimited(max_body_size));
+    }
+}
+
+/**
+ * Set the seconds a connection may stay idle while the headers of its
+ * first request are read, while a body is read and between requests
+ * of a connection kept alive. All default to 10.
+ */
+static PHP_METHOD(CanServer, setTimeouts)
+{
+    long header_timeout = 0, body_timeout = 0, keepalive_timeout = 0;
+
+    if (FAILURE == zend_parse_parameters_ex(ZEND_PARSE_PARAMS_QUIET, ZEND_NUM_ARGS() TSRMLS_CC,
+            "lll", &header_timeout, &body_timeout, &keepalive_timeout)
+            || header_timeout <= 0 || body_timeout <= 0 || keepalive_timeout <= 0) {
+        zchar *space, *class_name = get_active_class_name(&space TSRMLS_CC);
+        php_can_throw_exception(
+            ce_can_InvalidParametersException TSRMLS_CC,
+            "%s%s%s(int $headerTimeout, int $bodyTimeout, int $keepAliveTimeout)",
+            class_name, space, get_active_function_name(TSRMLS_C)
+        );
+        return;
+    }
+
+    struct php_can_server *server = (struct php_can_server*)
+        zend_object_store_get_object(getThis() TSRMLS_CC);
+
+    server->header_timeout = (int)header_timeout;
+    server->body_timeout = (int)body_timeout;
+    server->keepalive_timeout = (int)keepalive_timeout;
+    if (server->http != NULL) {
+        evhttp_set_timeout(server->http, server->header_timeout);
+    }
+}
+
+/**
+ * Compress responses of clients accepting gzip or deflate with the
+ * given zlib level, 0 disables it. Buffered responses smaller than
+ * $minSize bytes are sent as they are. $types lists the media types
+ * compressed, text/* stands for all text types.
+ */
+static PHP_METHOD(CanServer, setCompression)
+{
+    long level = 0, min_size = 1024;
+    zval *types = NULL;
+
+    if (FAILURE == zend_parse_parameters_ex(ZEND_PARSE_PARAMS_QUIET, ZEND_NUM_ARGS() TSRMLS_CC,
+            "l|la!", &level, &min_size, &types) || level < 0 || level > 9 || min_size < 0) {
+        zchar *space, *class_name = get_active_class_name(&space TSRMLS_CC);
+        php_can_throw_exception(
+            ce_can_InvalidParametersException TSRMLS_CC,
+            "%s%s%s(int $level[, int $minSize[, array $types]])",
+            class_name, space, get_active_function_name(TSRMLS_C)
+        );
+        return;
+    }
+
+    struct php_can_server *server = (struct php_can_server*)
+        zend_object_store_get_object(getThis() TSRMLS_CC);
+
+    if (server->compression.types) {
+        zend_hash_destroy(server->compression.types);
+        FREE_HASHTABLE(server->compression.types);
+    }
+    server->compression.level = (int)level;
+    server->compression.min_size = min_size;
+    server->compression.types = php_can_compress_types(types TSRMLS_CC);
+}
+
+/**
+ * Keep up to $entries files served by sendFile() open together with
+ * their metadata, 0 disables it. A cached file is checked for changes
+ * when it was last checked $revalidate seconds ago or earlier. Defaults
+ * to 128 files checked every 2 seconds.
+ */
+static PHP_METHOD(CanServer, setFileCache)
+{
+    long entries = 0, revalidate = 2;
+
+    if (FAILURE == zend_parse_parameters_ex(ZEND_PARSE_PARAMS_QUIET, ZEND_NUM_ARGS() TSRMLS_CC,
+            "l|l", &entries, &revalidate) || entries < 0 || revalidate < 0) {
+        zchar *space, *class_name = get_active_class_name(&space TSRMLS_CC);
+        php_can_throw_exception(
+            ce_can_InvalidParametersException TSRMLS_CC,
+            "%s%s%s(int $entries[, int $revalidate])",
+            class_name, space, get_active_function_name(TSRMLS_C)
+        );
+        return;
+    }
+
+    struct php_can_server *server = (struct php_can_server*)
+        zend_object_store_get_object(getThis() TSRMLS_CC);
+
+    server->file_cache.max_entries = entries;
+    server->file_cache.revalidate = revalidate;
+    php_can_server_file_cache_trim(&server->file_cache, entries);
+}
+
+/**
+ * Add the address or prefix passed to the allow or deny list
+ */
+static void access_list_add(INTERNAL_FUNCTION_PARAMETERS, int verdict)
+{
+    char *cidr;
+    int cidr_len;
+
+    if (FAILURE == zend_parse_parameters_ex(ZEND_PARSE_PARAMS_QUIET, ZEND_NUM_ARGS() TSRMLS_CC,
+            "s", &cidr, &cidr_len)) {
+        zchar *space, *class_name = get_active_class_name(&space TSRMLS_CC);
+        php_can_throw_exception(
+            ce_can_InvalidParametersException TSRMLS_CC,
+            "%s%s%s(string $cidr)",
+            class_name, space, get_active_function_name(TSRMLS_C)
+        );
+        return;
+    }
+
+    struct php_can_server *server = (struct php_can_server*)
+        zend_object_store_get_object(getThis() TSRMLS_CC);
+
+    if (FAILURE == php_can_server_access_add(&server->access, cidr, verdict)) {
+        php_can_throw_exception(
+            ce_can_InvalidParametersException TSRMLS_CC,
+            "Invalid address or CIDR prefix '%s'",
+            cidr
+        );
+    }
+}
+
+/**
+ * Admit clients of an address or CIDR prefix like 10.0.0.0/8, once any
+ * is allowed clients matching none are refused. The longest matching
+ * prefix of the allow and deny lists decides.
+ */
+static PHP_METHOD(CanServer, allow)
+{
+    access_list_add(INTERNAL_FUNCTION_PARAM_PASSTHRU, PHP_CAN_SERVER_ACCESS_ALLOW);
+}
+
+/**
+ * Refuse clients of an address or CIDR prefix, their connections are
+ * closed before the request is read
+ */
+static PHP_METHOD(CanServer, deny)
+{
+    access_list_add(INTERNAL_FUNCTION_PARAM_PASSTHRU, PHP_CAN_SERVER_ACCESS_DENY);
+}
+
+/**
+ * Limit the open connections of a client address, further connections
+ * are closed before the request is read. 0 disables the cap.
+ */
+static PHP_METHOD(CanServer, setMaxConnectionsPerIp)
+{
+    long max = 0;
+
+    if (FAILURE == zend_parse_parameters_ex(ZEND_PARSE_PARAMS_QUIET, ZEND_NUM_ARGS() TSRMLS_CC,
+            "l", &max) || max < 0) {
+        zchar *space, *class_name = get_active_class_name(&space TSRMLS_CC);
+        php_can_throw_exception(
+            ce_can_InvalidParametersException TSRMLS_CC,
+            "%s%s%s(int $connections)",
+            class_name, space, get_active_function_name(TSRMLS_C)
+        );
+        return;
+    }
+
+    struct php_can_server *server = (struct php_can_server*)
+        zend_object_store_get_object(getThis() TSRMLS_CC);
+
+    server->access.max_per_ip = max;
+}
+
+/**
+ * Get the open connections, the clients having any open and the
+ * connections refused by the access lists and by the connection cap
+ */
+static PHP_METHOD(CanServer, getConnectionStats)
+{
+    if (FAILURE == zend_parse_parameters_ex(ZEND_PARSE_PARAMS_QUIET, ZEND_NUM_ARGS() TSRMLS_CC, "")) {
+        zchar *space, *class_name = get_active_class_name(&space TSRMLS_CC);
+        php_can_throw_exception(
+            ce_can_InvalidParametersException TSRMLS_CC,
+            "%s%s%s(void)",
+            class_name, space, get_active_function_name(TSRMLS_C)
+        );
+        return;
+    }
+
+    struct php_can_server *server = (struct php_can_server*)
+        zend_object_store_get_object(getThis() TSRMLS_CC);
+
+    array_init(return_value);
+    add_assoc_long(return_value, "connections",
+            server->access.connections ? zend_hash_num_elements(server->access.connections) : 0);
+    add_assoc_long(return_value, "clients",
+            server->access.clients ? zend_hash_num_elements(server->access.clients) : 0);
+    add_assoc_long(return_value, "denied", server->access.denied);
+    add_assoc_long(return_value, "capped", server->access.capped);
 }
 
 /**
@@ -875,9 +2217,20 @@ static PHP_METHOD(CanServer, stop)
 }
 
 static zend_function_entry server_methods[] = {
-    PHP_ME(CanServer, __construct, NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
-    PHP_ME(CanServer, start,       NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
-    PHP_ME(CanServer, stop,        NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
+    PHP_ME(CanServer, __construct,              NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
+    PHP_ME(CanServer, start,                    NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
+    PHP_ME(CanServer, setRouter,                NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
+    PHP_ME(CanServer, setBodyFileThreshold,     NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
+    PHP_ME(CanServer, setUploadMemoryThreshold, NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
+    PHP_ME(CanServer, setLimits,                NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
+    PHP_ME(CanServer, setTimeouts,              NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
+    PHP_ME(CanServer, setCompression,           NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
+    PHP_ME(CanServer, setFileCache,             NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
+    PHP_ME(CanServer, allow,                    NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
+    PHP_ME(CanServer, deny,                     NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
+    PHP_ME(CanServer, setMaxConnectionsPerIp,   NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
+    PHP_ME(CanServer, getConnectionStats,       NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
+    PHP_ME(CanServer, stop,                     NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
     {NULL, NULL, NULL}
 };
 
@@ -42,10 +42,16 @@
 
 #define PHP_CAN_SERVER_NAME "PHP Can HTTP Server"
 
-#define PHP_CAN_SERVER_RESPONSE_STATUS_NONE    0
-#define PHP_CAN_SERVER_RESPONSE_STATUS_SENDING 1
-#define PHP_CAN_SERVER_RESPONSE_STATUS_SENT    2
-#define PHP_CAN_SERVER_RESPONSE_STATUS_FORWARD 3
+struct evbuffer;
+struct evhttp_request;
+struct evhttp_connection;
+struct evkeyvalq;
+
+#define PHP_CAN_SERVER_RESPONSE_STATUS_NONE      0
+#define PHP_CAN_SERVER_RESPONSE_STATUS_SENDING   1
+#define PHP_CAN_SERVER_RESPONSE_STATUS_SENT      2
+#define PHP_CAN_SERVER_RESPONSE_STATUS_FORWARD   3
+#define PHP_CAN_SERVER_RESPONSE_STATUS_STREAMING 4
 
 #define PHP_CAN_SERVER_ROUTE_METHOD_GET        1
 #define PHP_CAN_SERVER_ROUTE_METHOD_POST       2
@@ -58,6 +64,56 @@
 #define PHP_CAN_SERVER_ROUTE_METHOD_PATCH     256
 #define PHP_CAN_SERVER_ROUTE_METHOD_ALL       511
 
+/* number of distinct HTTP methods, one bit each in the methods mask */
+#define PHP_CAN_SERVER_ROUTE_METHODS           9
+
+/* offset vector entries kept on the stack when matching a route, 15 groups */
+#define PHP_CAN_SERVER_ROUTE_OVECTOR_SIZE      48
+
+/* number of dynamic lookups between two reorderings of a method list */
+#define PHP_CAN_SERVER_ROUTER_REORDER_INTERVAL 1024
+
+/* longest client key kept by the rate limiter, including the NUL */
+#define PHP_CAN_SERVER_RATELIMIT_KEY_SIZE      48
+
+/* rate limiter slots probed for a client before evicting the oldest */
+#define PHP_CAN_SERVER_RATELIMIT_PROBES        8
+
+/* largest number of clients a rate limiter tracks */
+#define PHP_CAN_SERVER_RATELIMIT_MAX_CAPACITY  (1L << 24)
+
+/* default nesting limit of decoded JSON request bodies */
+#define PHP_CAN_SERVER_JSON_DEPTH              512
+
+/* encoded JSON handed to the connection at once while streaming */
+#define PHP_CAN_SERVER_JSON_CHUNK_SIZE         65536
+
+/* request headers looked up internally through the header index */
+enum php_can_server_header {
+    PHP_CAN_HEADER_ACCEPT,
+    PHP_CAN_HEADER_ACCEPT_ENCODING,
+    PHP_CAN_HEADER_ACCESS_CONTROL_REQUEST_HEADERS,
+    PHP_CAN_HEADER_ACCESS_CONTROL_REQUEST_METHOD,
+    PHP_CAN_HEADER_AUTHORIZATION,
+    PHP_CAN_HEADER_CONNECTION,
+    PHP_CAN_HEADER_CONTENT_LENGTH,
+    PHP_CAN_HEADER_CONTENT_TYPE,
+    PHP_CAN_HEADER_COOKIE,
+    PHP_CAN_HEADER_HOST,
+    PHP_CAN_HEADER_IF_MODIFIED_SINCE,
+    PHP_CAN_HEADER_IF_NONE_MATCH,
+    PHP_CAN_HEADER_ORIGIN,
+    PHP_CAN_HEADER_RANGE,
+    PHP_CAN_HEADER_SEC_WEBSOCKET_KEY,
+    PHP_CAN_HEADER_SEC_WEBSOCKET_KEY1,
+    PHP_CAN_HEADER_SEC_WEBSOCKET_KEY2,
+    PHP_CAN_HEADER_SEC_WEBSOCKET_ORIGIN,
+    PHP_CAN_HEADER_SEC_WEBSOCKET_PROTOCOL,
+    PHP_CAN_HEADER_SEC_WEBSOCKET_VERSION,
+    PHP_CAN_HEADER_UPGRADE,
+    PHP_CAN_HEADER_COUNT
+};
+
 #ifndef IS_PATH
 #define IS_PATH 99
 #endif
@@ -86,6 +142,97 @@ extern zend_class_entry *ce_can_server_route;
 extern zend_class_entry *ce_can_server_websocket_route;
 extern zend_class_entry *ce_can_server_websocket_ctx;
 extern zend_class_entry *ce_can_server_router;
+extern zend_class_entry *ce_can_server_middleware;
+extern zend_class_entry *ce_can_server_ratelimit;
+extern zend_class_entry *ce_can_server_cors;
+
+#define PHP_CAN_COMPRESS_GZIP    1
+#define PHP_CAN_COMPRESS_DEFLATE 2
+
+struct php_can_compress;
+
+struct php_can_server_compression {
+    /**
+     * zlib level of compressed responses, 0 disables compression
+     */
+    int level;
+    /**
+     * Smallest response compressed, chunked responses always are
+     */
+    long min_size;
+    /**
+     * Lowercased media types compressed, like text/* for a major type
+     */
+    HashTable *types;
+};
+
+/**
+ * Open file of sendFile() with the metadata its responses are built from
+ */
+struct php_can_server_file {
+    char *path;
+    int path_len;
+    int fd;
+    struct stat st;
+    char *etag;
+    int etag_len;
+    /**
+     * Last-Modified and detected Content-Type, set on first use
+     */
+    char *last_modified;
+    char *mimetype;
+    time_t checked;
+    int refcount;
+    struct php_can_server_file *prev;
+    struct php_can_server_file *next;
+};
+
+struct php_can_server_file_cache {
+    /**
+     * Files kept open, 0 disables the cache
+     */
+    long max_entries;
+    /**
+     * Seconds a file is served before it is checked for changes again
+     */
+    long revalidate;
+    /**
+     * Cached files by resolved path, and the same files most recently
+     * used first
+     */
+    HashTable *entries;
+    struct php_can_server_file *head;
+    struct php_can_server_file *tail;
+};
+
+#define PHP_CAN_SERVER_ACCESS_ALLOW 1
+#define PHP_CAN_SERVER_ACCESS_DENY  2
+
+struct php_can_server_cidr_node {
+    struct php_can_server_cidr_node *child[2];
+    int verdict;
+};
+
+struct php_can_server_access {
+    /**
+     * Prefix tries of the allow and deny lists, per address family
+     */
+    struct php_can_server_cidr_node *v4;
+    struct php_can_server_cidr_node *v6;
+    long allows;
+    /**
+     * Open connections per client address allowed, 0 for no cap
+     */
+    long max_per_ip;
+    /**
+     * Open connections by client address, and client address of each
+     * open connection by connection pointer
+     */
+    HashTable *clients;
+    HashTable *connections;
+    long denied;
+    long capped;
+};
 
 struct php_can_server {
     zend_object std;
@@ -98,6 +245,36 @@ struct php_can_server {
     int port;
     int running;
     zval *router;
+    /**
+     * Requests routed on arrival of their headers, by request pointer
+     */
+    HashTable *pending;
+    /**
+     * Request bodies larger than this go to a temporary file, 0 keeps all in memory
+     */
+    long body_file_threshold;
+    /**
+     * Uploaded files up to this size are kept in memory, 0 writes all to disk
+     */
+    long upload_memory_threshold;
+    /**
+     * Largest header block and body accepted, 0 for no limit
+     */
+    long max_header_size;
+    long max_body_size;
+    /**
+     * Seconds a connection may stay idle while the headers or the body
+     * of a request are read, or between requests
+     */
+    int header_timeout;
+    int body_timeout;
+    int keepalive_timeout;
+    /**
+     * Allow and deny lists and connection counts of the clients
+     */
+    struct php_can_server_access access;
+    struct php_can_server_compression compression;
+    struct php_can_server_file_cache file_cache;
 };
 
 struct php_can_server_request {
@@ -115,6 +292,40 @@ struct php_can_server_request {
     char *error;
     char *uri;
     char *query;
+    /**
+     * Input headers by lowercased name, built on the first lookup
+     */
+    HashTable *headers;
+    /**
+     * Decoded JSON request body, set on the first access
+     */
+    zval *json;
+    zend_bool json_assoc;
+    /**
+     * Decoded MessagePack request body, set on the first access
+     */
+    zval *msgpack;
+    /**
+     * Request body spilled to a temporary file
+     */
+    zval *body_file;
+    /**
+     * Response compression settings of the server, and the encoder of
+     * a chunked response being compressed
+     */
+    struct php_can_server_compression *compression;
+    struct php_can_compress *compress;
+    /**
+     * Open files of the server served by sendFile()
+     */
+    struct php_can_server_file_cache *file_cache;
+};
+
+struct php_can_server_route_param {
+    char *name;
+    int  name_len;
+    int  group;
+    int  cast;
 };
 
 struct php_can_server_route {
@@ -125,15 +336,76 @@ struct php_can_server_route {
     zval *handler;
     int  methods;
     zval *casts;
+    /**
+     * Named groups of the regexp in group order with the cast to apply,
+     * resolved from the PCRE name table on the first match
+     */
+    struct php_can_server_route_param *params;
+    int  params_len;
+    int  capture_count;
+    zend_bool plan_resolved;
+    /**
+     * Rate limit of the route, routes sharing one limit share the buckets
+     */
+    zval *ratelimit;
+    /**
+     * CORS policy of the route, overrides the router policy
+     */
+    zval *cors;
+    /**
+     * Callback receiving the request body chunk by chunk, the body is
+     * not buffered for routes having one
+     */
+    zval *body_handler;
+    /**
+     * Callback or stream receiving uploaded files part by part, the
+     * files are not written to temporary files for routes having one
+     */
+    zval *upload_handler;
+    /**
+     * Hook checking the request on its headers before the body is read
+     */
+    zval *before_body;
+    /**
+     * Limits overriding those of the server, 0 to inherit
+     */
+    long max_header_size;
+    long max_body_size;
+    int body_timeout;
 };
 
-struct php_can_server_router {
-    zend_object std;
-    zval refhandle;
-    long pos;
+struct php_can_server_router_entry {
+    struct php_can_server_route *route;
+    char *uri;
+    char *regexp;
+    int  regexp_len;
+    long index;
+    long hits;
     /**
-     * Container for all routes, one domension array
-     * where key is route index and value is a route instance
+     * Indexes of routes whose patterns may match the same path,
+     * the relative order of those must never change
+     */
+    long *conflicts;
+    int  conflicts_len;
+};
+
+struct php_can_server_router_dynamic {
+    struct php_can_server_router_entry *entries;
+    int  len;
+    int  size;
+    long lookups;
+};
+
+/**
+ * Compiled routing table, built off to the side by Router::commit()
+ * and swapped in as a whole. It is reference counted, so a request
+ * which is in flight keeps using the table it was dispatched with.
+ */
+struct php_can_server_router_table {
+    int refcount;
+    /**
+     * Snapshot of the router routes at commit time,
+     * key is route index and value is a route instance
      */
     zval *routes;
     /**
@@ -149,12 +421,129 @@ struct php_can_server_router {
     zval *method_routes;
     /**
      * Container where we will search through for the routes
-     * in case we cannot find the route in router->method_routes
+     * in case we cannot find the route in table->method_routes
      * Actually the search through this container will be made only
      * to determine what kind of error response code we must send
      * back to the client: 404 Not Found or 405 Method Not Allowed
      */
     zval *route_methods;
+    /**
+     * Dynamic (regexp) routes per HTTP method in match order.
+     * Every PHP_CAN_SERVER_ROUTER_REORDER_INTERVAL lookups the list
+     * is reordered by hit count, hottest first, as long as routes
+     * which may match the same path keep their registration order
+     */
+    struct php_can_server_router_dynamic dynamic[PHP_CAN_SERVER_ROUTE_METHODS];
+    /**
+     * Per host tables, only set on the root table. Exact host names
+     * are stored as is, wildcard patterns like *.example.com are
+     * stored by their suffix "example.com"
+     */
+    HashTable *hosts;
+    HashTable *wildcards;
+    /**
+     * Snapshot of the router middlewares at commit time, run in order
+     * before and in reverse order after the route handler
+     */
+    zval *middlewares;
+    /**
+     * Router wide rate limit and CORS policy, only set on the root table
+     */
+    zval *ratelimit;
+    zval *cors;
+};
+
+struct php_can_server_router {
+    zend_object std;
+    zval refhandle;
+    long pos;
+    /**
+     * Container for all routes, one domension array
+     * where key is route index and value is a route instance
+     */
+    zval *routes;
+    /**
+     * Host pattern per route index for host bound routes
+     */
+    zval *route_hosts;
+    /**
+     * Routing table currently used to dispatch requests
+     */
+    struct php_can_server_router_table *table;
+    /**
+     * Middleware instances in registration order
+     */
+    zval *middlewares;
+    /**
+     * Rate limit applied to all routes
+     */
+    zval *ratelimit;
+    /**
+     * CORS policy of routes without an own one
+     */
+    zval *cors;
+    /**
+     * Routes or middlewares were added since the last commit
+     */
+    int dirty;
+};
+
+struct php_can_server_middleware {
+    zend_object std;
+    zval refhandle;
+    /**
+     * Native hooks of the built-in middlewares. before returns 0 to
+     * continue or a HTTP status code to respond with right away
+     */
+    int  (*before)(struct php_can_server_middleware *middleware, struct php_can_server_request *request TSRMLS_DC);
+    void (*after)(struct php_can_server_middleware *middleware, struct php_can_server_request *request TSRMLS_DC);
+    void (*free)(void *data TSRMLS_DC);
+    void *data;
+    /**
+     * PHP hooks of user middlewares
+     */
+    zval *before_cb;
+    zval *after_cb;
+};
+
+struct php_can_server_ratelimit_bucket {
+    ulong  hash;
+    double tokens;
+    double last;
+    char   key[PHP_CAN_SERVER_RATELIMIT_KEY_SIZE];
+};
+
+struct php_can_server_ratelimit {
+    zend_object std;
+    zval refhandle;
+    double rate;
+    double burst;
+    /**
+     * Request header identifying the client, remote address if NULL
+     */
+    char *header;
+    int  header_len;
+    struct php_can_server_ratelimit_bucket *buckets;
+    ulong mask;
+};
+
+struct php_can_server_cors {
+    zend_object std;
+    zval refhandle;
+    /**
+     * Lowercased allowed origins and request headers, NULL allows any
+     */
+    HashTable *origins;
+    HashTable *headers;
+    int methods;
+    zend_bool credentials;
+    /**
+     * Precomputed response header values
+     */
+    char *allow_methods;
+    char *allow_headers;
+    char *expose_headers;
+    char *max_age;
 };
 
 struct php_can_server_logentry {
@@ -179,6 +568,54 @@ struct php_can_client_ctx {
     struct evhttp_connection *evcon;
 };
 
+/**
+ * Request routed as soon as its headers arrived, handed over to the
+ * request handler once the body is complete
+ */
+struct php_can_multipart;
+
+struct php_can_server_pending {
+    struct evhttp_request *req;
+    /**
+     * Connection of the request, libevent forgets it when the request
+     * fails before its body is complete
+     */
+    struct evhttp_connection *evcon;
+    struct php_can_server_router_table *table;
+    zval *zroute;
+    zval *params;
+    zval *zrequest;
+    HashTable *headers;
+    double time;
+    int status;
+    /**
+     * Temporary file the body is written to, -1 if none
+     */
+    int body_fd;
+    char *body_file;
+    long body_size;
+    /**
+     * Parser of a multipart body fed as it arrives
+     */
+    struct php_can_multipart *multipart;
+    /**
+     * Whether the body is taken while it arrives, requests kept only
+     * for their beforeBody hook are buffered as usual
+     */
+    int streaming;
+};
+
+struct php_can_json_stream_ctx {
+    long request_id;
+    zval *zrequest;
+    zval *value;
+    HashPosition pos;
+    int object;
+    int first;
+    struct php_can_server *server;
+    struct evhttp_connection *evcon;
+};
+
 struct php_can_websocket_ctx {
     zend_object std;
     zval refhandle;
@@ -191,6 +628,9 @@ struct php_can_websocket_ctx {
     zval *data;
 };
 
+#define PHP_CAN_REQUEST_HEADER(request, id) \
+    php_can_server_header(&(request)->headers, (request)->req->input_headers, PHP_CAN_HEADER_##id)
+
 #define SETNOW(double_now) \
     double_now = 0.0;  struct timeval __tpnow = {0}; \
     if(gettimeofday(&__tpnow, NULL) == 0 ) \
@@ -269,6 +709,65 @@ struct php_can_websocket_ctx {
     efree(logentry->error); \
     efree(logentry);
 
+void php_can_server_route_compile(struct php_can_server_route *route, const char *uri, int uri_len TSRMLS_DC);
+void php_can_server_route_resolve_plan(struct php_can_server_route *route, pcre_cache_entry *pce TSRMLS_DC);
+void php_can_server_route_free(struct php_can_server_route *route TSRMLS_DC);
+int php_can_server_router_match(struct php_can_server_router_table *table, int type,
+        const char *host, const char *path, zval ***zroute, zval *params TSRMLS_DC);
+struct php_can_server_router_table *php_can_server_router_commit(struct php_can_server_router *router TSRMLS_DC);
+void php_can_server_router_table_release(struct php_can_server_router_table *table TSRMLS_DC);
+int php_can_server_middleware_before(zval *middlewares, zval *zrequest, zval *params, int *entered TSRMLS_DC);
+void php_can_server_middleware_after(zval *middlewares, int entered, zval *zrequest TSRMLS_DC);
+const char *php_can_server_header(HashTable **index, struct evkeyvalq *headers, int id);
+const char *php_can_server_find_header(HashTable **index, struct evkeyvalq *headers, const char *name, int name_len);
+void php_can_server_header_index_free(HashTable **index);
+void php_can_server_add_vary(struct evkeyvalq *headers, const char *field);
+int php_can_server_access_add(struct php_can_server_access *access, const char *cidr, int verdict);
+int php_can_server_access_open(struct php_can_server_access *access, struct evhttp_connection *evcon);
+void php_can_server_access_close(struct php_can_server_access *access, struct evhttp_connection *evcon);
+void php_can_server_access_free(struct php_can_server_access *access);
+void php_can_server_connection_closed(struct evhttp_connection *evcon);
+HashTable *php_can_compress_types(zval *types TSRMLS_DC);
+double php_can_compress_qvalue(const char *accept, const char *coding);
+int php_can_compress_negotiate(const char *accept);
+struct php_can_compress *php_can_compress_new(int encoding, int level);
+int php_can_compress_data(struct php_can_compress *c, struct evbuffer *in, struct evbuffer *out, int flush);
+void php_can_compress_free(struct php_can_compress *c);
+struct php_can_compress *php_can_server_compress_start(struct php_can_server_compression *cfg,
+        struct evhttp_request *req, HashTable **headers, long code, long len);
+void php_can_server_compress_chunk(struct php_can_server_request *request, struct evbuffer *buffer);
+void php_can_server_compress_end(struct php_can_server_request *request);
+struct php_can_server_file *php_can_server_file_find(struct php_can_server_file_cache *cache,
+        const char *path, int path_len);
+struct php_can_server_file *php_can_server_file_add(struct php_can_server_file_cache *cache,
+        const char *path, int path_len, int fd, const struct stat *st);
+void php_can_server_file_release(struct php_can_server_file *file);
+void php_can_server_file_cache_trim(struct php_can_server_file_cache *cache, long max_entries);
+void php_can_server_file_cache_free(struct php_can_server_file_cache *cache);
+long php_can_server_ratelimit_take(struct php_can_server_ratelimit *limit,
+        struct evhttp_request *req, HashTable **headers, double now);
+int php_can_server_cors_request_method(struct evhttp_request *req, HashTable **headers);
+int php_can_server_cors_preflight(struct php_can_server_cors *cors, struct evhttp_request *req,
+        HashTable **headers, int method);
+void php_can_server_cors_simple(struct php_can_server_cors *cors, struct evhttp_request *req, HashTable **headers);
+int php_can_server_middleware_set_callbacks(struct php_can_server_middleware *middleware,
+        zval *before, zval *after TSRMLS_DC);
+int php_can_json_serializable(zval *value TSRMLS_DC);
+int php_can_json_is_list(HashTable *ht);
+int php_can_json_encode(struct evbuffer *out, zval *value TSRMLS_DC);
+int php_can_json_encode_slice(struct evbuffer *out, HashTable *ht, HashPosition *pos, int object,
+        int *first, size_t limit TSRMLS_DC);
+int php_can_msgpack_encode(struct evbuffer *out, zval *value TSRMLS_DC);
+int php_can_msgpack_decode(zval *value, const char *data, size_t len TSRMLS_DC);
+zval *php_can_body_file(const char *tmp_name, int fd, long size TSRMLS_DC);
+struct php_can_multipart *php_can_multipart_new(const char *content_type, zval *post, zval *files,
+        size_t memory_size TSRMLS_DC);
+void php_can_multipart_set_handler(struct php_can_multipart *mp, zval *handler, zval *zrequest);
+void php_can_multipart_feed(struct php_can_multipart *mp, struct evbuffer *data TSRMLS_DC);
+void php_can_multipart_free(struct php_can_multipart *mp TSRMLS_DC);
+void php_can_parse_multipart(const char *content_type, struct evbuffer *buffer, zval *post, zval **files,
+        size_t memory_size, zval *handler, zval *zrequest TSRMLS_DC);
+
 PHP_MINIT_FUNCTION(can_server);
 PHP_MSHUTDOWN_FUNCTION(can_server);
 PHP_RINIT_FUNCTION(can_server);
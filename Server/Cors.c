@@ -0,0 +1,421 @@
+/*
+  +----------------------------------------------------------------------+
+  | PHP Version 5.3                                                      |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2002-2011 Dmitri Vinogradov                            |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Authors: Dmitri Vinogradov <dmitri.vinogradov@gmail.com>             |
+  +----------------------------------------------------------------------+
+*/
+
+#include "Server.h"
+
+#include <event.h>
+#include <evhttp.h>
+
+zend_class_entry *ce_can_server_cors;
+static zend_object_handlers server_cors_obj_handlers;
+
+static void server_cors_dtor(void *object TSRMLS_DC);
+
+static zend_object_value server_cors_ctor(zend_class_entry *ce TSRMLS_DC)
+{
+    struct php_can_server_cors *cors;
+    zend_object_value retval;
+
+    cors = ecalloc(1, sizeof(*cors));
+    zend_object_std_init(&cors->std, ce TSRMLS_CC);
+    PHP_CAN_INIT_OBJ_PROPS(cors, ce);
+    cors->origins = NULL;
+    cors->headers = NULL;
+    cors->allow_methods = NULL;
+    cors->allow_headers = NULL;
+    cors->expose_headers = NULL;
+    cors->max_age = NULL;
+    retval.handle = zend_objects_store_put(cors,
+            (zend_objects_store_dtor_t)zend_objects_destroy_object,
+            server_cors_dtor,
+            NULL TSRMLS_CC);
+    retval.handlers = &server_cors_obj_handlers;
+    return retval;
+}
+
+static void server_cors_dtor(void *object TSRMLS_DC)
+{
+    struct php_can_server_cors *cors = (struct php_can_server_cors*)object;
+
+    if (cors->origins) {
+        zend_hash_destroy(cors->origins);
+        FREE_HASHTABLE(cors->origins);
+    }
+    if (cors->headers) {
+        zend_hash_destroy(cors->headers);
+        FREE_HASHTABLE(cors->headers);
+    }
+    if (cors->allow_methods) {
+        efree(cors->allow_methods);
+    }
+    if (cors->allow_headers) {
+        efree(cors->allow_headers);
+    }
+    if (cors->expose_headers) {
+        efree(cors->expose_headers);
+    }
+    if (cors->max_age) {
+        efree(cors->max_age);
+    }
+
+    zend_objects_store_del_ref(&cors->refhandle TSRMLS_CC);
+    zend_object_std_dtor(&cors->std TSRMLS_CC);
+    efree(cors);
+}
+
+/**
+ * Get the method a preflight request asks for,
+ * 0 if the request is not a CORS preflight
+ */
+int php_can_server_cors_request_method(struct evhttp_request *req, HashTable **headers)
+{
+    const char *method;
+    int i;
+
+    if (req->type != EVHTTP_REQ_OPTIONS
+            || php_can_server_header(headers, req->input_headers, PHP_CAN_HEADER_ORIGIN) == NULL
+            || (method = php_can_server_header(headers, req->input_headers,
+                    PHP_CAN_HEADER_ACCESS_CONTROL_REQUEST_METHOD)) == NULL) {
+        return 0;
+    }
+    for (i = 0; i < PHP_CAN_SERVER_ROUTE_METHODS; i++) {
+        if (0 == strcmp(method, php_can_method_name(1 << i))) {
+            return 1 << i;
+        }
+    }
+    return 0;
+}
+
+static int origin_allowed(struct php_can_server_cors *cors, const char *origin)
+{
+    int len = strlen(origin), allowed;
+    char *lower;
+
+    if (cors->origins == NULL) {
+        return 1;
+    }
+    lower = zend_str_tolower_dup(origin, len);
+    allowed = zend_hash_exists(cors->origins, lower, len + 1);
+    efree(lower);
+    return allowed;
+}
+
+/**
+ * Check every header of the comma separated request header list
+ */
+static int headers_allowed(struct php_can_server_cors *cors, const char *list)
+{
+    const char *p = list, *end;
+    char name[256];
+    int len, i;
+
+    if (cors->headers == NULL) {
+        return 1;
+    }
+    while (*p) {
+        while (*p == ' ' || *p == '\t' || *p == ',') {
+            p++;
+        }
+        end = p;
+        while (*end && *end != ',') {
+            end++;
+        }
+        len = end - p;
+        while (len > 0 && (p[len - 1] == ' ' || p[len - 1] == '\t')) {
+            len--;
+        }
+        if (len > 0) {
+            if (len >= (int)sizeof(name)) {
+                return 0;
+            }
+            for (i = 0; i < len; i++) {
+                name[i] = tolower((unsigned char)p[i]);
+            }
+            name[len] = '\0';
+            if (!zend_hash_exists(cors->headers, name, len + 1)) {
+                return 0;
+            }
+        }
+        p = end;
+    }
+    return 1;
+}
+
+/**
+ * Responses of a policy with an origin list depend on the origin, even
+ * those refusing it, caches must know
+ */
+static void vary_origin(struct php_can_server_cors *cors, struct evhttp_request *req)
+{
+    if (cors->origins != NULL) {
+        php_can_server_add_vary(req->output_headers, "Origin");
+    }
+}
+
+static void add_origin_headers(struct php_can_server_cors *cors, struct evhttp_request *req, const char *origin)
+{
+    if (cors->origins == NULL) {
+        evhttp_add_header(req->output_headers, "Access-Control-Allow-Origin", "*");
+        return;
+    }
+    evhttp_add_header(req->output_headers, "Access-Control-Allow-Origin", origin);
+    if (cors->credentials) {
+        evhttp_add_header(req->output_headers, "Access-Control-Allow-Credentials", "true");
+    }
+}
+
+/**
+ * Add preflight response headers, returns the status code to respond with
+ */
+int php_can_server_cors_preflight(struct php_can_server_cors *cors, struct evhttp_request *req,
+        HashTable **headers, int method)
+{
+    const char *origin = php_can_server_header(headers, req->input_headers, PHP_CAN_HEADER_ORIGIN);
+    const char *request_headers = php_can_server_header(headers, req->input_headers,
+            PHP_CAN_HEADER_ACCESS_CONTROL_REQUEST_HEADERS);
+
+    if (cors->allow_methods == NULL) {
+        return 403;
+    }
+    vary_origin(cors, req);
+    if (origin == NULL || !origin_allowed(cors, origin) || !(cors->methods & method)
+            || (request_headers != NULL && !headers_allowed(cors, request_headers))) {
+        return 403;
+    }
+
+    add_origin_headers(cors, req, origin);
+    evhttp_add_header(req->output_headers, "Access-Control-Allow-Methods", cors->allow_methods);
+    if (request_headers != NULL && *request_headers) {
+        evhttp_add_header(req->output_headers, "Access-Control-Allow-Headers",
+                cors->allow_headers ? cors->allow_headers : request_headers);
+    }
+    if (cors->max_age) {
+        evhttp_add_header(req->output_headers, "Access-Control-Max-Age", cors->max_age);
+    }
+    return 204;
+}
+
+/**
+ * Add headers of simple and actual cross origin responses
+ */
+void php_can_server_cors_simple(struct php_can_server_cors *cors, struct evhttp_request *req, HashTable **headers)
+{
+    const char *origin = php_can_server_header(headers, req->input_headers, PHP_CAN_HEADER_ORIGIN);
+
+    if (cors->allow_methods == NULL) {
+        return;
+    }
+    vary_origin(cors, req);
+    if (origin == NULL || !origin_allowed(cors, origin)) {
+        return;
+    }
+    add_origin_headers(cors, req, origin);
+    if (cors->expose_headers) {
+        evhttp_add_header(req->output_headers, "Access-Control-Expose-Headers", cors->expose_headers);
+    }
+}
+
+/**
+ * Build lowercased lookup table and the joined header value of a list
+ */
+static int build_list(zval *list, HashTable **table, char **joined, zend_bool lowercase TSRMLS_DC)
+{
+    smart_str buf = {0};
+    zval **item;
+
+    if (table) {
+        ALLOC_HASHTABLE(*table);
+        zend_hash_init(*table, zend_hash_num_elements(Z_ARRVAL_P(list)), NULL, NULL, 0);
+    }
+    PHP_CAN_FOREACH(list, item) {
+        if (Z_TYPE_PP(item) != IS_STRING || Z_STRLEN_PP(item) == 0) {
+            smart_str_free(&buf);
+            return FAILURE;
+        }
+        if (table) {
+            char *key = lowercase ? zend_str_tolower_dup(Z_STRVAL_PP(item), Z_STRLEN_PP(item))
+                                  : estrndup(Z_STRVAL_PP(item), Z_STRLEN_PP(item));
+            zend_hash_add_empty_element(*table, key, Z_STRLEN_PP(item) + 1);
+            efree(key);
+        }
+        if (joined) {
+            if (buf.len) {
+                smart_str_appendl(&buf, ", ", 2);
+            }
+            smart_str_appendl(&buf, Z_STRVAL_PP(item), Z_STRLEN_PP(item));
+        }
+    }
+    if (joined) {
+        smart_str_0(&buf);
+        *joined = buf.c ? buf.c : estrdup("");
+    }
+    return SUCCESS;
+}
+
+/**
+ * Constructor
+ */
+static PHP_METHOD(CanServerCors, __construct)
+{
+    zval *options = NULL, **value;
+
+    if (FAILURE == zend_parse_parameters_ex(ZEND_PARSE_PARAMS_QUIET, ZEND_NUM_ARGS() TSRMLS_CC,
+            "|a", &options)) {
+        zchar *space, *class_name = get_active_class_name(&space TSRMLS_CC);
+        php_can_throw_exception(
+            ce_can_InvalidParametersException TSRMLS_CC,
+            "%s%s%s([array $options])",
+            class_name, space, get_active_function_name(TSRMLS_C)
+        );
+        return;
+    }
+
+    struct php_can_server_cors *cors = (struct php_can_server_cors*)
+        zend_object_store_get_object(getThis() TSRMLS_CC);
+
+    if (cors->allow_methods != NULL) {
+        php_can_throw_exception(
+            ce_can_LogicException TSRMLS_CC,
+            "CORS policy is already initialized"
+        );
+        return;
+    }
+
+    cors->methods = PHP_CAN_SERVER_ROUTE_METHOD_GET | PHP_CAN_SERVER_ROUTE_METHOD_HEAD
+            | PHP_CAN_SERVER_ROUTE_METHOD_POST;
+
+    if (options != NULL) {
+        if (SUCCESS == zend_hash_find(Z_ARRVAL_P(options), "origins", sizeof("origins"), (void **)&value)
+                && !(Z_TYPE_PP(value) == IS_STRING && strcmp(Z_STRVAL_PP(value), "*") == 0)) {
+            if (Z_TYPE_PP(value) != IS_ARRAY || FAILURE == build_list(*value, &cors->origins, NULL, 1 TSRMLS_CC)) {
+                php_can_throw_exception(
+                    ce_can_InvalidParametersException TSRMLS_CC,
+                    "Option 'origins' must be '*' or array of origins"
+                );
+                return;
+            }
+        }
+        if (SUCCESS == zend_hash_find(Z_ARRVAL_P(options), "methods", sizeof("methods"), (void **)&value)) {
+            if (Z_TYPE_PP(value) != IS_LONG || !(Z_LVAL_PP(value) & PHP_CAN_SERVER_ROUTE_METHOD_ALL)) {
+                php_can_throw_exception(
+                    ce_can_InvalidParametersException TSRMLS_CC,
+                    "Option 'methods' must be a combination of Route::METHOD_* constants"
+                );
+                return;
+            }
+            cors->methods = Z_LVAL_PP(value) & PHP_CAN_SERVER_ROUTE_METHOD_ALL;
+        }
+        if (SUCCESS == zend_hash_find(Z_ARRVAL_P(options), "headers", sizeof("headers"), (void **)&value)
+                && !(Z_TYPE_PP(value) == IS_STRING && strcmp(Z_STRVAL_PP(value), "*") == 0)) {
+            if (Z_TYPE_PP(value) != IS_ARRAY
+                    || FAILURE == build_list(*value, &cors->headers, &cors->allow_headers, 1 TSRMLS_CC)) {
+                php_can_throw_exception(
+                    ce_can_InvalidParametersException TSRMLS_CC,
+                    "Option 'headers' must be '*' or array of header names"
+                );
+                return;
+            }
+        }
+        if (SUCCESS == zend_hash_find(Z_ARRVAL_P(options), "expose", sizeof("expose"), (void **)&value)) {
+            if (Z_TYPE_PP(value) != IS_ARRAY
+                    || FAILURE == build_list(*value, NULL, &cors->expose_headers, 0 TSRMLS_CC)) {
+                php_can_throw_exception(
+                    ce_can_InvalidParametersException TSRMLS_CC,
+                    "Option 'expose' must be array of header names"
+                );
+                return;
+            }
+        }
+        if (SUCCESS == zend_hash_find(Z_ARRVAL_P(options), "max_age", sizeof("max_age"), (void **)&value)) {
+            if (Z_TYPE_PP(value) != IS_LONG || Z_LVAL_PP(value) < 0) {
+                php_can_throw_exception(
+                    ce_can_InvalidParametersException TSRMLS_CC,
+                    "Option 'max_age' must be a positive integer"
+                );
+                return;
+            }
+            spprintf(&cors->max_age, 0, "%ld", Z_LVAL_PP(value));
+        }
+        if (SUCCESS == zend_hash_find(Z_ARRVAL_P(options), "credentials", sizeof("credentials"), (void **)&value)) {
+            cors->credentials = zend_is_true(*value);
+        }
+    }
+
+    // any site could read credentialed responses if every origin is echoed
+    if (cors->credentials && cors->origins == NULL) {
+        php_can_throw_exception(
+            ce_can_InvalidParametersException TSRMLS_CC,
+            "Option 'credentials' requires an array of origins"
+        );
+        return;
+    }
+
+    // precompute the allowed methods header
+    smart_str methods = {0};
+    int i;
+    for (i = 0; i < PHP_CAN_SERVER_ROUTE_METHODS; i++) {
+        if (cors->methods & (1 << i)) {
+            if (methods.len) {
+                smart_str_appendl(&methods, ", ", 2);
+            }
+            smart_str_appends(&methods, php_can_method_name(1 << i));
+        }
+    }
+    smart_str_0(&methods);
+    cors->allow_methods = methods.c;
+}
+
+static zend_function_entry server_cors_methods[] = {
+    PHP_ME(CanServerCors, __construct, NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
+    {NULL, NULL, NULL}
+};
+
+static void server_cors_init(TSRMLS_D)
+{
+    memcpy(&server_cors_obj_handlers, zend_get_std_object_handlers(), sizeof(zend_object_handlers));
+    server_cors_obj_handlers.clone_obj = NULL;
+
+    // class \Can\Server\Cors
+    PHP_CAN_REGISTER_CLASS(
+        &ce_can_server_cors,
+        ZEND_NS_NAME(PHP_CAN_SERVER_NS, "Cors"),
+        server_cors_ctor,
+        server_cors_methods
+    );
+}
+
+PHP_MINIT_FUNCTION(can_server_cors)
+{
+    server_cors_init(TSRMLS_C);
+    return SUCCESS;
+}
+
+PHP_MSHUTDOWN_FUNCTION(can_server_cors)
+{
+    return SUCCESS;
+}
+
+PHP_RINIT_FUNCTION(can_server_cors)
+{
+    return SUCCESS;
+}
+
+PHP_RSHUTDOWN_FUNCTION(can_server_cors)
+{
+    return SUCCESS;
+}
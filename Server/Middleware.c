@@ -0,0 +1,552 @@
+/*
+  +----------------------------------------------------------------------+
+  | PHP Version 5.3                                                      |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2002-2011 Dmitri Vinogradov                            |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Authors: Dmitri Vinogradov <dmitri.vinogradov@gmail.com>             |
+  +----------------------------------------------------------------------+
+*/
+
+#include "Server.h"
+
+#include <event.h>
+#include <evhttp.h>
+#include <unistd.h>
+#include <time.h>
+
+#define PHP_CAN_SERVER_MIDDLEWARE_NS ZEND_NS_NAME(PHP_CAN_SERVER_NS, "Middleware")
+
+zend_class_entry *ce_can_server_middleware;
+zend_class_entry *ce_can_server_middleware_headers;
+zend_class_entry *ce_can_server_middleware_request_id;
+zend_class_entry *ce_can_server_middleware_basic_auth;
+static zend_object_handlers server_middleware_obj_handlers;
+
+static void server_middleware_dtor(void *object TSRMLS_DC);
+
+static zend_object_value server_middleware_ctor(zend_class_entry *ce TSRMLS_DC)
+{
+    struct php_can_server_middleware *middleware;
+    zend_object_value retval;
+
+    middleware = ecalloc(1, sizeof(*middleware));
+    zend_object_std_init(&middleware->std, ce TSRMLS_CC);
+    PHP_CAN_INIT_OBJ_PROPS(middleware, ce);
+    middleware->before = NULL;
+    middleware->after = NULL;
+    middleware->free = NULL;
+    middleware->data = NULL;
+    middleware->before_cb = NULL;
+    middleware->after_cb = NULL;
+    retval.handle = zend_objects_store_put(middleware,
+            (zend_objects_store_dtor_t)zend_objects_destroy_object,
+            server_middleware_dtor,
+            NULL TSRMLS_CC);
+    retval.handlers = &server_middleware_obj_handlers;
+    return retval;
+}
+
+static void server_middleware_dtor(void *object TSRMLS_DC)
+{
+    struct php_can_server_middleware *middleware = (struct php_can_server_middleware*)object;
+
+    if (middleware->free && middleware->data) {
+        middleware->free(middleware->data TSRMLS_CC);
+    }
+
+    if (middleware->before_cb) {
+        zval_ptr_dtor(&middleware->before_cb);
+    }
+
+    if (middleware->after_cb) {
+        zval_ptr_dtor(&middleware->after_cb);
+    }
+
+    zend_objects_store_del_ref(&middleware->refhandle TSRMLS_CC);
+    zend_object_std_dtor(&middleware->std TSRMLS_CC);
+    efree(middleware);
+}
+
+/**
+ * Run before hooks of the middlewares in order. Returns 0 to continue with
+ * the route handler, a HTTP status code to respond with right away or -1
+ * if a hook threw an exception or already sent the response.
+ * entered is set to the number of middlewares whose before hook was run.
+ */
+int php_can_server_middleware_before(zval *middlewares, zval *zrequest, zval *params, int *entered TSRMLS_DC)
+{
+    struct php_can_server_request *request = (struct php_can_server_request *)
+        zend_object_store_get_object(zrequest TSRMLS_CC);
+    zval **zmiddleware;
+    int status = 0;
+
+    if (middlewares == NULL) {
+        return 0;
+    }
+
+    PHP_CAN_FOREACH(middlewares, zmiddleware) {
+        struct php_can_server_middleware *middleware = (struct php_can_server_middleware *)
+            zend_object_store_get_object(*zmiddleware TSRMLS_CC);
+
+        (*entered)++;
+
+        if (middleware->before) {
+            status = middleware->before(middleware, request TSRMLS_CC);
+        } else if (middleware->before_cb) {
+            zval retval, *args[2];
+            args[0] = zrequest;
+            args[1] = params;
+            Z_ADDREF_P(args[0]);
+            Z_ADDREF_P(args[1]);
+            if (call_user_function(EG(function_table), NULL, middleware->before_cb, &retval, 2, args TSRMLS_CC) == SUCCESS) {
+                if (EG(exception) || request->status != PHP_CAN_SERVER_RESPONSE_STATUS_NONE) {
+                    status = -1;
+                } else if (Z_TYPE(retval) == IS_STRING) {
+                    // respond with the returned body
+                    evbuffer_add(request->req->output_buffer, Z_STRVAL(retval), Z_STRLEN(retval));
+                    request->response_len += Z_STRLEN(retval);
+                    status = request->response_code ? request->response_code : 200;
+                } else if (Z_TYPE(retval) == IS_BOOL && !Z_BVAL(retval)) {
+                    status = request->response_code ? request->response_code : 403;
+                }
+                zval_dtor(&retval);
+            } else {
+                status = -1;
+            }
+            Z_DELREF_P(args[0]);
+            Z_DELREF_P(args[1]);
+        }
+
+        if (status != 0) {
+            break;
+        }
+    }
+    return status;
+}
+
+/**
+ * Run after hooks of the entered middlewares in reverse order
+ */
+void php_can_server_middleware_after(zval *middlewares, int entered, zval *zrequest TSRMLS_DC)
+{
+    struct php_can_server_request *request = (struct php_can_server_request *)
+        zend_object_store_get_object(zrequest TSRMLS_CC);
+    zval **zmiddleware;
+    int i;
+
+    if (middlewares == NULL) {
+        return;
+    }
+
+    for (i = entered - 1; i >= 0; i--) {
+        if (FAILURE == zend_hash_index_find(Z_ARRVAL_P(middlewares), i, (void **)&zmiddleware)) {
+            continue;
+        }
+
+        struct php_can_server_middleware *middleware = (struct php_can_server_middleware *)
+            zend_object_store_get_object(*zmiddleware TSRMLS_CC);
+
+        if (middleware->after) {
+            middleware->after(middleware, request TSRMLS_CC);
+        } else if (middleware->after_cb) {
+            zval retval, *args[1];
+            args[0] = zrequest;
+            Z_ADDREF_P(args[0]);
+            if (call_user_function(EG(function_table), NULL, middleware->after_cb, &retval, 1, args TSRMLS_CC) == SUCCESS) {
+                zval_dtor(&retval);
+            }
+            Z_DELREF_P(args[0]);
+            if (EG(exception)) {
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * Add response headers unless already set by the handler
+ */
+static void headers_after(struct php_can_server_middleware *middleware,
+        struct php_can_server_request *request TSRMLS_DC)
+{
+    struct evhttp_request *req = request->req;
+    zval *headers = (zval *)middleware->data, **value;
+
+    PHP_CAN_FOREACH(headers, value) {
+        if (keytype == HASH_KEY_IS_STRING && evhttp_find_header(req->output_headers, strkey) == NULL) {
+            evhttp_add_header(req->output_headers, strkey, Z_STRVAL_PP(value));
+        }
+    }
+}
+
+static void zval_data_free(void *data TSRMLS_DC)
+{
+    zval *zv = (zval *)data;
+    zval_ptr_dtor(&zv);
+}
+
+/**
+ * Propagate or generate request id, visible to the handler
+ * as request header and returned to the client
+ */
+static int request_id_before(struct php_can_server_middleware *middleware,
+        struct php_can_server_request *request TSRMLS_DC)
+{
+    static unsigned long counter = 0;
+    static unsigned long prefix = 0;
+    struct evhttp_request *req = request->req;
+    zval *name = (zval *)middleware->data;
+    const char *header = Z_STRVAL_P(name);
+    const char *id = php_can_server_find_header(&request->headers, req->input_headers, header, Z_STRLEN_P(name));
+    char buf[33];
+
+    if (id == NULL) {
+        if (prefix == 0) {
+            prefix = ((unsigned long)getpid() << 16) ^ (unsigned long)time(NULL) ^ (unsigned long)php_rand(TSRMLS_C);
+        }
+        snprintf(buf, sizeof(buf), "%08lx%08lx", prefix & 0xffffffffUL, ++counter & 0xffffffffUL);
+        evhttp_add_header(req->input_headers, header, buf);
+        php_can_server_header_index_free(&request->headers);
+        id = buf;
+    }
+    evhttp_remove_header(req->output_headers, header);
+    evhttp_add_header(req->output_headers, header, id);
+    return 0;
+}
+
+struct basic_auth {
+    HashTable credentials;
+    char *challenge;
+};
+
+static void basic_auth_free(void *data TSRMLS_DC)
+{
+    struct basic_auth *auth = (struct basic_auth *)data;
+    zend_hash_destroy(&auth->credentials);
+    efree(auth->challenge);
+    efree(auth);
+}
+
+/**
+ * Compare given credentials with known ones in time depending only on
+ * the length of the known ones
+ */
+static int credentials_equal(const char *given, const char *known, size_t known_len)
+{
+    size_t given_len = strlen(given), i;
+    unsigned char diff = given_len != known_len;
+
+    for (i = 0; i < known_len; i++) {
+        diff |= (unsigned char)((i < given_len ? given[i] : 0) ^ known[i]);
+    }
+    return diff == 0;
+}
+
+/**
+ * Accept requests with known credentials, the encoded credentials of
+ * the Authorization header are compared against those of every user
+ * in constant time
+ */
+static int basic_auth_before(struct php_can_server_middleware *middleware,
+        struct php_can_server_request *request TSRMLS_DC)
+{
+    struct basic_auth *auth = (struct basic_auth *)middleware->data;
+    struct evhttp_request *req = request->req;
+    const char *authorization = PHP_CAN_REQUEST_HEADER(request, AUTHORIZATION);
+    HashPosition pos;
+    char *key;
+    uint key_len;
+    ulong index;
+    int matched = 0;
+
+    // the scheme is case insensitive, the credentials follow after spaces
+    if (authorization != NULL && strncasecmp(authorization, "Basic", 5) == 0
+            && (authorization[5] == ' ' || authorization[5] == '\t')) {
+        authorization += 5 + strspn(authorization + 5, " \t");
+        // every user is compared so the time taken tells nothing
+        for (zend_hash_internal_pointer_reset_ex(&auth->credentials, &pos);
+                zend_hash_get_current_key_ex(&auth->credentials, &key, &key_len, &index, 0, &pos) == HASH_KEY_IS_STRING;
+                zend_hash_move_forward_ex(&auth->credentials, &pos)) {
+            matched |= credentials_equal(authorization, key, key_len - 1);
+        }
+        if (matched) {
+            return 0;
+        }
+    }
+    evhttp_add_header(req->output_headers, "WWW-Authenticate", auth->challenge);
+    return 401;
+}
+
+static zend_bool check_callable(zval *callback TSRMLS_DC)
+{
+    char *func_name;
+    zend_bool is_callable = zend_is_callable(callback, 0, &func_name TSRMLS_CC);
+    if (!is_callable) {
+        php_can_throw_exception(
+            ce_can_InvalidCallbackException TSRMLS_CC,
+            "Handler '%s' is not a valid callback",
+            func_name
+        );
+    }
+    efree(func_name);
+    return is_callable;
+}
+
+/**
+ * Set PHP before and after hooks of the middleware
+ */
+int php_can_server_middleware_set_callbacks(struct php_can_server_middleware *middleware,
+        zval *before, zval *after TSRMLS_DC)
+{
+    if ((before && Z_TYPE_P(before) != IS_NULL && !check_callable(before TSRMLS_CC))
+            || (after && Z_TYPE_P(after) != IS_NULL && !check_callable(after TSRMLS_CC))) {
+        return FAILURE;
+    }
+    if (before && Z_TYPE_P(before) != IS_NULL) {
+        zval_add_ref(&before);
+        middleware->before_cb = before;
+    }
+    if (after && Z_TYPE_P(after) != IS_NULL) {
+        zval_add_ref(&after);
+        middleware->after_cb = after;
+    }
+    return SUCCESS;
+}
+
+/**
+ * Constructor
+ */
+static PHP_METHOD(CanServerMiddleware, __construct)
+{
+    zval *before = NULL, *after = NULL;
+
+    if (FAILURE == zend_parse_parameters_ex(ZEND_PARSE_PARAMS_QUIET, ZEND_NUM_ARGS() TSRMLS_CC,
+            "z|z", &before, &after)) {
+        zchar *space, *class_name = get_active_class_name(&space TSRMLS_CC);
+        php_can_throw_exception(
+            ce_can_InvalidParametersException TSRMLS_CC,
+            "%s%s%s(callable $before[, callable $after])",
+            class_name, space, get_active_function_name(TSRMLS_C)
+        );
+        return;
+    }
+
+    struct php_can_server_middleware *middleware = (struct php_can_server_middleware*)
+        zend_object_store_get_object(getThis() TSRMLS_CC);
+
+    php_can_server_middleware_set_callbacks(middleware, before, after TSRMLS_CC);
+}
+
+/**
+ * Constructor
+ */
+static PHP_METHOD(CanServerMiddlewareHeaders, __construct)
+{
+    zval *headers = NULL, **value;
+
+    if (FAILURE == zend_parse_parameters_ex(ZEND_PARSE_PARAMS_QUIET, ZEND_NUM_ARGS() TSRMLS_CC,
+            "a", &headers)) {
+        zchar *space, *class_name = get_active_class_name(&space TSRMLS_CC);
+        php_can_throw_exception(
+            ce_can_InvalidParametersException TSRMLS_CC,
+            "%s%s%s(array $headers)",
+            class_name, space, get_active_function_name(TSRMLS_C)
+        );
+        return;
+    }
+
+    struct php_can_server_middleware *middleware = (struct php_can_server_middleware*)
+        zend_object_store_get_object(getThis() TSRMLS_CC);
+
+    zval *copy;
+    MAKE_STD_ZVAL(copy);
+    array_init(copy);
+    PHP_CAN_FOREACH(headers, value) {
+        if (keytype != HASH_KEY_IS_STRING || Z_TYPE_PP(value) != IS_STRING) {
+            zval_ptr_dtor(&copy);
+            php_can_throw_exception(
+                ce_can_InvalidParametersException TSRMLS_CC,
+                "Headers must be given as array('Header-Name' => 'value')"
+            );
+            return;
+        }
+        add_assoc_stringl(copy, strkey, Z_STRVAL_PP(value), Z_STRLEN_PP(value), 1);
+    }
+
+    middleware->data = copy;
+    middleware->free = zval_data_free;
+    middleware->after = headers_after;
+}
+
+/**
+ * Constructor
+ */
+static PHP_METHOD(CanServerMiddlewareRequestId, __construct)
+{
+    char *header = "X-Request-Id";
+    int header_len = sizeof("X-Request-Id") - 1;
+
+    if (FAILURE == zend_parse_parameters_ex(ZEND_PARSE_PARAMS_QUIET, ZEND_NUM_ARGS() TSRMLS_CC,
+            "|s", &header, &header_len) || header_len == 0) {
+        zchar *space, *class_name = get_active_class_name(&space TSRMLS_CC);
+        php_can_throw_exception(
+            ce_can_InvalidParametersException TSRMLS_CC,
+            "%s%s%s([string $header = 'X-Request-Id'])",
+            class_name, space, get_active_function_name(TSRMLS_C)
+        );
+        return;
+    }
+
+    struct php_can_server_middleware *middleware = (struct php_can_server_middleware*)
+        zend_object_store_get_object(getThis() TSRMLS_CC);
+
+    zval *name;
+    MAKE_STD_ZVAL(name);
+    ZVAL_STRINGL(name, header, header_len, 1);
+
+    middleware->data = name;
+    middleware->free = zval_data_free;
+    middleware->before = request_id_before;
+}
+
+/**
+ * Constructor
+ */
+static PHP_METHOD(CanServerMiddlewareBasicAuth, __construct)
+{
+    zval *users = NULL, **password;
+    char *realm = "Restricted";
+    int realm_len = sizeof("Restricted") - 1;
+
+    if (FAILURE == zend_parse_parameters_ex(ZEND_PARSE_PARAMS_QUIET, ZEND_NUM_ARGS() TSRMLS_CC,
+            "a|s", &users, &realm, &realm_len)) {
+        zchar *space, *class_name = get_active_class_name(&space TSRMLS_CC);
+        php_can_throw_exception(
+            ce_can_InvalidParametersException TSRMLS_CC,
+            "%s%s%s(array $users[, string $realm = 'Restricted'])",
+            class_name, space, get_active_function_name(TSRMLS_C)
+        );
+        return;
+    }
+
+    struct php_can_server_middleware *middleware = (struct php_can_server_middleware*)
+        zend_object_store_get_object(getThis() TSRMLS_CC);
+
+    struct basic_auth *auth = emalloc(sizeof(*auth));
+    zend_hash_init(&auth->credentials, zend_hash_num_elements(Z_ARRVAL_P(users)), NULL, NULL, 0);
+    spprintf(&auth->challenge, 0, "Basic realm=\"%s\"", realm);
+
+    PHP_CAN_FOREACH(users, password) {
+        char *credentials = NULL;
+        unsigned char *encoded;
+        int credentials_len, encoded_len;
+        if (keytype != HASH_KEY_IS_STRING || Z_TYPE_PP(password) != IS_STRING) {
+            basic_auth_free(auth TSRMLS_CC);
+            php_can_throw_exception(
+                ce_can_InvalidParametersException TSRMLS_CC,
+                "Users must be given as array('user' => 'password')"
+            );
+            return;
+        }
+        credentials_len = spprintf(&credentials, 0, "%s:%s", strkey, Z_STRVAL_PP(password));
+        encoded = php_base64_encode((unsigned char *)credentials, credentials_len, &encoded_len);
+        zend_hash_add_empty_element(&auth->credentials, (char *)encoded, encoded_len + 1);
+        efree(encoded);
+        efree(credentials);
+    }
+
+    middleware->data = auth;
+    middleware->free = basic_auth_free;
+    middleware->before = basic_auth_before;
+}
+
+static zend_function_entry server_middleware_methods[] = {
+    PHP_ME(CanServerMiddleware, __construct, NULL, ZEND_ACC_PUBLIC)
+    {NULL, NULL, NULL}
+};
+
+static zend_function_entry server_middleware_headers_methods[] = {
+    PHP_ME(CanServerMiddlewareHeaders, __construct, NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
+    {NULL, NULL, NULL}
+};
+
+static zend_function_entry server_middleware_request_id_methods[] = {
+    PHP_ME(CanServerMiddlewareRequestId, __construct, NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
+    {NULL, NULL, NULL}
+};
+
+static zend_function_entry server_middleware_basic_auth_methods[] = {
+    PHP_ME(CanServerMiddlewareBasicAuth, __construct, NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
+    {NULL, NULL, NULL}
+};
+
+static void server_middleware_init(TSRMLS_D)
+{
+    memcpy(&server_middleware_obj_handlers, zend_get_std_object_handlers(), sizeof(zend_object_handlers));
+    server_middleware_obj_handlers.clone_obj = NULL;
+
+    // class \Can\Server\Middleware
+    PHP_CAN_REGISTER_CLASS(
+        &ce_can_server_middleware,
+        ZEND_NS_NAME(PHP_CAN_SERVER_NS, "Middleware"),
+        server_middleware_ctor,
+        server_middleware_methods
+    );
+
+    // class \Can\Server\Middleware\Headers extends \Can\Server\Middleware
+    PHP_CAN_REGISTER_SUBCLASS(
+        &ce_can_server_middleware_headers,
+        ce_can_server_middleware,
+        ZEND_NS_NAME(PHP_CAN_SERVER_MIDDLEWARE_NS, "Headers"),
+        NULL,
+        server_middleware_headers_methods
+    );
+
+    // class \Can\Server\Middleware\RequestId extends \Can\Server\Middleware
+    PHP_CAN_REGISTER_SUBCLASS(
+        &ce_can_server_middleware_request_id,
+        ce_can_server_middleware,
+        ZEND_NS_NAME(PHP_CAN_SERVER_MIDDLEWARE_NS, "RequestId"),
+        NULL,
+        server_middleware_request_id_methods
+    );
+
+    // class \Can\Server\Middleware\BasicAuth extends \Can\Server\Middleware
+    PHP_CAN_REGISTER_SUBCLASS(
+        &ce_can_server_middleware_basic_auth,
+        ce_can_server_middleware,
+        ZEND_NS_NAME(PHP_CAN_SERVER_MIDDLEWARE_NS, "BasicAuth"),
+        NULL,
+        server_middleware_basic_auth_methods
+    );
+}
+
+PHP_MINIT_FUNCTION(can_server_middleware)
+{
+    server_middleware_init(TSRMLS_C);
+    return SUCCESS;
+}
+
+PHP_MSHUTDOWN_FUNCTION(can_server_middleware)
+{
+    return SUCCESS;
+}
+
+PHP_RINIT_FUNCTION(can_server_middleware)
+{
+    return SUCCESS;
+}
+
+PHP_RSHUTDOWN_FUNCTION(can_server_middleware)
+{
+    return SUCCESS;
+}
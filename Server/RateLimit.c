@@ -0,0 +1,220 @@
+/*
+  +----------------------------------------------------------------------+
+  | PHP Version 5.3                                                      |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2002-2011 Dmitri Vinogradov                            |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Authors: Dmitri Vinogradov <dmitri.vinogradov@gmail.com>             |
+  +----------------------------------------------------------------------+
+*/
+
+#include "Server.h"
+
+#include <event.h>
+#include <evhttp.h>
+#include <math.h>
+
+zend_class_entry *ce_can_server_ratelimit;
+static zend_object_handlers server_ratelimit_obj_handlers;
+
+static void server_ratelimit_dtor(void *object TSRMLS_DC);
+
+static zend_object_value server_ratelimit_ctor(zend_class_entry *ce TSRMLS_DC)
+{
+    struct php_can_server_ratelimit *limit;
+    zend_object_value retval;
+
+    limit = ecalloc(1, sizeof(*limit));
+    zend_object_std_init(&limit->std, ce TSRMLS_CC);
+    PHP_CAN_INIT_OBJ_PROPS(limit, ce);
+    limit->rate = 0;
+    limit->burst = 0;
+    limit->header = NULL;
+    limit->buckets = NULL;
+    limit->mask = 0;
+    retval.handle = zend_objects_store_put(limit,
+            (zend_objects_store_dtor_t)zend_objects_destroy_object,
+            server_ratelimit_dtor,
+            NULL TSRMLS_CC);
+    retval.handlers = &server_ratelimit_obj_handlers;
+    return retval;
+}
+
+static void server_ratelimit_dtor(void *object TSRMLS_DC)
+{
+    struct php_can_server_ratelimit *limit = (struct php_can_server_ratelimit*)object;
+
+    if (limit->header) {
+        efree(limit->header);
+    }
+
+    if (limit->buckets) {
+        efree(limit->buckets);
+    }
+
+    zend_objects_store_del_ref(&limit->refhandle TSRMLS_CC);
+    zend_object_std_dtor(&limit->std TSRMLS_CC);
+    efree(limit);
+}
+
+/**
+ * Take a token from the bucket of the client. Returns 0 if the request
+ * may pass, otherwise the number of seconds until a token is available.
+ *
+ * Buckets live in a fixed size open addressing table. A client which is
+ * not found within the probe window takes over the least recently seen
+ * slot of the window, idle clients are evicted this way without any
+ * sweeping and the memory used never grows.
+ */
+long php_can_server_ratelimit_take(struct php_can_server_ratelimit *limit,
+        struct evhttp_request *req, HashTable **headers, double now)
+{
+    struct php_can_server_ratelimit_bucket *bucket = NULL, *oldest = NULL;
+    const char *key = NULL;
+    size_t key_len;
+    ulong hash;
+    int i;
+
+    if (limit->buckets == NULL) {
+        return 0;
+    }
+
+    if (limit->header != NULL) {
+        key = php_can_server_find_header(headers, req->input_headers, limit->header, limit->header_len);
+    }
+    if (key == NULL) {
+        key = req->remote_host != NULL ? req->remote_host : "";
+    }
+    key_len = strlen(key);
+    if (key_len >= PHP_CAN_SERVER_RATELIMIT_KEY_SIZE) {
+        // keep the tail, forwarded-for lists end with the closest proxy
+        key += key_len - PHP_CAN_SERVER_RATELIMIT_KEY_SIZE + 1;
+        key_len = PHP_CAN_SERVER_RATELIMIT_KEY_SIZE - 1;
+    }
+    hash = zend_inline_hash_func(key, key_len) | 1;
+
+    for (i = 0; i < PHP_CAN_SERVER_RATELIMIT_PROBES; i++) {
+        struct php_can_server_ratelimit_bucket *slot = &limit->buckets[(hash + i) & limit->mask];
+        if (slot->hash == hash && memcmp(slot->key, key, key_len + 1) == 0) {
+            bucket = slot;
+            break;
+        }
+        if (oldest == NULL || slot->last < oldest->last) {
+            oldest = slot;
+        }
+    }
+
+    if (bucket == NULL) {
+        bucket = oldest;
+        bucket->hash = hash;
+        memcpy(bucket->key, key, key_len + 1);
+        bucket->tokens = limit->burst;
+    } else {
+        bucket->tokens += (now - bucket->last) * limit->rate;
+        if (bucket->tokens > limit->burst) {
+            bucket->tokens = limit->burst;
+        }
+    }
+    bucket->last = now;
+
+    if (bucket->tokens >= 1.0) {
+        bucket->tokens -= 1.0;
+        return 0;
+    }
+    return (long)ceil((1.0 - bucket->tokens) / limit->rate);
+}
+
+/**
+ * Constructor
+ */
+static PHP_METHOD(CanServerRateLimit, __construct)
+{
+    double rate;
+    long burst, capacity = 65536;
+    char *header = NULL;
+    int header_len = 0;
+
+    if (FAILURE == zend_parse_parameters_ex(ZEND_PARSE_PARAMS_QUIET, ZEND_NUM_ARGS() TSRMLS_CC,
+            "dl|s!l", &rate, &burst, &header, &header_len, &capacity)
+            || rate <= 0 || burst < 1 || capacity < 1 || capacity > PHP_CAN_SERVER_RATELIMIT_MAX_CAPACITY) {
+        zchar *space, *class_name = get_active_class_name(&space TSRMLS_CC);
+        php_can_throw_exception(
+            ce_can_InvalidParametersException TSRMLS_CC,
+            "%s%s%s(float $rate, int $burst[, string $header[, int $capacity = 65536]])",
+            class_name, space, get_active_function_name(TSRMLS_C)
+        );
+        return;
+    }
+
+    struct php_can_server_ratelimit *limit = (struct php_can_server_ratelimit*)
+        zend_object_store_get_object(getThis() TSRMLS_CC);
+
+    if (limit->buckets != NULL) {
+        php_can_throw_exception(
+            ce_can_LogicException TSRMLS_CC,
+            "Rate limit is already initialized"
+        );
+        return;
+    }
+
+    // table size is the next power of two, never below the probe window
+    long size = PHP_CAN_SERVER_RATELIMIT_PROBES;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    limit->rate = rate;
+    limit->burst = (double)burst;
+    limit->header = header_len ? estrndup(header, header_len) : NULL;
+    limit->header_len = header_len;
+    limit->buckets = ecalloc(size, sizeof(struct php_can_server_ratelimit_bucket));
+    limit->mask = size - 1;
+}
+
+static zend_function_entry server_ratelimit_methods[] = {
+    PHP_ME(CanServerRateLimit, __construct, NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
+    {NULL, NULL, NULL}
+};
+
+static void server_ratelimit_init(TSRMLS_D)
+{
+    memcpy(&server_ratelimit_obj_handlers, zend_get_std_object_handlers(), sizeof(zend_object_handlers));
+    server_ratelimit_obj_handlers.clone_obj = NULL;
+
+    // class \Can\Server\RateLimit
+    PHP_CAN_REGISTER_CLASS(
+        &ce_can_server_ratelimit,
+        ZEND_NS_NAME(PHP_CAN_SERVER_NS, "RateLimit"),
+        server_ratelimit_ctor,
+        server_ratelimit_methods
+    );
+}
+
+PHP_MINIT_FUNCTION(can_server_ratelimit)
+{
+    server_ratelimit_init(TSRMLS_C);
+    return SUCCESS;
+}
+
+PHP_MSHUTDOWN_FUNCTION(can_server_ratelimit)
+{
+    return SUCCESS;
+}
+
+PHP_RINIT_FUNCTION(can_server_ratelimit)
+{
+    return SUCCESS;
+}
+
+PHP_RSHUTDOWN_FUNCTION(can_server_ratelimit)
+{
+    return SUCCESS;
+}
@@ -35,6 +35,32 @@ static HashTable *mimetypes = NULL;
 static int has_finfo = -1;
 static zend_class_entry **finfo_cep = NULL;
 static const char *default_mimetype = "text/plain";
+static HashTable *variants = NULL;
+
+/* seconds a precompressed sibling lookup is trusted without stat() */
+#define PHP_CAN_SERVER_VARIANT_TTL 2
+/* number of sibling lookups kept, the cache is emptied when full */
+#define PHP_CAN_SERVER_VARIANT_MAX 1024
+
+/**
+ * Precompressed siblings served by sendFile(), preferred in this order
+ * on equal weights
+ */
+static const struct {
+    const char *coding;
+    const char *suffix;
+} precompressed[] = {
+    {"br",   ".br"},
+    {"gzip", ".gz"},
+    {NULL,   NULL}
+};
+
+struct precompressed_variant {
+    time_t checked;
+    time_t source_mtime;
+    int usable;
+    struct stat st;
+};
 
 static void server_request_dtor(void *object TSRMLS_DC);
 
@@ -56,6 +82,13 @@ static zend_object_value server_request_ctor(zend_class_entry *ce TSRMLS_DC)
     request->response_code = 0;
     request->response_len = 0;
     request->error = NULL;
+    request->headers = NULL;
+    request->json = NULL;
+    request->msgpack = NULL;
+    request->body_file = NULL;
+    request->compression = NULL;
+    request->compress = NULL;
+    request->file_cache = NULL;
     retval.handle = zend_objects_store_put(request,
             (zend_objects_store_dtor_t)zend_objects_destroy_object,
             server_request_dtor,
@@ -103,11 +136,116 @@ static void server_request_dtor(void *object TSRMLS_DC)
         request->error = NULL;
     }
 
+    php_can_server_header_index_free(&request->headers);
+
+    if (request->json) {
+        zval_ptr_dtor(&request->json);
+    }
+
+    if (request->msgpack) {
+        zval_ptr_dtor(&request->msgpack);
+    }
+
+    if (request->body_file) {
+        zval_ptr_dtor(&request->body_file);
+    }
+
+    if (request->compress) {
+        php_can_compress_free(request->compress);
+    }
+
     zend_objects_store_del_ref(&request->refhandle TSRMLS_CC);
     zend_object_std_dtor(&request->std TSRMLS_CC);
     efree(request);
 }
 
+/**
+ * Decode the request body as JSON straight from the input buffer,
+ * the result is kept for subsequent calls. Throws HTTPError 413 if
+ * the body is larger than max_size and 400 if it is malformed.
+ */
+static zval *request_json(struct php_can_server_request *request, zend_bool assoc, long depth, long max_size TSRMLS_DC)
+{
+#ifdef HAVE_JSON
+    size_t len = EVBUFFER_LENGTH(request->req->input_buffer);
+
+    if (request->json != NULL && request->json_assoc == assoc) {
+        return request->json;
+    }
+
+    if (max_size > 0 && len > (size_t)max_size) {
+        php_can_throw_exception_code(
+            ce_can_HTTPError TSRMLS_CC, 413, "JSON request body exceeds %ld bytes", max_size
+        );
+        return NULL;
+    }
+
+    zval *json;
+    MAKE_STD_ZVAL(json);
+    if (len == 0) {
+        ZVAL_NULL(json);
+    } else {
+        php_json_decode(json, (char *)EVBUFFER_DATA(request->req->input_buffer), len, assoc, depth TSRMLS_CC);
+        if (JSON_G(error_code) != PHP_JSON_ERROR_NONE) {
+            zval_ptr_dtor(&json);
+            php_can_throw_exception_code(
+                ce_can_HTTPError TSRMLS_CC, 400, "Malformed JSON request body"
+            );
+            return NULL;
+        }
+    }
+
+    if (request->json != NULL) {
+        zval_ptr_dtor(&request->json);
+    }
+    request->json = json;
+    request->json_assoc = assoc;
+    return json;
+#else
+    php_can_throw_exception(
+        ce_can_InvalidOperationException TSRMLS_CC,
+        "JSON support is not available"
+    );
+    return NULL;
+#endif
+}
+
+/**
+ * Decode the request body as MessagePack straight from the input
+ * buffer, same rules as for JSON bodies apply
+ */
+static zval *request_msgpack(struct php_can_server_request *request, long max_size TSRMLS_DC)
+{
+    size_t len = EVBUFFER_LENGTH(request->req->input_buffer);
+
+    if (request->msgpack != NULL) {
+        return request->msgpack;
+    }
+
+    if (max_size > 0 && len > (size_t)max_size) {
+        php_can_throw_exception_code(
+            ce_can_HTTPError TSRMLS_CC, 413, "MessagePack request body exceeds %ld bytes", max_size
+        );
+        return NULL;
+    }
+
+    zval *msgpack;
+    MAKE_STD_ZVAL(msgpack);
+    if (len == 0) {
+        ZVAL_NULL(msgpack);
+    } else if (php_can_msgpack_decode(msgpack, (char *)EVBUFFER_DATA(request->req->input_buffer), len TSRMLS_CC)
+            == FAILURE) {
+        zval_ptr_dtor(&msgpack);
+        php_can_throw_exception_code(
+            ce_can_HTTPError TSRMLS_CC, 400, "Malformed MessagePack request body"
+        );
+        return NULL;
+    }
+
+    request->msgpack = msgpack;
+    return msgpack;
+}
+
 static zval *read_property(zval *object, zval *member, int type ZEND_LITERAL_KEY_DC TSRMLS_DC)
 {
     struct php_can_server_request *request;
@@ -277,6 +415,41 @@ static zval *read_property(zval *object, zval *member, int type ZEND_LITERAL_KEY
         ZVAL_LONG(retval, request->response_code);
         Z_SET_REFCOUNT_P(retval, 0);
         
+    } else if (Z_STRLEN_P(member) == (sizeof("json") - 1)
+            && !memcmp(Z_STRVAL_P(member), "json", Z_STRLEN_P(member))) {
+
+        zval *json = request_json(request, 1, PHP_CAN_SERVER_JSON_DEPTH, PG(post_max_size) TSRMLS_CC);
+        MAKE_STD_ZVAL(retval);
+        if (json != NULL) {
+            ZVAL_ZVAL(retval, json, 1, 0);
+        } else {
+            ZVAL_NULL(retval);
+        }
+        Z_SET_REFCOUNT_P(retval, 0);
+
+    } else if (Z_STRLEN_P(member) == (sizeof("msgpack") - 1)
+            && !memcmp(Z_STRVAL_P(member), "msgpack", Z_STRLEN_P(member))) {
+
+        zval *msgpack = request_msgpack(request, PG(post_max_size) TSRMLS_CC);
+        MAKE_STD_ZVAL(retval);
+        if (msgpack != NULL) {
+            ZVAL_ZVAL(retval, msgpack, 1, 0);
+        } else {
+            ZVAL_NULL(retval);
+        }
+        Z_SET_REFCOUNT_P(retval, 0);
+
+    } else if (Z_STRLEN_P(member) == (sizeof("bodyFile") - 1)
+            && !memcmp(Z_STRVAL_P(member), "bodyFile", Z_STRLEN_P(member))) {
+
+        MAKE_STD_ZVAL(retval);
+        if (request->body_file != NULL) {
+            ZVAL_ZVAL(retval, request->body_file, 1, 0);
+        } else {
+            ZVAL_NULL(retval);
+        }
+        Z_SET_REFCOUNT_P(retval, 0);
+
     } else if (Z_STRLEN_P(member) == (sizeof("responseLength") - 1)
             && !memcmp(Z_STRVAL_P(member), "responseLength", Z_STRLEN_P(member))) {
 
@@ -401,6 +574,14 @@ static HashTable *get_properties(zval *object TSRMLS_DC) /* {{{ */
     }
     zend_hash_update(props, "files", sizeof("files"), &zv, sizeof(zval), NULL);
 
+    MAKE_STD_ZVAL(zv);
+    if (request->body_file) {
+        ZVAL_ZVAL(zv, request->body_file, 1, 0);
+    } else {
+        ZVAL_NULL(zv);
+    }
+    zend_hash_update(props, "bodyFile", sizeof("bodyFile"), &zv, sizeof(zval), NULL);
+
     MAKE_STD_ZVAL(zv);
     ZVAL_LONG(zv, (int)request->status);
     zend_hash_update(props, "status", sizeof("status"), &zv, sizeof(zval), NULL);
@@ -469,7 +650,8 @@ static PHP_METHOD(CanServerRequest, findRequestHeader)
     struct php_can_server_request *request = (struct php_can_server_request*)
         zend_object_store_get_object(getThis() TSRMLS_CC);
 
-    const char *value = evhttp_find_header(request->req->input_headers, (const char*)Z_STRVAL_P(header));
+    const char *value = php_can_server_find_header(&request->headers, request->req->input_headers,
+            Z_STRVAL_P(header), Z_STRLEN_P(header));
     if (value == NULL) {
         RETURN_FALSE;
     }
@@ -516,9 +698,56 @@ static PHP_METHOD(CanServerRequest, getRequestBody)
     if (buffer_len > 0) {
         RETURN_STRINGL(EVBUFFER_DATA(request->req->input_buffer), buffer_len, 1);
     }
+
+    // read back the body spilled to a temporary file
+    if (request->body_file != NULL) {
+        zval **tmp_name;
+        char *contents = NULL;
+        php_stream *stream;
+        size_t len = 0;
+
+        if (zend_hash_find(Z_ARRVAL_P(request->body_file), "tmp_name", sizeof("tmp_name"),
+                (void **)&tmp_name) == SUCCESS
+                && (stream = php_stream_open_wrapper(Z_STRVAL_PP(tmp_name), "rb", REPORT_ERRORS, NULL)) != NULL) {
+            len = php_stream_copy_to_mem(stream, &contents, PHP_STREAM_COPY_ALL, 0);
+            php_stream_close(stream);
+            if (len > 0) {
+                RETURN_STRINGL(contents, len, 0);
+            }
+        }
+    }
     RETURN_FALSE;
 }
 
+/**
+ * Get request body decoded as JSON
+ */
+static PHP_METHOD(CanServerRequest, getJson)
+{
+    zend_bool assoc = 1;
+    long depth = PHP_CAN_SERVER_JSON_DEPTH, max_size = PG(post_max_size);
+
+    if (FAILURE == zend_parse_parameters_ex(ZEND_PARSE_PARAMS_QUIET, ZEND_NUM_ARGS() TSRMLS_CC,
+            "|bll", &assoc, &depth, &max_size) || depth <= 0 || max_size < 0) {
+        zchar *space, *class_name = get_active_class_name(&space TSRMLS_CC);
+        php_can_throw_exception(
+            ce_can_InvalidParametersException TSRMLS_CC,
+            "%s%s%s([bool $assoc = true[, int $depth = 512[, int $max_size]]])",
+            class_name, space, get_active_function_name(TSRMLS_C)
+        );
+        return;
+    }
+
+    struct php_can_server_request *request = (struct php_can_server_request*)
+        zend_object_store_get_object(getThis() TSRMLS_CC);
+
+    zval *json = request_json(request, assoc, depth, max_size TSRMLS_CC);
+    if (json == NULL) {
+        return;
+    }
+    RETURN_ZVAL(json, 1, 0);
+}
+
 /**
  * Get response body
  */
@@ -867,6 +1096,99 @@ static char *get_realpath(char *path, int check_is_readable TSRMLS_DC)
     return NULL;
 }
 
+/**
+ * Whether the precompressed sibling at path can stand in for the file
+ * with the given stat, it must be a readable regular file not older
+ * than the file. Lookups are cached for a few seconds and dropped as
+ * soon as the file changes.
+ */
+static int variant_usable(const char *path, int path_len, const struct stat *source, struct stat *st)
+{
+    struct precompressed_variant *cached, entry;
+    time_t now = time(NULL);
+
+    if (variants == NULL) {
+        ALLOC_HASHTABLE(variants);
+        zend_hash_init(variants, 64, NULL, NULL, 0);
+    }
+    if (SUCCESS == zend_hash_find(variants, path, path_len + 1, (void **)&cached)
+        && cached->source_mtime == source->st_mtime
+        && now - cached->checked < PHP_CAN_SERVER_VARIANT_TTL
+    ) {
+        *st = cached->st;
+        return cached->usable;
+    }
+
+    memset(&entry, 0, sizeof(entry));
+    entry.checked = now;
+    entry.source_mtime = source->st_mtime;
+    entry.usable = stat(path, &entry.st) == 0
+        && S_ISREG(entry.st.st_mode)
+        && entry.st.st_mtime >= source->st_mtime
+        && VCWD_ACCESS(path, R_OK) == 0;
+
+    if (zend_hash_num_elements(variants) >= PHP_CAN_SERVER_VARIANT_MAX) {
+        zend_hash_clean(variants);
+    }
+    zend_hash_update(variants, path, path_len + 1, &entry, sizeof(entry), NULL);
+    *st = entry.st;
+    return entry.usable;
+}
+
+/**
+ * Switch the response over to the best precompressed sibling of the
+ * file the client accepts. Vary is set as soon as the file has any
+ * sibling. Returns the index of the served variant or -1, file is
+ * the sibling then.
+ */
+static int use_precompressed(struct php_can_server_request *request, const char *filepath,
+        struct php_can_server_file **file)
+{
+    const char *accept = PHP_CAN_REQUEST_HEADER(request, ACCEPT_ENCODING);
+    struct php_can_server_file *variant;
+    struct stat vst;
+    double q, best_q = 0;
+    int i, best = -1, found = 0, path_len, vfd;
+    char *path;
+
+    for (i = 0; precompressed[i].coding != NULL; i++) {
+        path_len = spprintf(&path, 0, "%s%s", filepath, precompressed[i].suffix);
+        if (variant_usable(path, path_len, &(*file)->st, &vst)) {
+            found = 1;
+            q = accept != NULL ? php_can_compress_qvalue(accept, precompressed[i].coding) : 0;
+            if (q > best_q) {
+                best_q = q;
+                best = i;
+            }
+        }
+        efree(path);
+    }
+    if (found) {
+        php_can_server_add_vary(request->req->output_headers, "Accept-Encoding");
+    }
+    if (best < 0) {
+        return -1;
+    }
+
+    path_len = spprintf(&path, 0, "%s%s", filepath, precompressed[best].suffix);
+    variant = php_can_server_file_find(request->file_cache, path, path_len);
+    if (variant == NULL && (vfd = open(path, O_RDONLY)) >= 0) {
+        if (fstat(vfd, &vst) == 0) {
+            variant = php_can_server_file_add(request->file_cache, path, path_len, vfd, &vst);
+        } else {
+            close(vfd);
+        }
+    }
+    efree(path);
+    if (variant == NULL) {
+        return -1;
+    }
+    php_can_server_file_release(*file);
+    *file = variant;
+    evhttp_add_header(request->req->output_headers, "Content-Encoding", precompressed[best].coding);
+    return best;
+}
+
 /**
  * Send file
  */
@@ -959,57 +1281,73 @@ static PHP_METHOD(CanServerRequest, sendFile)
         efree(rootpath);
     }
     
-#ifdef R_OK
-    // requested path exists and is within root path, check for read permissions
-    if (VCWD_ACCESS(filepath, R_OK)) {
-        php_can_throw_exception_code(
-            ce_can_HTTPError TSRMLS_CC, 403, "Requested file '%s' is not readable", filename
-        );
-        efree(filepath);
-        return;
-    }
-#endif
-    
-    int fd = -1;
-    if ((fd = open(filepath, O_RDONLY)) < 0) {
-        php_can_throw_exception(
-            ce_can_RuntimeException TSRMLS_CC,
-            "Cannot open the file '%s'", filename
-        );
-        efree(filepath);
-        return;
-    }
-    
+    struct php_can_server_request *request = (struct php_can_server_request*)
+        zend_object_store_get_object(getThis() TSRMLS_CC);
+    int filepath_len = strlen(filepath);
     struct stat st;
-    if (fstat(fd, &st) < 0) {
-        php_can_throw_exception(
-            ce_can_RuntimeException TSRMLS_CC,
-            "Cannot fstat the file '%s'", filename
-        );
-        efree(filepath);
-        return;
-    }
     
-    // we do not serving directory listings, so if requested URI points to directory
-    // we send 403 Forbidden response to the client
-    if (S_ISDIR(st.st_mode)) {
-        php_can_throw_exception_code(
-            ce_can_HTTPError TSRMLS_CC, 403, "Requested path '%s' is a directory", filename
-        );
-        efree(filepath);
-        return;
+    // files served before are kept open as long as they do not change
+    struct php_can_server_file *file = php_can_server_file_find(request->file_cache, filepath, filepath_len);
+    if (file == NULL) {
+        
+#ifdef R_OK
+        // requested path exists and is within root path, check for read permissions
+        if (VCWD_ACCESS(filepath, R_OK)) {
+            php_can_throw_exception_code(
+                ce_can_HTTPError TSRMLS_CC, 403, "Requested file '%s' is not readable", filename
+            );
+            efree(filepath);
+            return;
+        }
+#endif
+        
+        int fd = -1;
+        if ((fd = open(filepath, O_RDONLY)) < 0) {
+            php_can_throw_exception(
+                ce_can_RuntimeException TSRMLS_CC,
+                "Cannot open the file '%s'", filename
+            );
+            efree(filepath);
+            return;
+        }
+        
+        if (fstat(fd, &st) < 0) {
+            php_can_throw_exception(
+                ce_can_RuntimeException TSRMLS_CC,
+                "Cannot fstat the file '%s'", filename
+            );
+            close(fd);
+            efree(filepath);
+            return;
+        }
+        
+        // we do not serving directory listings, so if requested URI points to directory
+        // we send 403 Forbidden response to the client
+        if (S_ISDIR(st.st_mode)) {
+            php_can_throw_exception_code(
+                ce_can_HTTPError TSRMLS_CC, 403, "Requested path '%s' is a directory", filename
+            );
+            close(fd);
+            efree(filepath);
+            return;
+        }
+        
+        file = php_can_server_file_add(request->file_cache, filepath, filepath_len, fd, &st);
     }
+    st = file->st;
     
-    struct php_can_server_request *request = (struct php_can_server_request*)
-        zend_object_store_get_object(getThis() TSRMLS_CC);
-    
-    // generate and add ETag
-    char *etag = NULL;
-    int etag_len = spprintf(&etag, 0, "\"%x-%x-%x\"", (int)st.st_ino, (int)st.st_mtime, (int)st.st_size);
+    // add ETag
+    char *etag = estrndup(file->etag, file->etag_len);
+    int etag_len = file->etag_len;
     evhttp_add_header(request->req->output_headers, "ETag", etag);
     
     // handle $mimetype
-    if (mimetype_len == 0) {
+    if (mimetype_len == 0 && file->mimetype != NULL) {
+        
+        // detected when the file was served before
+        evhttp_add_header(request->req->output_headers, "Content-Type", file->mimetype);
+        
+    } else if (mimetype_len == 0) {
         
         if (has_finfo == -1) {
             has_finfo = zend_lookup_class("\\finfo", sizeof("\\finfo") - 1, &finfo_cep TSRMLS_CC) == SUCCESS ? 
@@ -1075,6 +1413,7 @@ static PHP_METHOD(CanServerRequest, sendFile)
                     MAKE_STD_ZVAL(mtype);
                     ZVAL_STRING(mtype, default_mimetype, 1);
                     zend_hash_add(mimetypes, etag, etag_len + 1, (void **)mtype, sizeof(zval), NULL);
+                    php_can_server_file_release(file);
                     efree(filepath);
                     efree(etag);
                     return;
@@ -1096,6 +1435,7 @@ static PHP_METHOD(CanServerRequest, sendFile)
                     MAKE_STD_ZVAL(mtype);
                     ZVAL_STRING(mtype, default_mimetype, 1);
                     zend_hash_add(mimetypes, etag, etag_len + 1, (void **)mtype, sizeof(zval), NULL);
+                    php_can_server_file_release(file);
                     efree(filepath);
                     efree(etag);
                     return;
@@ -1139,6 +1479,13 @@ static PHP_METHOD(CanServerRequest, sendFile)
         evhttp_add_header(request->req->output_headers, "Content-Type", mimetype);
     }
     
+    if (mimetype_len == 0 && file->mimetype == NULL) {
+        const char *detected = evhttp_find_header(request->req->output_headers, "Content-Type");
+        if (detected != NULL) {
+            file->mimetype = estrdup(detected);
+        }
+    }
+    
     // handle $download
     if (download) { 
         char *basename = NULL;
@@ -1157,13 +1504,27 @@ static PHP_METHOD(CanServerRequest, sendFile)
         }
     }
     
+    // serve a precompressed sibling if there is one the client accepts,
+    // ranges are always served from the file itself
+    if (PHP_CAN_REQUEST_HEADER(request, RANGE) == NULL
+        && use_precompressed(request, filepath, &file) >= 0
+    ) {
+        st = file->st;
+        // every variant needs an ETag of its own
+        efree(etag);
+        etag_len = spprintf(&etag, 0, "\"%x-%x-%x-%s\"", (int)st.st_ino, (int)st.st_mtime, (int)st.st_size,
+            evhttp_find_header(request->req->output_headers, "Content-Encoding"));
+        evhttp_remove_header(request->req->output_headers, "ETag");
+        evhttp_add_header(request->req->output_headers, "ETag", etag);
+    }
+    
     efree(filepath);
     
     // add Accept-Ranges header to notify client that we can handle renged requests
     evhttp_add_header(request->req->output_headers, "Accept-Ranges", "bytes");
     
     // check if client gave us ETag in header
-    const char *client_etag = evhttp_find_header(request->req->input_headers, "If-None-Match");
+    const char *client_etag = PHP_CAN_REQUEST_HEADER(request, IF_NONE_MATCH);
     if (client_etag != NULL && strcmp(client_etag, etag) == 0) {
         
         // ETags are the same 
@@ -1173,9 +1534,12 @@ static PHP_METHOD(CanServerRequest, sendFile)
     } else {
         
         // ETag is not the same or unknown, so check client's modification stamp
-        const char *client_lm = evhttp_find_header(request->req->input_headers, "If-Modified-Since");
+        const char *client_lm = PHP_CAN_REQUEST_HEADER(request, IF_MODIFIED_SINCE);
         int client_ts = 0;
-        if (client_lm != NULL) {
+        if (client_lm != NULL && file->last_modified != NULL && strcmp(client_lm, file->last_modified) == 0) {
+            // client sent back the stamp we gave it, no need to parse it
+            client_ts = st.st_mtime;
+        } else if (client_lm != NULL) {
             zval retval, *strtotime, *time, *args[1];
             MAKE_STD_ZVAL(strtotime); ZVAL_STRING(strtotime, "strtotime", 1);
             MAKE_STD_ZVAL(time); ZVAL_STRING(time, client_lm, 1);
@@ -1200,28 +1564,27 @@ static PHP_METHOD(CanServerRequest, sendFile)
 
         } else {
 
-            // generate and add Last-Modified header
-            char *lm = NULL;
-            zval retval, *gmstrftime, *format, *timestamp, *args[2];
-            MAKE_STD_ZVAL(gmstrftime); ZVAL_STRING(gmstrftime, "gmstrftime", 1);
-            MAKE_STD_ZVAL(format); ZVAL_STRING(format, "%a, %d %b %Y %H:%M:%S GMT", 1);
-            MAKE_STD_ZVAL(timestamp); ZVAL_LONG(timestamp, st.st_mtime);
-            args[0] = format; args[1] = timestamp;
-            Z_ADDREF_P(args[0]); Z_ADDREF_P(args[1]);
-            if (call_user_function(EG(function_table), NULL, gmstrftime, &retval, 2, args TSRMLS_CC) == SUCCESS) {
-                if (Z_TYPE(retval) == IS_STRING) {
-                    lm = estrndup(Z_STRVAL(retval), Z_STRLEN(retval));
+            // generate once and add Last-Modified header
+            if (file->last_modified == NULL) {
+                zval retval, *gmstrftime, *format, *timestamp, *args[2];
+                MAKE_STD_ZVAL(gmstrftime); ZVAL_STRING(gmstrftime, "gmstrftime", 1);
+                MAKE_STD_ZVAL(format); ZVAL_STRING(format, "%a, %d %b %Y %H:%M:%S GMT", 1);
+                MAKE_STD_ZVAL(timestamp); ZVAL_LONG(timestamp, st.st_mtime);
+                args[0] = format; args[1] = timestamp;
+                Z_ADDREF_P(args[0]); Z_ADDREF_P(args[1]);
+                if (call_user_function(EG(function_table), NULL, gmstrftime, &retval, 2, args TSRMLS_CC) == SUCCESS) {
+                    if (Z_TYPE(retval) == IS_STRING) {
+                        file->last_modified = estrndup(Z_STRVAL(retval), Z_STRLEN(retval));
+                    }
+                    zval_dtor(&retval);
                 }
-                zval_dtor(&retval);
+                Z_DELREF_P(args[0]); Z_DELREF_P(args[1]);
+                zval_ptr_dtor(&format);
+                zval_ptr_dtor(&timestamp);
+                zval_ptr_dtor(&gmstrftime);
             }
-            Z_DELREF_P(args[0]); Z_DELREF_P(args[1]);
-            zval_ptr_dtor(&format);
-            zval_ptr_dtor(&timestamp);
-            zval_ptr_dtor(&gmstrftime);
-        
-            if (lm != NULL) {
-                evhttp_add_header(request->req->output_headers, "Last-Modified", lm);
-                efree(lm);
+            if (file->last_modified != NULL) {
+                evhttp_add_header(request->req->output_headers, "Last-Modified", file->last_modified);
             }
             
             // if request method is HEAD, just add Content-Length header
@@ -1237,7 +1600,7 @@ static PHP_METHOD(CanServerRequest, sendFile)
             
                 // check if the client requested the ranged content
                 long range_from = 0, range_to = st.st_size, range_len;
-                char *range = (char *)evhttp_find_header(request->req->input_headers, "Range");
+                char *range = (char *)PHP_CAN_REQUEST_HEADER(request, RANGE);
                 if (range != NULL) {
                     int pos = php_can_strpos(range, "bytes=", 0);
                     if (FAILURE != pos) {
@@ -1299,7 +1662,15 @@ static PHP_METHOD(CanServerRequest, sendFile)
                     }
                     request->response_len = range_len;
                     struct evbuffer *buffer = evbuffer_new();
-                    evbuffer_add_file(buffer, fd, range_from, range_len);
+                    // the buffer closes the descriptor it gets, the file stays open
+                    int body_fd = dup(file->fd);
+                    if (body_fd >= 0) {
+                        evbuffer_add_file(buffer, body_fd, range_from, range_len);
+                    } else {
+                        evhttp_remove_header(request->req->output_headers, "Content-Range");
+                        request->response_code = 500;
+                        request->response_len = 0;
+                    }
                     evhttp_send_reply(request->req, request->response_code, NULL, buffer);
                     evbuffer_free(buffer);
                 }
@@ -1307,6 +1678,7 @@ static PHP_METHOD(CanServerRequest, sendFile)
         }
     }
     request->status = PHP_CAN_SERVER_RESPONSE_STATUS_SENT;
+    php_can_server_file_release(file);
     efree(etag);
 }
 
@@ -1350,6 +1722,10 @@ static PHP_METHOD(CanServerRequest, sendResponseStart)
         return;
     }
     
+    if (request->compression != NULL) {
+        request->compress = php_can_server_compress_start(request->compression, request->req,
+                &request->headers, Z_LVAL_P(status), -1);
+    }
     evhttp_send_reply_start(request->req, Z_LVAL_P(status), reason != NULL ? Z_STRVAL_P(reason) : NULL);
 
     request->status = PHP_CAN_SERVER_RESPONSE_STATUS_SENDING;
@@ -1391,6 +1767,7 @@ static PHP_METHOD(CanServerRequest, sendResponseChunk)
     if (Z_STRLEN_P(chunk) > 0) {
         struct evbuffer *buffer = evbuffer_new();
         evbuffer_add(buffer, Z_STRVAL_P(chunk), Z_STRLEN_P(chunk));
+        php_can_server_compress_chunk(request, buffer);
         evhttp_send_reply_chunk(request->req, buffer);
         evbuffer_free(buffer);
         request->response_len += Z_STRLEN_P(chunk);
@@ -1413,6 +1790,7 @@ static PHP_METHOD(CanServerRequest, sendResponseEnd)
         return;
     }
 
+    php_can_server_compress_end(request);
     evhttp_send_reply_end(request->req);
 
     request->status = PHP_CAN_SERVER_RESPONSE_STATUS_SENT;
@@ -1423,6 +1801,7 @@ static zend_function_entry server_request_methods[] = {
     PHP_ME(CanServerRequest, findRequestHeader,    NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
     PHP_ME(CanServerRequest, findResponseHeader,   NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
     PHP_ME(CanServerRequest, getRequestBody,       NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
+    PHP_ME(CanServerRequest, getJson,              NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
     PHP_ME(CanServerRequest, getResponseBody,      NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
     PHP_ME(CanServerRequest, setResponseBody,      NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
     PHP_ME(CanServerRequest, addResponseHeader,    NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
@@ -1462,6 +1841,8 @@ static void server_request_init(TSRMLS_D)
         PHP_CAN_SERVER_RESPONSE_STATUS_SENT);
     PHP_CAN_REGISTER_CLASS_CONST_LONG(ce_can_server_request, "STATUS_FORWARD",
         PHP_CAN_SERVER_RESPONSE_STATUS_FORWARD);
+    PHP_CAN_REGISTER_CLASS_CONST_LONG(ce_can_server_request, "STATUS_STREAMING",
+        PHP_CAN_SERVER_RESPONSE_STATUS_STREAMING);
 }
 
 PHP_MINIT_FUNCTION(can_server_request)
@@ -1482,5 +1863,10 @@ PHP_RINIT_FUNCTION(can_server_request)
 
 PHP_RSHUTDOWN_FUNCTION(can_server_request)
 {
+    if (variants != NULL) {
+        zend_hash_destroy(variants);
+        FREE_HASHTABLE(variants);
+        variants = NULL;
+    }
     return SUCCESS;
 }
@@ -36,6 +36,17 @@ static zend_object_value server_route_ctor(zend_class_entry *ce TSRMLS_DC)
     route->regexp = NULL;
     route->route = NULL;
     route->casts = NULL;
+    route->params = NULL;
+    route->params_len = 0;
+    route->plan_resolved = 0;
+    route->ratelimit = NULL;
+    route->cors = NULL;
+    route->body_handler = NULL;
+    route->upload_handler = NULL;
+    route->before_body = NULL;
+    route->max_header_size = 0;
+    route->max_body_size = 0;
+    route->body_timeout = 0;
     retval.handle = zend_objects_store_put(route,       
             (zend_objects_store_dtor_t)zend_objects_destroy_object,
             server_route_dtor,
@@ -44,9 +55,12 @@ static zend_object_value server_route_ctor(zend_class_entry *ce TSRMLS_DC)
     return retval;
 }
 
-static void server_route_dtor(void *object TSRMLS_DC)
+/**
+ * Release members shared by Route and WebSocketRoute
+ */
+void php_can_server_route_free(struct php_can_server_route *route TSRMLS_DC)
 {
-    struct php_can_server_route *route = (struct php_can_server_route*)object;
+    int i;
 
     if (route->handler) {
         zval_ptr_dtor(&route->handler);
@@ -66,12 +80,168 @@ static void server_route_dtor(void *object TSRMLS_DC)
         zval_ptr_dtor(&route->casts);
     }
 
+    if (route->ratelimit) {
+        zval_ptr_dtor(&route->ratelimit);
+        route->ratelimit = NULL;
+    }
+
+    if (route->cors) {
+        zval_ptr_dtor(&route->cors);
+        route->cors = NULL;
+    }
+
+    if (route->body_handler) {
+        zval_ptr_dtor(&route->body_handler);
+        route->body_handler = NULL;
+    }
+
+    if (route->upload_handler) {
+        zval_ptr_dtor(&route->upload_handler);
+        route->upload_handler = NULL;
+    }
+
+    if (route->before_body) {
+        zval_ptr_dtor(&route->before_body);
+        route->before_body = NULL;
+    }
+
+    for (i = 0; i < route->params_len; i++) {
+        efree(route->params[i].name);
+    }
+    if (route->params) {
+        efree(route->params);
+        route->params = NULL;
+    }
+}
+
+static void server_route_dtor(void *object TSRMLS_DC)
+{
+    struct php_can_server_route *route = (struct php_can_server_route*)object;
+
+    php_can_server_route_free(route TSRMLS_CC);
+
     zend_objects_store_del_ref(&route->refhandle TSRMLS_CC);
     zend_object_std_dtor(&route->std TSRMLS_CC);
     efree(route);
 
 }
 
+/**
+ * Compile the route URI into a regexp, every placeholder becomes
+ * a named group and typed placeholders are registered in casts
+ */
+void php_can_server_route_compile(struct php_can_server_route *route, const char *uri, int uri_len TSRMLS_DC)
+{
+    MAKE_STD_ZVAL(route->casts);
+    array_init(route->casts);
+
+    if (memchr(uri, '<', uri_len) != NULL && memchr(uri, '>', uri_len) != NULL) {
+        smart_str regexp = {0};
+        int i;
+
+        smart_str_appendl(&regexp, "\1^", 2);
+        for (i = 0; i < uri_len; i++) {
+            const char *end;
+            if (uri[i] != '<' || NULL == (end = memchr(uri + i, '>', uri_len - i))) {
+                smart_str_appendc(&regexp, uri[i]);
+                continue;
+            }
+
+            const char *name = uri + i + 1, *filter = memchr(name, ':', end - name);
+            int name_len = (filter ? filter : end) - name, filter_len = 0;
+            const char *pattern = "[^/]+";
+            int pattern_len = sizeof("[^/]+") - 1, cast = 0;
+
+            if (filter) {
+                filter++;
+                filter_len = end - filter;
+                if (filter_len == sizeof("int") - 1 && 0 == memcmp(filter, "int", filter_len)) {
+                    pattern = "-?[0-9]+";
+                    cast = IS_LONG;
+                } else if (filter_len == sizeof("float") - 1 && 0 == memcmp(filter, "float", filter_len)) {
+                    pattern = "-?[0-9.]+";
+                    cast = IS_DOUBLE;
+                } else if (filter_len == sizeof("path") - 1 && 0 == memcmp(filter, "path", filter_len)) {
+                    pattern = ".+?";
+                    cast = IS_PATH;
+                } else if (filter_len >= sizeof("re:") - 1 && 0 == memcmp(filter, "re:", sizeof("re:") - 1)) {
+                    pattern = filter + sizeof("re:") - 1;
+                    if (pattern == end) {
+                        smart_str_free(&regexp);
+                        php_can_throw_exception(
+                            ce_can_InvalidParametersException TSRMLS_CC,
+                            "Empty regular expression in placeholder '%.*s'",
+                            name_len, name
+                        );
+                        return;
+                    }
+                }
+                pattern_len = (pattern >= filter && pattern <= end) ? end - pattern : strlen(pattern);
+            }
+
+            smart_str_appendl(&regexp, "(?<", 3);
+            smart_str_appendl(&regexp, name, name_len);
+            smart_str_appendc(&regexp, '>');
+            smart_str_appendl(&regexp, pattern, pattern_len);
+            smart_str_appendc(&regexp, ')');
+
+            if (cast) {
+                char *var = estrndup(name, name_len);
+                add_assoc_long_ex(route->casts, var, name_len + 1, cast);
+                efree(var);
+            }
+            i = end - uri;
+        }
+        smart_str_appendl(&regexp, "$\1", 2);
+        smart_str_0(&regexp);
+        route->regexp = regexp.c;
+    }
+
+    route->route = estrndup(uri, uri_len);
+}
+
+/**
+ * Build the group to param plan of the route from the name table
+ * of the compiled regexp, group numbers do not change on recompile
+ */
+void php_can_server_route_resolve_plan(struct php_can_server_route *route, pcre_cache_entry *pce TSRMLS_DC)
+{
+    int count = 0, entry_size = 0, i, y;
+    char *table = NULL;
+    zval **cast;
+
+    pcre_fullinfo(pce->re, pce->extra, PCRE_INFO_CAPTURECOUNT, &route->capture_count);
+    pcre_fullinfo(pce->re, pce->extra, PCRE_INFO_NAMECOUNT, &count);
+
+    if (count > 0) {
+        pcre_fullinfo(pce->re, pce->extra, PCRE_INFO_NAMEENTRYSIZE, &entry_size);
+        pcre_fullinfo(pce->re, pce->extra, PCRE_INFO_NAMETABLE, &table);
+
+        route->params = safe_emalloc(count, sizeof(*route->params), 0);
+        for (i = 0; i < count; i++) {
+            struct php_can_server_route_param param;
+            unsigned char *entry = (unsigned char *)table + i * entry_size;
+
+            param.group = (entry[0] << 8) | entry[1];
+            param.name_len = strlen((char *)entry + 2);
+            param.name = estrndup((char *)entry + 2, param.name_len);
+            param.cast = IS_STRING;
+            if (route->casts && SUCCESS == zend_hash_find(Z_ARRVAL_P(route->casts),
+                    param.name, param.name_len + 1, (void **)&cast)) {
+                param.cast = Z_LVAL_PP(cast);
+            }
+
+            // the name table is sorted by name, keep params in group order
+            for (y = i; y > 0 && route->params[y - 1].group > param.group; y--) {
+                route->params[y] = route->params[y - 1];
+            }
+            route->params[y] = param;
+        }
+        route->params_len = count;
+    }
+    route->plan_resolved = 1;
+}
+
 /**
  * Constructor
  */
@@ -129,49 +299,7 @@ static PHP_METHOD(CanServerRoute, __construct)
         );
     }
     
-    MAKE_STD_ZVAL(route->casts);
-    array_init(route->casts);
-    
-    if (FAILURE != php_can_strpos(Z_STRVAL_P(uri), "<", 0) && FAILURE != php_can_strpos(Z_STRVAL_P(uri), ">", 0)) {
-        int i;
-        for (i = 0; i < Z_STRLEN_P(uri); i++) {
-            if (Z_STRVAL_P(uri)[i] != '<') {
-                spprintf(&route->regexp, 0, "%s%c", route->regexp == NULL ? "" : route->regexp, Z_STRVAL_P(uri)[i]);
-            } else {
-                int y = php_can_strpos(Z_STRVAL_P(uri), ">", i);
-                char *name = php_can_substr(Z_STRVAL_P(uri), i + 1, y - (i + 1));
-                int pos = php_can_strpos(name, ":", 0);
-                if (FAILURE != pos) {
-                    char *var = php_can_substr(name, 0, pos);
-                    char *filter = php_can_substr(name, pos + 1, strlen(name) - (pos + 1));
-                    if (strcmp(filter, "int") == 0) {
-                        spprintf(&route->regexp, 0, "%s(?<%s>%s)", route->regexp, var, "-?[0-9]+");
-                        add_assoc_long(route->casts, var, IS_LONG);
-                    } else if (0 == strcmp(filter, "float")) {
-                        spprintf(&route->regexp, 0, "%s(?<%s>%s)", route->regexp, var, "-?[0-9.]+");
-                        add_assoc_long(route->casts, var, IS_DOUBLE);
-                    } else if (0 == strcmp(filter, "path")) {
-                        spprintf(&route->regexp, 0, "%s(?<%s>%s)", route->regexp, var, ".+?");
-                        add_assoc_long(route->casts, var, IS_PATH);
-                    } else if (0 == (pos = php_can_strpos(filter, "re:", 0))) {
-                        char *reg = php_can_substr(filter, pos + 3, strlen(filter) - (pos + 3));
-                        spprintf(&route->regexp, 0, "%s(?<%s>%s)", route->regexp, var, reg);
-                        efree(reg);
-                    }
-                    efree(filter);
-                    efree(var);
-                    
-                } else {
-                    spprintf(&route->regexp, 0, "%s(?<%s>[^/]+)", route->regexp, name);
-                }
-                efree(name);
-                i = y;
-            }
-        }
-        spprintf(&route->regexp, 0, "\1^%s$\1", route->regexp);
-    }
-    
-    route->route = estrndup(Z_STRVAL_P(uri), Z_STRLEN_P(uri));
+    php_can_server_route_compile(route, Z_STRVAL_P(uri), Z_STRLEN_P(uri) TSRMLS_CC);
 
 }
 
@@ -305,6 +433,203 @@ static PHP_METHOD(CanServerRoute, setMethod)
     }
 }
 
+/**
+ * Set rate limit of the route, pass the same limit to several
+ * routes to limit them as a group
+ */
+static PHP_METHOD(CanServerRoute, setRateLimit)
+{
+    zval *zlimit = NULL;
+    if (FAILURE == zend_parse_parameters_ex(ZEND_PARSE_PARAMS_QUIET, ZEND_NUM_ARGS() TSRMLS_CC,
+            "O!", &zlimit, ce_can_server_ratelimit)) {
+        zchar *space, *class_name = get_active_class_name(&space TSRMLS_CC);
+        php_can_throw_exception(
+            ce_can_InvalidParametersException TSRMLS_CC,
+            "%s%s%s(RateLimit $limit)",
+            class_name, space, get_active_function_name(TSRMLS_C)
+        );
+        return;
+    }
+
+    struct php_can_server_route *route = (struct php_can_server_route*)
+        zend_object_store_get_object(getThis() TSRMLS_CC);
+
+    if (route->ratelimit) {
+        zval_ptr_dtor(&route->ratelimit);
+        route->ratelimit = NULL;
+    }
+    if (zlimit) {
+        zval_add_ref(&zlimit);
+        route->ratelimit = zlimit;
+    }
+}
+
+/**
+ * Set CORS policy of the route
+ */
+static PHP_METHOD(CanServerRoute, setCors)
+{
+    zval *zcors = NULL;
+    if (FAILURE == zend_parse_parameters_ex(ZEND_PARSE_PARAMS_QUIET, ZEND_NUM_ARGS() TSRMLS_CC,
+            "O!", &zcors, ce_can_server_cors)) {
+        zchar *space, *class_name = get_active_class_name(&space TSRMLS_CC);
+        php_can_throw_exception(
+            ce_can_InvalidParametersException TSRMLS_CC,
+            "%s%s%s(Cors $cors)",
+            class_name, space, get_active_function_name(TSRMLS_C)
+        );
+        return;
+    }
+
+    struct php_can_server_route *route = (struct php_can_server_route*)
+        zend_object_store_get_object(getThis() TSRMLS_CC);
+
+    if (route->cors) {
+        zval_ptr_dtor(&route->cors);
+        route->cors = NULL;
+    }
+    if (zcors) {
+        zval_add_ref(&zcors);
+        route->cors = zcors;
+    }
+}
+
+/**
+ * Parse the callable or null passed to a callback setter, throws and
+ * returns FAILURE if it is neither
+ */
+static int parse_callback(INTERNAL_FUNCTION_PARAMETERS, const char *signature, zval **handler)
+{
+    char *func_name;
+
+    if (FAILURE == zend_parse_parameters_ex(ZEND_PARSE_PARAMS_QUIET, ZEND_NUM_ARGS() TSRMLS_CC,
+            "z!", handler)) {
+        zchar *space, *class_name = get_active_class_name(&space TSRMLS_CC);
+        php_can_throw_exception(
+            ce_can_InvalidParametersException TSRMLS_CC,
+            "%s%s%s(%s)",
+            class_name, space, get_active_function_name(TSRMLS_C), signature
+        );
+        return FAILURE;
+    }
+
+    if (*handler && !zend_is_callable(*handler, 0, &func_name TSRMLS_CC)) {
+        php_can_throw_exception(
+            ce_can_InvalidCallbackException TSRMLS_CC,
+            "Handler '%s' is not a valid callback",
+            func_name
+        );
+        efree(func_name);
+        return FAILURE;
+    }
+    if (*handler) {
+        efree(func_name);
+    }
+    return SUCCESS;
+}
+
+/**
+ * Replace a callback of the route, NULL removes it
+ */
+static void replace_callback(zval **slot, zval *handler)
+{
+    if (*slot) {
+        zval_ptr_dtor(slot);
+        *slot = NULL;
+    }
+    if (handler) {
+        zval_add_ref(&handler);
+        *slot = handler;
+    }
+}
+
+/**
+ * Receive the request body through a callback as it arrives instead
+ * of having it buffered, the callback gets the request and the chunk
+ */
+static PHP_METHOD(CanServerRoute, setBodyHandler)
+{
+    zval *handler = NULL;
+
+    if (FAILURE == parse_callback(INTERNAL_FUNCTION_PARAM_PASSTHRU, "callable $handler", &handler)) {
+        return;
+    }
+
+    struct php_can_server_route *route = (struct php_can_server_route*)
+        zend_object_store_get_object(getThis() TSRMLS_CC);
+
+    replace_callback(&route->body_handler, handler);
+}
+
+/**
+ * Limit the header block and the body of requests to the route, and
+ * the seconds the body may take to arrive between two reads. 0 keeps
+ * the limit of the server.
+ */
+static PHP_METHOD(CanServerRoute, setLimits)
+{
+    long max_header_size = 0, max_body_size = 0, body_timeout = 0;
+
+    if (FAILURE == zend_parse_parameters_ex(ZEND_PARSE_PARAMS_QUIET, ZEND_NUM_ARGS() TSRMLS_CC,
+            "ll|l", &max_header_size, &max_body_size, &body_timeout)
+            || max_header_size < 0 || max_body_size < 0 || body_timeout < 0) {
+        zchar *space, *class_name = get_active_class_name(&space TSRMLS_CC);
+        php_can_throw_exception(
+            ce_can_InvalidParametersException TSRMLS_CC,
+            "%s%s%s(int $maxHeaderSize, int $maxBodySize[, int $bodyTimeout])",
+            class_name, space, get_active_function_name(TSRMLS_C)
+        );
+        return;
+    }
+
+    struct php_can_server_route *route = (struct php_can_server_route*)
+        zend_object_store_get_object(getThis() TSRMLS_CC);
+
+    route->max_header_size = max_header_size;
+    route->max_body_size = max_body_size;
+    route->body_timeout = (int)body_timeout;
+}
+
+/**
+ * Check requests on their headers before the body is read, the hook
+ * gets the request and the route params and throws HTTPError to
+ * reject the request. Clients expecting 100-continue get the answer
+ * before they send the body.
+ */
+static PHP_METHOD(CanServerRoute, setBeforeBody)
+{
+    zval *handler = NULL;
+
+    if (FAILURE == parse_callback(INTERNAL_FUNCTION_PARAM_PASSTHRU, "callable $hook", &handler)) {
+        return;
+    }
+
+    struct php_can_server_route *route = (struct php_can_server_route*)
+        zend_object_store_get_object(getThis() TSRMLS_CC);
+
+    replace_callback(&route->before_body, handler);
+}
+
+/**
+ * Pass uploaded files to a callback as they arrive instead of writing
+ * temporary files. The callback is called for every chunk of every
+ * file part of a request with the request, the part (name, filename
+ * and type), the chunk and whether it is the last chunk of the part.
+ */
+static PHP_METHOD(CanServerRoute, setUploadHandler)
+{
+    zval *handler = NULL;
+
+    if (FAILURE == parse_callback(INTERNAL_FUNCTION_PARAM_PASSTHRU, "callable $handler", &handler)) {
+        return;
+    }
+
+    struct php_can_server_route *route = (struct php_can_server_route*)
+        zend_object_store_get_object(getThis() TSRMLS_CC);
+
+    replace_callback(&route->upload_handler, handler);
+}
+
 /**
  * Default request handler
  */
@@ -317,11 +642,17 @@ static PHP_METHOD(CanServerRoute, handleRequest)
 }
 
 static zend_function_entry server_route_methods[] = {
-    PHP_ME(CanServerRoute, __construct,   NULL, ZEND_ACC_PUBLIC)
-    PHP_ME(CanServerRoute, getUri,        NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
-    PHP_ME(CanServerRoute, getMethod,     NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
-    PHP_ME(CanServerRoute, setMethod,     NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
-    PHP_ME(CanServerRoute, handleRequest, NULL, ZEND_ACC_PUBLIC)
+    PHP_ME(CanServerRoute, __construct,      NULL, ZEND_ACC_PUBLIC)
+    PHP_ME(CanServerRoute, getUri,           NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
+    PHP_ME(CanServerRoute, getMethod,        NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
+    PHP_ME(CanServerRoute, setMethod,        NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
+    PHP_ME(CanServerRoute, setRateLimit,     NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
+    PHP_ME(CanServerRoute, setCors,          NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
+    PHP_ME(CanServerRoute, setBodyHandler,   NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
+    PHP_ME(CanServerRoute, setUploadHandler, NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
+    PHP_ME(CanServerRoute, setBeforeBody,    NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
+    PHP_ME(CanServerRoute, setLimits,        NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
+    PHP_ME(CanServerRoute, handleRequest,    NULL, ZEND_ACC_PUBLIC)
     {NULL, NULL, NULL}
 };
 
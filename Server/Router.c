@@ -19,12 +19,12 @@
 #include "Server.h"
 
 #define add_to_maps(METHOD) { \
-    if (!zend_hash_exists(Z_ARRVAL_P(router->method_routes), METHOD, sizeof(METHOD))) {\
+    if (!zend_hash_exists(Z_ARRVAL_P(table->method_routes), METHOD, sizeof(METHOD))) {\
         zval *tmp; MAKE_STD_ZVAL(tmp); array_init(tmp);                                \
-        add_assoc_zval(router->method_routes, METHOD, tmp);                            \
+        add_assoc_zval(table->method_routes, METHOD, tmp);                             \
     }                                                                                  \
     zval **arr;                                                                        \
-    if (SUCCESS == zend_hash_find(Z_ARRVAL_P(router->method_routes),                   \
+    if (SUCCESS == zend_hash_find(Z_ARRVAL_P(table->method_routes),                    \
                 METHOD, sizeof(METHOD), (void **)&arr)) {                              \
         if (route->regexp == NULL) {                                                   \
             add_assoc_long(*arr, route->route, numkey);                                \
@@ -34,6 +34,12 @@
     }                                                                                  \
 }
 
+#define SEGMENT_LITERAL     0
+#define SEGMENT_PARAM       1
+#define SEGMENT_PARAM_INT   2
+#define SEGMENT_PARAM_FLOAT 3
+#define SEGMENT_WILDCARD    4
+
 zend_class_entry *ce_can_server_router;
 static zend_object_handlers server_router_obj_handlers;
 
@@ -49,8 +55,12 @@ static zend_object_value server_router_ctor(zend_class_entry *ce TSRMLS_DC)
     PHP_CAN_INIT_OBJ_PROPS(router, ce);
     router->pos = -1;
     router->routes = NULL;
-    router->method_routes = NULL;
-    router->route_methods = NULL;
+    router->route_hosts = NULL;
+    router->middlewares = NULL;
+    router->ratelimit = NULL;
+    router->cors = NULL;
+    router->table = NULL;
+    router->dirty = 0;
     retval.handle = zend_objects_store_put(router,
             (zend_objects_store_dtor_t)zend_objects_destroy_object,
             server_router_dtor,
@@ -67,12 +77,24 @@ static void server_router_dtor(void *object TSRMLS_DC)
         zval_ptr_dtor(&router->routes);
     }
 
-    if (router->method_routes) {
-        zval_ptr_dtor(&router->method_routes);
+    if (router->route_hosts) {
+        zval_ptr_dtor(&router->route_hosts);
+    }
+
+    if (router->middlewares) {
+        zval_ptr_dtor(&router->middlewares);
+    }
+
+    if (router->ratelimit) {
+        zval_ptr_dtor(&router->ratelimit);
+    }
+
+    if (router->cors) {
+        zval_ptr_dtor(&router->cors);
     }
-    
-    if (router->route_methods) {
-        zval_ptr_dtor(&router->route_methods);
+
+    if (router->table) {
+        php_can_server_router_table_release(router->table TSRMLS_CC);
     }
 
     zend_objects_store_del_ref(&router->refhandle TSRMLS_CC);
@@ -81,19 +103,196 @@ static void server_router_dtor(void *object TSRMLS_DC)
 
 }
 
-static void add_route(struct php_can_server_router *router, 
-        struct php_can_server_route *route, ulong numkey TSRMLS_DC)
+/**
+ * Classify a single URI segment of the route pattern
+ */
+static int segment_kind(const char *seg, int len)
+{
+    const char *lt = memchr(seg, '<', len);
+
+    if (lt == NULL) {
+        int i;
+        // literals are compiled into the regexp as they are,
+        // so regexp metacharacters may match other paths too
+        for (i = 0; i < len; i++) {
+            if (strchr(".\\+*?[^]$(){}|", seg[i]) != NULL) {
+                return SEGMENT_WILDCARD;
+            }
+        }
+        return SEGMENT_LITERAL;
+    }
+    if (lt != seg || seg[len - 1] != '>' || memchr(seg + 1, '<', len - 1) != NULL) {
+        // literal mixed with placeholders or several placeholders in one segment
+        return SEGMENT_WILDCARD;
+    }
+
+    const char *colon = memchr(seg, ':', len);
+    if (colon == NULL) {
+        return SEGMENT_PARAM;
+    }
+    len -= (colon + 1 - seg) + 1;
+    if (len == sizeof("int") - 1 && 0 == memcmp(colon + 1, "int", len)) {
+        return SEGMENT_PARAM_INT;
+    }
+    if (len == sizeof("float") - 1 && 0 == memcmp(colon + 1, "float", len)) {
+        return SEGMENT_PARAM_FLOAT;
+    }
+    // path and re: placeholders may span or constrain segments arbitrarily
+    return SEGMENT_WILDCARD;
+}
+
+/**
+ * Check whether a literal segment may be matched by a placeholder
+ */
+static int segment_accepts(int kind, const char *seg, int len)
+{
+    int i = 0;
+
+    if (len == 0) {
+        return 0;
+    }
+    if (kind == SEGMENT_PARAM) {
+        return 1;
+    }
+    if (seg[0] == '-') {
+        i++;
+    }
+    for (; i < len; i++) {
+        if (!isdigit((unsigned char)seg[i]) && !(kind == SEGMENT_PARAM_FLOAT && seg[i] == '.')) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Conservatively determine whether two route patterns may match
+ * the same path. False positives only cost reordering freedom,
+ * false negatives would change which route wins, so anything we
+ * cannot prove disjoint is reported as an overlap.
+ */
+static int routes_may_overlap(const char *a, const char *b)
+{
+    while (1) {
+        const char *ea = strchr(a, '/'), *eb = strchr(b, '/');
+        int la = ea ? ea - a : strlen(a),
+            lb = eb ? eb - b : strlen(b),
+            ka = segment_kind(a, la),
+            kb = segment_kind(b, lb);
+
+        if (ka == SEGMENT_WILDCARD || kb == SEGMENT_WILDCARD) {
+            return 1;
+        }
+        if (ka == SEGMENT_LITERAL && kb == SEGMENT_LITERAL) {
+            if (la != lb || memcmp(a, b, la) != 0) {
+                return 0;
+            }
+        } else if (ka == SEGMENT_LITERAL) {
+            if (!segment_accepts(kb, a, la)) {
+                return 0;
+            }
+        } else if (kb == SEGMENT_LITERAL) {
+            if (!segment_accepts(ka, b, lb)) {
+                return 0;
+            }
+        }
+
+        if (ea == NULL || eb == NULL) {
+            // different number of segments cannot match the same path
+            return ea == NULL && eb == NULL;
+        }
+        a = ea + 1;
+        b = eb + 1;
+    }
+}
+
+static int method_index(int type)
 {
-    if (router->method_routes == NULL) {
-        MAKE_STD_ZVAL(router->method_routes);
-        array_init(router->method_routes);
+    int i;
+    for (i = 0; i < PHP_CAN_SERVER_ROUTE_METHODS; i++) {
+        if (type == (1 << i)) {
+            return i;
+        }
     }
-    
-    if (router->route_methods == NULL) {
-        MAKE_STD_ZVAL(router->route_methods);
-        array_init(router->route_methods);
+    return -1;
+}
+
+static int entries_conflict(struct php_can_server_router_entry *a, struct php_can_server_router_entry *b)
+{
+    int i;
+    for (i = 0; i < a->conflicts_len; i++) {
+        if (a->conflicts[i] == b->index) {
+            return 1;
+        }
     }
-    add_assoc_long(router->route_methods, route->regexp != NULL ? route->regexp : route->route, route->methods);
+    return 0;
+}
+
+static void add_conflict(struct php_can_server_router_entry *entry, long index)
+{
+    entry->conflicts = erealloc(entry->conflicts, (entry->conflicts_len + 1) * sizeof(long));
+    entry->conflicts[entry->conflicts_len++] = index;
+}
+
+static void add_dynamic_route(struct php_can_server_router_dynamic *dynamic,
+        struct php_can_server_route *route, ulong numkey)
+{
+    struct php_can_server_router_entry *entry;
+    int i;
+
+    if (dynamic->len == dynamic->size) {
+        dynamic->size = dynamic->size ? dynamic->size * 2 : 8;
+        dynamic->entries = erealloc(dynamic->entries, dynamic->size * sizeof(*entry));
+    }
+
+    entry = &dynamic->entries[dynamic->len];
+    memset(entry, 0, sizeof(*entry));
+    entry->route = route;
+    entry->uri = estrdup(route->route);
+    entry->regexp_len = strlen(route->regexp);
+    entry->regexp = estrndup(route->regexp, entry->regexp_len);
+    entry->index = numkey;
+
+    for (i = 0; i < dynamic->len; i++) {
+        if (routes_may_overlap(dynamic->entries[i].uri, entry->uri)) {
+            add_conflict(&dynamic->entries[i], entry->index);
+            add_conflict(entry, dynamic->entries[i].index);
+        }
+    }
+    dynamic->len++;
+}
+
+/**
+ * Reorder dynamic routes by hit count, hottest first.
+ * An entry only moves in front of entries it does not overlap,
+ * so the registration order of ambiguous routes is preserved.
+ */
+static void reorder_dynamic_routes(struct php_can_server_router_dynamic *dynamic)
+{
+    int i, y;
+
+    for (i = 1; i < dynamic->len; i++) {
+        struct php_can_server_router_entry entry = dynamic->entries[i];
+        y = i;
+        while (y > 0 && dynamic->entries[y - 1].hits < entry.hits
+                && !entries_conflict(&dynamic->entries[y - 1], &entry)) {
+            dynamic->entries[y] = dynamic->entries[y - 1];
+            y--;
+        }
+        dynamic->entries[y] = entry;
+    }
+
+    // decay hits, so the order follows the recent traffic
+    for (i = 0; i < dynamic->len; i++) {
+        dynamic->entries[i].hits >>= 1;
+    }
+    dynamic->lookups = 0;
+}
+
+static void add_route(struct php_can_server_router_table *table,
+        struct php_can_server_route *route, ulong numkey TSRMLS_DC)
+{
+    add_assoc_long(table->route_methods, route->regexp != NULL ? route->regexp : route->route, route->methods);
 
     if (route->methods & PHP_CAN_SERVER_ROUTE_METHOD_GET) {
         add_to_maps("GET");
@@ -122,6 +321,414 @@ static void add_route(struct php_can_server_router *router,
     if (route->methods & PHP_CAN_SERVER_ROUTE_METHOD_PATCH) {
         add_to_maps("PATCH");
     }
+
+    if (route->regexp != NULL) {
+        int i;
+        for (i = 0; i < PHP_CAN_SERVER_ROUTE_METHODS; i++) {
+            if (route->methods & (1 << i)) {
+                add_dynamic_route(&table->dynamic[i], route, numkey);
+            }
+        }
+    }
+}
+
+/**
+ * Run the regexp with the pcre.backtrack_limit and pcre.recursion_limit
+ * settings applied the way ext/pcre does, paths come from clients
+ */
+static int exec_route(pcre_cache_entry *pce, const char *path, int path_len, int *ovector, int size TSRMLS_DC)
+{
+    pcre_extra extra;
+
+    if (pce->extra != NULL) {
+        extra = *pce->extra;
+    } else {
+        memset(&extra, 0, sizeof(extra));
+    }
+    extra.flags |= PCRE_EXTRA_MATCH_LIMIT | PCRE_EXTRA_MATCH_LIMIT_RECURSION;
+    extra.match_limit = PCRE_G(backtrack_limit);
+    extra.match_limit_recursion = PCRE_G(recursion_limit);
+
+    return pcre_exec(pce->re, &extra, path, path_len, 0, 0, ovector, size);
+}
+
+/**
+ * Match regexp of the route against the path. Params are filled straight
+ * from the offset vector following the route plan: ints and floats are
+ * converted from the raw bytes, strings are url decoded in place.
+ * Returns 1 on match, -1 if a path param contains a NUL byte, otherwise 0.
+ */
+static int match_route(struct php_can_server_route *route, char *regexp, int regexp_len,
+        const char *path, int path_len, zval *params TSRMLS_DC)
+{
+    pcre_cache_entry *pce;
+    int ovector_buf[PHP_CAN_SERVER_ROUTE_OVECTOR_SIZE], *ovector = ovector_buf;
+    int size, rc, i, matched = 1;
+
+    if (NULL == (pce = pcre_get_compiled_regex_cache(regexp, regexp_len TSRMLS_CC))) {
+        return 0;
+    }
+
+    if (route == NULL || params == NULL) {
+        return exec_route(pce, path, path_len, NULL, 0 TSRMLS_CC) >= 0;
+    }
+
+    if (!route->plan_resolved) {
+        php_can_server_route_resolve_plan(route, pce TSRMLS_CC);
+    }
+
+    size = (route->capture_count + 1) * 3;
+    if (size > PHP_CAN_SERVER_ROUTE_OVECTOR_SIZE) {
+        ovector = safe_emalloc(size, sizeof(int), 0);
+    }
+
+    rc = exec_route(pce, path, path_len, ovector, size TSRMLS_CC);
+    if (rc < 0) {
+        matched = 0;
+    } else {
+        for (i = 0; i < route->params_len; i++) {
+            struct php_can_server_route_param *param = &route->params[i];
+            const char *start = "";
+            int len = 0;
+
+            if (param->group < rc && ovector[2 * param->group] >= 0) {
+                start = path + ovector[2 * param->group];
+                len = ovector[2 * param->group + 1] - ovector[2 * param->group];
+            }
+
+            if (param->cast == IS_LONG) {
+                add_assoc_long_ex(params, param->name, param->name_len + 1,
+                        len ? ZEND_STRTOL(start, NULL, 10) : 0);
+
+            } else if (param->cast == IS_DOUBLE) {
+                char num[64];
+                if (len >= sizeof(num)) {
+                    len = sizeof(num) - 1;
+                }
+                memcpy(num, start, len);
+                num[len] = '\0';
+                add_assoc_double_ex(params, param->name, param->name_len + 1,
+                        len ? zend_strtod(num, NULL) : 0.0);
+
+            } else {
+                char *value = estrndup(start, len);
+                len = php_url_decode(value, len);
+                if (param->cast == IS_PATH && memchr(value, '\0', len) != NULL) {
+                    matched = -1;
+                }
+                add_assoc_stringl_ex(params, param->name, param->name_len + 1, value, len, 0);
+            }
+        }
+    }
+
+    if (ovector != ovector_buf) {
+        efree(ovector);
+    }
+    return matched;
+}
+
+/**
+ * Find the table of the host, exact names win over wildcards and
+ * longer wildcard suffixes over shorter ones. Returns the default
+ * table if no host specific table applies.
+ */
+static struct php_can_server_router_table *table_for_host(struct php_can_server_router_table *table, const char *host)
+{
+    struct php_can_server_router_table **found;
+    char name[256];
+    int i, len = 0;
+
+    if (host == NULL || (table->hosts == NULL && table->wildcards == NULL)) {
+        return table;
+    }
+
+    // lowercase, strip port and trailing dot
+    for (i = 0; host[i] && (host[i] != ':' || host[0] == '['); i++) {
+        if (i == sizeof(name) - 1) {
+            return table;
+        }
+        name[i] = tolower((unsigned char)host[i]);
+        if (host[i] == ']') {
+            i++;
+            break;
+        }
+    }
+    len = i;
+    if (len && name[len - 1] == '.') {
+        len--;
+    }
+    name[len] = '\0';
+
+    if (table->hosts && SUCCESS == zend_hash_find(table->hosts, name, len + 1, (void **)&found)) {
+        return *found;
+    }
+    if (table->wildcards) {
+        for (i = 0; i < len; i++) {
+            if (name[i] == '.' && SUCCESS == zend_hash_find(table->wildcards,
+                    name + i + 1, len - i, (void **)&found)) {
+                return *found;
+            }
+        }
+    }
+    return table;
+}
+
+/**
+ * Resolve the route for the given HTTP method and path in one table,
+ * see php_can_server_router_match for the returned status
+ */
+static int match_in_table(struct php_can_server_router_table *table, int type,
+        const char *path, int path_len, zval ***zroute, zval *params TSRMLS_DC)
+{
+    long routeIndex = -1;
+    int invalid = 0;
+    char *method = php_can_method_name(type);
+    zval **method_routes, **item;
+
+    if (FAILURE != zend_hash_find(Z_ARRVAL_P(table->method_routes), method, strlen(method) + 1, (void **)&method_routes)
+            && FAILURE != zend_hash_find(Z_ARRVAL_PP(method_routes), path, path_len + 1, (void **)&item)) {
+        // static route
+        routeIndex = Z_LVAL_PP(item);
+    } else {
+        // dynamic routes, apply regexp to the URI
+        int idx = method_index(type);
+        if (idx >= 0) {
+            struct php_can_server_router_dynamic *dynamic = &table->dynamic[idx];
+            int i;
+            for (i = 0; i < dynamic->len; i++) {
+                struct php_can_server_router_entry *entry = &dynamic->entries[i];
+                int matched = match_route(entry->route, entry->regexp, entry->regexp_len,
+                        path, path_len, params TSRMLS_CC);
+                if (matched) {
+                    invalid = matched < 0;
+                    routeIndex = entry->index;
+                    entry->hits++;
+                    break;
+                }
+            }
+            if (dynamic->len > 1 && ++dynamic->lookups >= PHP_CAN_SERVER_ROUTER_REORDER_INTERVAL) {
+                reorder_dynamic_routes(dynamic);
+            }
+        }
+    }
+
+    if (routeIndex >= 0
+            && SUCCESS == zend_hash_index_find(Z_ARRVAL_P(table->routes), routeIndex, (void **)zroute)) {
+        return invalid ? 400 : 200;
+    }
+
+    // there is definitely no such route for requested HTTP method
+    // we search through route_methods to determine what HTTP response we send back
+    if (FAILURE != zend_hash_find(Z_ARRVAL_P(table->route_methods), path, path_len + 1, (void **)&item)) {
+        return 405;
+    }
+    PHP_CAN_FOREACH(table->route_methods, item) {
+        if (keytype == HASH_KEY_IS_STRING && strkey[0] == '\1'
+                && match_route(NULL, strkey, strlen(strkey), path, path_len, NULL TSRMLS_CC)) {
+            // route exists, so we send 405
+            return 405;
+        }
+    }
+    return 404;
+}
+
+/**
+ * Resolve the route for the given HTTP method, host and path.
+ * Returns 200 and sets zroute and params if found, 400 if a path
+ * param is invalid, otherwise 405 if the path is routed for another
+ * method or 404. Paths the host table does not route at all fall
+ * back to the default table.
+ */
+int php_can_server_router_match(struct php_can_server_router_table *table, int type,
+        const char *host, const char *path, zval ***zroute, zval *params TSRMLS_DC)
+{
+    struct php_can_server_router_table *host_table = table_for_host(table, host);
+    int path_len = strlen(path);
+    int status = match_in_table(host_table, type, path, path_len, zroute, params TSRMLS_CC);
+
+    if (status == 404 && host_table != table) {
+        status = match_in_table(table, type, path, path_len, zroute, params TSRMLS_CC);
+    }
+    return status;
+}
+
+void php_can_server_router_table_release(struct php_can_server_router_table *table TSRMLS_DC)
+{
+    int i, y;
+
+    if (--table->refcount > 0) {
+        return;
+    }
+
+    if (table->hosts) {
+        zend_hash_destroy(table->hosts);
+        FREE_HASHTABLE(table->hosts);
+    }
+    if (table->wildcards) {
+        zend_hash_destroy(table->wildcards);
+        FREE_HASHTABLE(table->wildcards);
+    }
+
+    zval_ptr_dtor(&table->routes);
+    zval_ptr_dtor(&table->method_routes);
+    zval_ptr_dtor(&table->route_methods);
+    if (table->middlewares) {
+        zval_ptr_dtor(&table->middlewares);
+    }
+    if (table->ratelimit) {
+        zval_ptr_dtor(&table->ratelimit);
+    }
+    if (table->cors) {
+        zval_ptr_dtor(&table->cors);
+    }
+
+    for (i = 0; i < PHP_CAN_SERVER_ROUTE_METHODS; i++) {
+        struct php_can_server_router_dynamic *dynamic = &table->dynamic[i];
+        for (y = 0; y < dynamic->len; y++) {
+            efree(dynamic->entries[y].uri);
+            efree(dynamic->entries[y].regexp);
+            if (dynamic->entries[y].conflicts) {
+                efree(dynamic->entries[y].conflicts);
+            }
+        }
+        if (dynamic->entries) {
+            efree(dynamic->entries);
+        }
+    }
+    efree(table);
+}
+
+static void table_dtor(void *data)
+{
+    TSRMLS_FETCH();
+    php_can_server_router_table_release(*(struct php_can_server_router_table **)data TSRMLS_CC);
+}
+
+static struct php_can_server_router_table *table_new(void)
+{
+    struct php_can_server_router_table *table = ecalloc(1, sizeof(*table));
+
+    table->refcount = 1;
+    MAKE_STD_ZVAL(table->routes);
+    array_init(table->routes);
+    MAKE_STD_ZVAL(table->method_routes);
+    array_init(table->method_routes);
+    MAKE_STD_ZVAL(table->route_methods);
+    array_init(table->route_methods);
+
+    return table;
+}
+
+/**
+ * Get the table of the host pattern, creating it if needed
+ */
+static struct php_can_server_router_table *host_table(struct php_can_server_router_table *table, zval *host)
+{
+    struct php_can_server_router_table **found, *created;
+    HashTable **hosts = &table->hosts;
+    char *name = Z_STRVAL_P(host);
+    int len = Z_STRLEN_P(host);
+
+    if (len > 2 && name[0] == '*' && name[1] == '.') {
+        hosts = &table->wildcards;
+        name += 2;
+        len -= 2;
+    }
+
+    if (*hosts == NULL) {
+        ALLOC_HASHTABLE(*hosts);
+        zend_hash_init(*hosts, 8, NULL, table_dtor, 0);
+    }
+    if (SUCCESS == zend_hash_find(*hosts, name, len + 1, (void **)&found)) {
+        return *found;
+    }
+
+    created = table_new();
+    zend_hash_add(*hosts, name, len + 1, (void *)&created, sizeof(created), NULL);
+    return created;
+}
+
+/**
+ * Compile the routes of the router into a new table and switch it in,
+ * the previous table is released once the last request using it is done
+ */
+struct php_can_server_router_table *php_can_server_router_commit(struct php_can_server_router *router TSRMLS_DC)
+{
+    struct php_can_server_router_table *table = table_new();
+    zval **zroute, **host;
+
+    PHP_CAN_FOREACH(router->routes, zroute) {
+        struct php_can_server_route *route = (struct php_can_server_route*)
+                zend_object_store_get_object((*zroute) TSRMLS_CC);
+        struct php_can_server_router_table *target = table;
+
+        if (router->route_hosts != NULL
+                && SUCCESS == zend_hash_index_find(Z_ARRVAL_P(router->route_hosts), numkey, (void **)&host)) {
+            target = host_table(table, *host);
+        }
+
+        add_route(target, route, numkey TSRMLS_CC);
+
+        zval_add_ref(zroute);
+        add_index_zval(target->routes, numkey, *zroute);
+    }
+
+    if (router->middlewares) {
+        zval *copy;
+        MAKE_STD_ZVAL(copy);
+        array_init_size(copy, zend_hash_num_elements(Z_ARRVAL_P(router->middlewares)));
+        zend_hash_copy(Z_ARRVAL_P(copy), Z_ARRVAL_P(router->middlewares),
+                (copy_ctor_func_t) zval_add_ref, NULL, sizeof(zval *));
+        table->middlewares = copy;
+    }
+
+    if (router->ratelimit) {
+        zval_add_ref(&router->ratelimit);
+        table->ratelimit = router->ratelimit;
+    }
+
+    if (router->cors) {
+        zval_add_ref(&router->cors);
+        table->cors = router->cors;
+    }
+
+    if (router->table) {
+        php_can_server_router_table_release(router->table TSRMLS_CC);
+    }
+    router->table = table;
+    router->dirty = 0;
+
+    return table;
+}
+
+/**
+ * Append route to the router, optionally bound to a host pattern
+ */
+static int append_route(struct php_can_server_router *router, zval *zroute, zval *host TSRMLS_DC)
+{
+    ulong index;
+
+    if (Z_TYPE_P(zroute) != IS_OBJECT || !instanceof_function(Z_OBJCE_P(zroute), ce_can_server_route TSRMLS_CC)) {
+        php_can_throw_exception(
+            ce_can_InvalidParametersException TSRMLS_CC,
+            "Route must be instance of '%s'", ce_can_server_route->name
+        );
+        return FAILURE;
+    }
+
+    index = zend_hash_next_free_element(Z_ARRVAL_P(router->routes));
+    zval_add_ref(&zroute);
+    add_index_zval(router->routes, index, zroute);
+
+    if (host != NULL) {
+        if (router->route_hosts == NULL) {
+            MAKE_STD_ZVAL(router->route_hosts);
+            array_init(router->route_hosts);
+        }
+        char *pattern = zend_str_tolower_dup(Z_STRVAL_P(host), Z_STRLEN_P(host));
+        add_index_stringl(router->route_hosts, index, pattern, Z_STRLEN_P(host), 0);
+    }
+    return SUCCESS;
 }
 
 /**
@@ -145,63 +752,289 @@ static PHP_METHOD(CanServerRouter, __construct)
     struct php_can_server_router *router = (struct php_can_server_router*)
         zend_object_store_get_object(getThis() TSRMLS_CC);
 
+    MAKE_STD_ZVAL(router->routes);
+    array_init(router->routes);
+
     if (routes != NULL) {
         zval **zroute;
         PHP_CAN_FOREACH(routes, zroute) {
-            
-            if (Z_TYPE_PP(zroute) != IS_OBJECT || !instanceof_function(Z_OBJCE_PP(zroute), ce_can_server_route TSRMLS_CC)) {
-                php_can_throw_exception(
-                    ce_can_InvalidParametersException TSRMLS_CC,
-                    "Route must be instance of '%s'", ce_can_server_route->name
-                );
+            if (keytype == HASH_KEY_IS_STRING && Z_TYPE_PP(zroute) == IS_ARRAY) {
+                // routes of a host, array('api.example.com' => array(...))
+                zval *host, **item;
+                if (strkey[0] == '\0') {
+                    php_can_throw_exception(
+                        ce_can_InvalidParametersException TSRMLS_CC,
+                        "Host pattern must not be empty"
+                    );
+                    return;
+                }
+                MAKE_STD_ZVAL(host);
+                ZVAL_STRING(host, strkey, 1);
+                HashPosition pos;
+                for (zend_hash_internal_pointer_reset_ex(Z_ARRVAL_PP(zroute), &pos);
+                        zend_hash_get_current_data_ex(Z_ARRVAL_PP(zroute), (void **)&item, &pos) == SUCCESS;
+                        zend_hash_move_forward_ex(Z_ARRVAL_PP(zroute), &pos)) {
+                    if (FAILURE == append_route(router, *item, host TSRMLS_CC)) {
+                        zval_ptr_dtor(&host);
+                        return;
+                    }
+                }
+                zval_ptr_dtor(&host);
+            } else if (FAILURE == append_route(router, *zroute, NULL TSRMLS_CC)) {
                 return;
             }
+        }
+    }
 
-            struct php_can_server_route *route = (struct php_can_server_route*)
-                    zend_object_store_get_object((*zroute) TSRMLS_CC);
+    php_can_server_router_commit(router TSRMLS_CC);
+}
 
-            add_route(router, route, numkey TSRMLS_CC);
-        }
+/**
+ * Add route
+ */
+static PHP_METHOD(CanServerRouter, addRoute)
+{
+    zval *zroute, *host = NULL;
+
+    if (FAILURE == zend_parse_parameters_ex(ZEND_PARSE_PARAMS_QUIET, ZEND_NUM_ARGS() TSRMLS_CC,
+            "O|z", &zroute, ce_can_server_route, &host)
+            || (host && (Z_TYPE_P(host) != IS_STRING || Z_STRLEN_P(host) == 0))) {
+        zchar *space, *class_name = get_active_class_name(&space TSRMLS_CC);
+        php_can_throw_exception(
+            ce_can_InvalidParametersException TSRMLS_CC,
+            "%s%s%s(Route $route[, string $host])",
+            class_name, space, get_active_function_name(TSRMLS_C)
+        );
+        return;
+    }
+
+    struct php_can_server_router *router = (struct php_can_server_router*)
+        zend_object_store_get_object(getThis() TSRMLS_CC);
+
+    if (FAILURE == append_route(router, zroute, host TSRMLS_CC)) {
+        return;
+    }
+
+    // staged until the next commit, the live table is not touched
+    router->dirty = 1;
+}
+
+/**
+ * Add middleware, either an instance or before and after callbacks
+ */
+static PHP_METHOD(CanServerRouter, addMiddleware)
+{
+    zval *before = NULL, *after = NULL;
+
+    if (FAILURE == zend_parse_parameters_ex(ZEND_PARSE_PARAMS_QUIET, ZEND_NUM_ARGS() TSRMLS_CC,
+            "z|z", &before, &after)) {
+        zchar *space, *class_name = get_active_class_name(&space TSRMLS_CC);
+        php_can_throw_exception(
+            ce_can_InvalidParametersException TSRMLS_CC,
+            "%s%s%s(Middleware|callable $before[, callable $after])",
+            class_name, space, get_active_function_name(TSRMLS_C)
+        );
+        return;
+    }
+
+    struct php_can_server_router *router = (struct php_can_server_router*)
+        zend_object_store_get_object(getThis() TSRMLS_CC);
+
+    zval *zmiddleware;
 
-        zval_add_ref(&routes);
-        router->routes = routes;
+    if (Z_TYPE_P(before) == IS_OBJECT
+            && instanceof_function(Z_OBJCE_P(before), ce_can_server_middleware TSRMLS_CC)) {
+        if (after != NULL) {
+            php_can_throw_exception(
+                ce_can_InvalidParametersException TSRMLS_CC,
+                "Unexpected after callback for middleware instance"
+            );
+            return;
+        }
+        zmiddleware = before;
+        zval_add_ref(&zmiddleware);
     } else {
-        MAKE_STD_ZVAL(router->routes);
-        array_init(router->routes);
+        MAKE_STD_ZVAL(zmiddleware);
+        object_init_ex(zmiddleware, ce_can_server_middleware);
+        struct php_can_server_middleware *middleware = (struct php_can_server_middleware*)
+            zend_object_store_get_object(zmiddleware TSRMLS_CC);
+        if (FAILURE == php_can_server_middleware_set_callbacks(middleware, before, after TSRMLS_CC)) {
+            zval_ptr_dtor(&zmiddleware);
+            return;
+        }
+    }
+
+    if (router->middlewares == NULL) {
+        MAKE_STD_ZVAL(router->middlewares);
+        array_init(router->middlewares);
     }
+    add_next_index_zval(router->middlewares, zmiddleware);
+
+    // staged until the next commit, the live table is not touched
+    router->dirty = 1;
 }
 
 /**
- * Add route
+ * Set rate limit applied to all routes of the router
  */
-static PHP_METHOD(CanServerRouter, addRoute)
+static PHP_METHOD(CanServerRouter, setRateLimit)
 {
-    zval *zroute;
+    zval *zlimit = NULL;
 
     if (FAILURE == zend_parse_parameters_ex(ZEND_PARSE_PARAMS_QUIET, ZEND_NUM_ARGS() TSRMLS_CC,
-            "O", &zroute, ce_can_server_route)) {
+            "O!", &zlimit, ce_can_server_ratelimit)) {
         zchar *space, *class_name = get_active_class_name(&space TSRMLS_CC);
         php_can_throw_exception(
             ce_can_InvalidParametersException TSRMLS_CC,
-            "%s%s%s(Route $route)",
+            "%s%s%s(RateLimit $limit)",
             class_name, space, get_active_function_name(TSRMLS_C)
         );
         return;
     }
-    
+
     struct php_can_server_router *router = (struct php_can_server_router*)
         zend_object_store_get_object(getThis() TSRMLS_CC);
-    
-    struct php_can_server_route *route = (struct php_can_server_route*)
-        zend_object_store_get_object(zroute TSRMLS_CC);
-    
-    ulong numkey = (ulong) zend_hash_num_elements(Z_ARRVAL_P(router->routes));
-    
-    add_route(router, route, numkey TSRMLS_CC);
-    
-    zval_add_ref(&zroute);
-    add_next_index_zval(router->routes, zroute);
-    
+
+    if (router->ratelimit) {
+        zval_ptr_dtor(&router->ratelimit);
+        router->ratelimit = NULL;
+    }
+    if (zlimit) {
+        zval_add_ref(&zlimit);
+        router->ratelimit = zlimit;
+    }
+
+    // staged until the next commit, the live table is not touched
+    router->dirty = 1;
+}
+
+/**
+ * Set CORS policy of all routes without an own one
+ */
+static PHP_METHOD(CanServerRouter, setCors)
+{
+    zval *zcors = NULL;
+
+    if (FAILURE == zend_parse_parameters_ex(ZEND_PARSE_PARAMS_QUIET, ZEND_NUM_ARGS() TSRMLS_CC,
+            "O!", &zcors, ce_can_server_cors)) {
+        zchar *space, *class_name = get_active_class_name(&space TSRMLS_CC);
+        php_can_throw_exception(
+            ce_can_InvalidParametersException TSRMLS_CC,
+            "%s%s%s(Cors $cors)",
+            class_name, space, get_active_function_name(TSRMLS_C)
+        );
+        return;
+    }
+
+    struct php_can_server_router *router = (struct php_can_server_router*)
+        zend_object_store_get_object(getThis() TSRMLS_CC);
+
+    if (router->cors) {
+        zval_ptr_dtor(&router->cors);
+        router->cors = NULL;
+    }
+    if (zcors) {
+        zval_add_ref(&zcors);
+        router->cors = zcors;
+    }
+
+    // staged until the next commit, the live table is not touched
+    router->dirty = 1;
+}
+
+/**
+ * Compile added routes and switch them in atomically
+ */
+static PHP_METHOD(CanServerRouter, commit)
+{
+    if (FAILURE == zend_parse_parameters_ex(ZEND_PARSE_PARAMS_QUIET, ZEND_NUM_ARGS() TSRMLS_CC, "")) {
+        zchar *space, *class_name = get_active_class_name(&space TSRMLS_CC);
+        php_can_throw_exception(
+            ce_can_InvalidParametersException TSRMLS_CC,
+            "%s%s%s(void)",
+            class_name, space, get_active_function_name(TSRMLS_C)
+        );
+        return;
+    }
+
+    struct php_can_server_router *router = (struct php_can_server_router*)
+        zend_object_store_get_object(getThis() TSRMLS_CC);
+
+    php_can_server_router_commit(router TSRMLS_CC);
+}
+
+/**
+ * Resolve route for the method and path the same way the server does
+ */
+static PHP_METHOD(CanServerRouter, match)
+{
+    char *method, *path, *host = NULL;
+    int method_len, path_len, host_len = 0, type = 0, i;
+
+    if (FAILURE == zend_parse_parameters_ex(ZEND_PARSE_PARAMS_QUIET, ZEND_NUM_ARGS() TSRMLS_CC,
+            "ss|s", &method, &method_len, &path, &path_len, &host, &host_len)) {
+        zchar *space, *class_name = get_active_class_name(&space TSRMLS_CC);
+        php_can_throw_exception(
+            ce_can_InvalidParametersException TSRMLS_CC,
+            "%s%s%s(string $method, string $path[, string $host])",
+            class_name, space, get_active_function_name(TSRMLS_C)
+        );
+        return;
+    }
+
+    for (i = 0; i < PHP_CAN_SERVER_ROUTE_METHODS; i++) {
+        if (0 == strcasecmp(method, php_can_method_name(1 << i))) {
+            type = 1 << i;
+            break;
+        }
+    }
+    if (type == 0) {
+        php_can_throw_exception(
+            ce_can_InvalidParametersException TSRMLS_CC,
+            "Unexpected method"
+        );
+        return;
+    }
+
+    struct php_can_server_router *router = (struct php_can_server_router*)
+        zend_object_store_get_object(getThis() TSRMLS_CC);
+
+    if (router->table == NULL) {
+        if (router->routes == NULL) {
+            php_can_throw_exception(
+                ce_can_InvalidOperationException TSRMLS_CC,
+                "Router is not initialized"
+            );
+            return;
+        }
+        php_can_server_router_commit(router TSRMLS_CC);
+    }
+
+    struct php_can_server_router_table *table = router->table;
+    zval *params, **zroute;
+    int status;
+
+    table->refcount++;
+    MAKE_STD_ZVAL(params);
+    array_init(params);
+
+    status = php_can_server_router_match(table, type, host, path, &zroute, params TSRMLS_CC);
+
+    array_init(return_value);
+    add_assoc_long(return_value, "status", status);
+    if (status == 200) {
+        zval_add_ref(zroute);
+        add_assoc_zval(return_value, "route", *zroute);
+        add_assoc_zval(return_value, "params", params);
+    } else {
+        add_assoc_null(return_value, "route");
+        zval_ptr_dtor(&params);
+        MAKE_STD_ZVAL(params);
+        array_init(params);
+        add_assoc_zval(return_value, "params", params);
+    }
+
+    php_can_server_router_table_release(table TSRMLS_CC);
 }
 
 /**
@@ -267,13 +1100,18 @@ static PHP_METHOD(CanServerRouter, valid)
 }
 
 static zend_function_entry server_router_methods[] = {
-    PHP_ME(CanServerRouter, __construct, NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
-    PHP_ME(CanServerRouter, addRoute,    NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
-    PHP_ME(CanServerRouter, current,     NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
-    PHP_ME(CanServerRouter, key,         NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
-    PHP_ME(CanServerRouter, next,        NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
-    PHP_ME(CanServerRouter, rewind,      NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
-    PHP_ME(CanServerRouter, valid,       NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
+    PHP_ME(CanServerRouter, __construct,   NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
+    PHP_ME(CanServerRouter, addRoute,      NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
+    PHP_ME(CanServerRouter, addMiddleware, NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
+    PHP_ME(CanServerRouter, setRateLimit,  NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
+    PHP_ME(CanServerRouter, setCors,       NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
+    PHP_ME(CanServerRouter, commit,        NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
+    PHP_ME(CanServerRouter, match,         NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
+    PHP_ME(CanServerRouter, current,       NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
+    PHP_ME(CanServerRouter, key,           NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
+    PHP_ME(CanServerRouter, next,          NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
+    PHP_ME(CanServerRouter, rewind,        NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
+    PHP_ME(CanServerRouter, valid,         NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
     {NULL, NULL, NULL}
 };
 
@@ -39,6 +39,17 @@ static zend_object_value server_websocket_route_ctor(zend_class_entry *ce TSRMLS
     route->regexp = NULL;
     route->route = NULL;
     route->casts = NULL;
+    route->params = NULL;
+    route->params_len = 0;
+    route->plan_resolved = 0;
+    route->ratelimit = NULL;
+    route->cors = NULL;
+    route->body_handler = NULL;
+    route->upload_handler = NULL;
+    route->before_body = NULL;
+    route->max_header_size = 0;
+    route->max_body_size = 0;
+    route->body_timeout = 0;
     retval.handle = zend_objects_store_put(route,       
             (zend_objects_store_dtor_t)zend_objects_destroy_object,
             server_websocket_route_dtor,
@@ -51,23 +62,7 @@ static void server_websocket_route_dtor(void *object TSRMLS_DC)
 {
     struct php_can_server_route *route = (struct php_can_server_route*)object;
 
-    if (route->handler) {
-        zval_ptr_dtor(&route->handler);
-    }
-    
-    if (route->regexp) {
-        efree(route->regexp);
-        route->regexp = NULL;
-    }
-
-    if (route->route) {
-        efree(route->route);
-        route->route = NULL;
-    }
-    
-    if (route->casts) {
-        zval_ptr_dtor(&route->casts);
-    }
+    php_can_server_route_free(route TSRMLS_CC);
 
     zend_objects_store_del_ref(&route->refhandle TSRMLS_CC);
     zend_object_std_dtor(&route->std TSRMLS_CC);
@@ -116,6 +111,10 @@ static void server_websocket_ctx_dtor(void *object TSRMLS_DC)
         zval_ptr_dtor(&ctx->data);
     }
 
+    if (ctx->zroute) {
+        zval_ptr_dtor(&ctx->zroute);
+    }
+
     zend_objects_store_del_ref(&ctx->refhandle TSRMLS_CC);
     zend_object_std_dtor(&ctx->std TSRMLS_CC);
     efree(ctx);
@@ -563,6 +562,7 @@ static void on_connection_close(struct evhttp_connection *evcon, void *arg)
     ctx->evcon = NULL;
     ctx->req = NULL;
     zval_ptr_dtor(&websocket_ctx);
+    php_can_server_connection_closed(evcon);
 }
 
 static int
@@ -663,7 +663,7 @@ void server_websocket_route_handle_request(zval *zroute, zval *zrequest, zval *p
     const char *hdr_upgrade, *hdr_conn, *hdr_wskey, *hdr_wskey1, *hdr_wskey2, *hdr_origin, *hdr_wsver;
     char *body = NULL;
     
-    if ((hdr_upgrade = evhttp_find_header(request->req->input_headers, "Upgrade")) == NULL
+    if ((hdr_upgrade = PHP_CAN_REQUEST_HEADER(request, UPGRADE)) == NULL
         || strcasecmp(hdr_upgrade, "websocket") != 0
     ) {
         request->response_code = 400;
@@ -673,7 +673,7 @@ void server_websocket_route_handle_request(zval *zroute, zval *zrequest, zval *p
         return;
     }
     
-    if ((hdr_conn = evhttp_find_header(request->req->input_headers, "Connection")) == NULL
+    if ((hdr_conn = PHP_CAN_REQUEST_HEADER(request, CONNECTION)) == NULL
         || php_can_strpos((char *)hdr_conn, "Upgrade", 0) == FAILURE
     ) {
         request->response_code = 400;
@@ -681,16 +681,16 @@ void server_websocket_route_handle_request(zval *zroute, zval *zrequest, zval *p
         return;
     }
     
-    if ((hdr_wskey = evhttp_find_header(request->req->input_headers, "Sec-WebSocket-Key")) == NULL
-        && ((hdr_wskey1 = evhttp_find_header(request->req->input_headers, "Sec-WebSocket-Key1")) == NULL
-         || (hdr_wskey2 = evhttp_find_header(request->req->input_headers, "Sec-WebSocket-Key2")) == NULL)
+    if ((hdr_wskey = PHP_CAN_REQUEST_HEADER(request, SEC_WEBSOCKET_KEY)) == NULL
+        && ((hdr_wskey1 = PHP_CAN_REQUEST_HEADER(request, SEC_WEBSOCKET_KEY1)) == NULL
+         || (hdr_wskey2 = PHP_CAN_REQUEST_HEADER(request, SEC_WEBSOCKET_KEY2)) == NULL)
     ) {
         request->response_code = 400;
         spprintf(&request->error, 0, "Missing Sec-WebSocket-Key request header");
         return;
     }
     
-    if ((hdr_wsver = evhttp_find_header(request->req->input_headers, "Sec-WebSocket-Version")) == NULL
+    if ((hdr_wsver = PHP_CAN_REQUEST_HEADER(request, SEC_WEBSOCKET_VERSION)) == NULL
         || (strcmp(hdr_wsver, "7") != 0 && strcmp(hdr_wsver, "8") != 0 && strcmp(hdr_wsver, "13") != 0)
     ) {
         if (hdr_wskey != NULL) {
@@ -702,9 +702,9 @@ void server_websocket_route_handle_request(zval *zroute, zval *zrequest, zval *p
     }
     
     if (hdr_wsver != NULL && strcmp(hdr_wsver, "13") != 0) {
-        hdr_origin = evhttp_find_header(request->req->input_headers, "Sec-Websocket-Origin");
+        hdr_origin = PHP_CAN_REQUEST_HEADER(request, SEC_WEBSOCKET_ORIGIN);
     } else {
-        hdr_origin = evhttp_find_header(request->req->input_headers, "Origin");
+        hdr_origin = PHP_CAN_REQUEST_HEADER(request, ORIGIN);
     }
     
     if (hdr_origin == NULL) {
@@ -795,7 +795,7 @@ void server_websocket_route_handle_request(zval *zroute, zval *zrequest, zval *p
         
         char *location = NULL;
         spprintf(&location, 0, "ws://%s%s", 
-                evhttp_find_header(request->req->input_headers, "Host"),
+                PHP_CAN_REQUEST_HEADER(request, HOST),
                 evhttp_uri_get_path(request->req->uri_elems));
         evhttp_add_header(request->req->output_headers, "Sec-WebSocket-Location", location);
         efree(location);
@@ -808,7 +808,7 @@ void server_websocket_route_handle_request(zval *zroute, zval *zrequest, zval *p
     evhttp_add_header(request->req->output_headers, "Upgrade", "websocket");
     evhttp_add_header(request->req->output_headers, "Connection", "Upgrade");
 
-    const char *ws_protocol = evhttp_find_header(request->req->input_headers, "Sec-WebSocket-Protocol");
+    const char *ws_protocol = PHP_CAN_REQUEST_HEADER(request, SEC_WEBSOCKET_PROTOCOL);
     if (ws_protocol != NULL) {
         evhttp_add_header(request->req->output_headers, "Sec-WebSocket-Protocol", ws_protocol);
     }
@@ -818,6 +818,8 @@ void server_websocket_route_handle_request(zval *zroute, zval *zrequest, zval *p
     ctx->req = request->req;
     ctx->evcon = evhttp_request_get_connection(request->req);
     ctx->rfc6455 = rfc6455;
+    // keep the route alive, the routing table may be swapped meanwhile
+    zval_add_ref(&zroute);
     ctx->zroute = zroute;
 
     struct bufferevent *bufev = evhttp_connection_get_bufferevent(ctx->evcon);
@@ -919,49 +921,7 @@ static PHP_METHOD(CanServerWebSocketRoute, __construct)
         add_next_index_string(route->handler, "onMessage", 1);
     }
     
-    MAKE_STD_ZVAL(route->casts);
-    array_init(route->casts);
-    
-    if (FAILURE != php_can_strpos(Z_STRVAL_P(uri), "<", 0) && FAILURE != php_can_strpos(Z_STRVAL_P(uri), ">", 0)) {
-        int i;
-        for (i = 0; i < Z_STRLEN_P(uri); i++) {
-            if (Z_STRVAL_P(uri)[i] != '<') {
-                spprintf(&route->regexp, 0, "%s%c", route->regexp == NULL ? "" : route->regexp, Z_STRVAL_P(uri)[i]);
-            } else {
-                int y = php_can_strpos(Z_STRVAL_P(uri), ">", i);
-                char *name = php_can_substr(Z_STRVAL_P(uri), i + 1, y - (i + 1));
-                int pos = php_can_strpos(name, ":", 0);
-                if (FAILURE != pos) {
-                    char *var = php_can_substr(name, 0, pos);
-                    char *filter = php_can_substr(name, pos + 1, strlen(name) - (pos + 1));
-                    if (strcmp(filter, "int") == 0) {
-                        spprintf(&route->regexp, 0, "%s(?<%s>%s)", route->regexp, var, "-?[0-9]+");
-                        add_assoc_long(route->casts, var, IS_LONG);
-                    } else if (0 == strcmp(filter, "float")) {
-                        spprintf(&route->regexp, 0, "%s(?<%s>%s)", route->regexp, var, "-?[0-9.]+");
-                        add_assoc_long(route->casts, var, IS_DOUBLE);
-                    } else if (0 == strcmp(filter, "path")) {
-                        spprintf(&route->regexp, 0, "%s(?<%s>%s)", route->regexp, var, ".+?");
-                        add_assoc_long(route->casts, var, IS_PATH);
-                    } else if (0 == (pos = php_can_strpos(filter, "re:", 0))) {
-                        char *reg = php_can_substr(filter, pos + 3, strlen(filter) - (pos + 3));
-                        spprintf(&route->regexp, 0, "%s(?<%s>%s)", route->regexp, var, reg);
-                        efree(reg);
-                    }
-                    efree(filter);
-                    efree(var);
-                    
-                } else {
-                    spprintf(&route->regexp, 0, "%s(?<%s>[^/]+)", route->regexp, name);
-                }
-                efree(name);
-                i = y;
-            }
-        }
-        spprintf(&route->regexp, 0, "\1^%s$\1", route->regexp);
-    }
-    
-    route->route = estrndup(Z_STRVAL_P(uri), Z_STRLEN_P(uri));
+    php_can_server_route_compile(route, Z_STRVAL_P(uri), Z_STRLEN_P(uri) TSRMLS_CC);
 
 }
 
@@ -0,0 +1,233 @@
+/*
+  +----------------------------------------------------------------------+
+  | PHP Version 5.3                                                      |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2002-2011 Dmitri Vinogradov                            |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Authors: Dmitri Vinogradov <dmitri.vinogradov@gmail.com>             |
+  +----------------------------------------------------------------------+
+*/
+
+#include "Server.h"
+
+#include <event.h>
+#include <evhttp.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#define ADDRESS_BIT(addr, i) (((addr)[(i) >> 3] >> (7 - ((i) & 7))) & 1)
+
+struct php_can_server_access_client {
+    unsigned char addr[16];
+    int len;
+};
+
+/**
+ * Binary address of the client of the connection, IPv4 mapped into
+ * IPv6 counts as IPv4. Returns the length, 0 if unknown.
+ */
+static int client_address(struct evhttp_connection *evcon, unsigned char *addr)
+{
+    const struct sockaddr *sa = evhttp_connection_get_addr(evcon);
+    char *host = NULL;
+    ev_uint16_t port;
+
+    if (sa != NULL && sa->sa_family == AF_INET) {
+        memcpy(addr, &((const struct sockaddr_in *)sa)->sin_addr, 4);
+        return 4;
+    }
+    if (sa != NULL && sa->sa_family == AF_INET6) {
+        const unsigned char *in6 = ((const struct sockaddr_in6 *)sa)->sin6_addr.s6_addr;
+        if (IN6_IS_ADDR_V4MAPPED(&((const struct sockaddr_in6 *)sa)->sin6_addr)) {
+            memcpy(addr, in6 + 12, 4);
+            return 4;
+        }
+        memcpy(addr, in6, 16);
+        return 16;
+    }
+
+    // older libevent only keeps the address as a string
+    evhttp_connection_get_peer(evcon, &host, &port);
+    if (host != NULL && inet_pton(AF_INET, host, addr) == 1) {
+        return 4;
+    }
+    if (host != NULL && inet_pton(AF_INET6, host, addr) == 1) {
+        return 16;
+    }
+    return 0;
+}
+
+/**
+ * Add an address or CIDR prefix like 10.0.0.0/8 or 2001:db8::/32 to
+ * the allow or deny list
+ */
+int php_can_server_access_add(struct php_can_server_access *access, const char *cidr, int verdict)
+{
+    struct php_can_server_cidr_node **node;
+    const char *slash = strchr(cidr, '/');
+    size_t len = slash ? (size_t)(slash - cidr) : strlen(cidr);
+    char host[INET6_ADDRSTRLEN], *end;
+    unsigned char addr[16];
+    long bits, max, i;
+
+    if (len == 0 || len >= sizeof(host)) {
+        return FAILURE;
+    }
+    memcpy(host, cidr, len);
+    host[len] = '\0';
+
+    if (inet_pton(AF_INET, host, addr) == 1) {
+        max = 32;
+        node = &access->v4;
+    } else if (inet_pton(AF_INET6, host, addr) == 1) {
+        max = 128;
+        node = &access->v6;
+    } else {
+        return FAILURE;
+    }
+
+    bits = max;
+    if (slash != NULL) {
+        bits = strtol(slash + 1, &end, 10);
+        if (end == slash + 1 || *end != '\0' || bits < 0 || bits > max) {
+            return FAILURE;
+        }
+    }
+
+    for (i = 0; i < bits; i++) {
+        if (*node == NULL) {
+            *node = ecalloc(1, sizeof(**node));
+        }
+        node = &(*node)->child[ADDRESS_BIT(addr, i)];
+    }
+    if (*node == NULL) {
+        *node = ecalloc(1, sizeof(**node));
+    }
+
+    if ((*node)->verdict == PHP_CAN_SERVER_ACCESS_ALLOW) {
+        access->allows--;
+    }
+    if (verdict == PHP_CAN_SERVER_ACCESS_ALLOW) {
+        access->allows++;
+    }
+    (*node)->verdict = verdict;
+    return SUCCESS;
+}
+
+/**
+ * Verdict of the longest prefix matching the address, 0 if none does
+ */
+static int cidr_verdict(const struct php_can_server_cidr_node *node, const unsigned char *addr, int bits)
+{
+    int verdict = 0, i;
+
+    for (i = 0; node != NULL; i++) {
+        if (node->verdict) {
+            verdict = node->verdict;
+        }
+        if (i == bits) {
+            break;
+        }
+        node = node->child[ADDRESS_BIT(addr, i)];
+    }
+    return verdict;
+}
+
+/**
+ * Admit a connection on its first request. Returns 0 if the connection
+ * may go on, 403 if its client is not allowed or 503 if the client has
+ * too many open connections already. Known connections are admitted
+ * with a single lookup.
+ */
+int php_can_server_access_open(struct php_can_server_access *access, struct evhttp_connection *evcon)
+{
+    struct php_can_server_access_client client;
+    long *count, one = 1;
+    int verdict;
+
+    if (access->connections != NULL && zend_hash_index_exists(access->connections, (ulong)evcon)) {
+        return 0;
+    }
+
+    client.len = client_address(evcon, client.addr);
+    if (client.len > 0) {
+        verdict = cidr_verdict(client.len == 4 ? access->v4 : access->v6, client.addr, client.len * 8);
+        // an allow list admits nothing else
+        if (verdict == PHP_CAN_SERVER_ACCESS_DENY || (verdict == 0 && access->allows > 0)) {
+            access->denied++;
+            return 403;
+        }
+    }
+
+    if (access->connections == NULL) {
+        ALLOC_HASHTABLE(access->connections);
+        zend_hash_init(access->connections, 64, NULL, NULL, 0);
+        ALLOC_HASHTABLE(access->clients);
+        zend_hash_init(access->clients, 64, NULL, NULL, 0);
+    }
+    if (client.len > 0) {
+        if (zend_hash_find(access->clients, (char *)client.addr, client.len, (void **)&count) == SUCCESS) {
+            if (access->max_per_ip > 0 && *count >= access->max_per_ip) {
+                access->capped++;
+                return 503;
+            }
+            (*count)++;
+        } else {
+            zend_hash_add(access->clients, (char *)client.addr, client.len, &one, sizeof(one), NULL);
+        }
+    }
+    zend_hash_index_update(access->connections, (ulong)evcon, &client, sizeof(client), NULL);
+    return 0;
+}
+
+/**
+ * Forget a closed connection
+ */
+void php_can_server_access_close(struct php_can_server_access *access, struct evhttp_connection *evcon)
+{
+    struct php_can_server_access_client *client;
+    long *count;
+
+    if (access->connections == NULL
+            || zend_hash_index_find(access->connections, (ulong)evcon, (void **)&client) == FAILURE) {
+        return;
+    }
+    if (client->len > 0
+            && zend_hash_find(access->clients, (char *)client->addr, client->len, (void **)&count) == SUCCESS
+            && --(*count) <= 0) {
+        zend_hash_del(access->clients, (char *)client->addr, client->len);
+    }
+    zend_hash_index_del(access->connections, (ulong)evcon);
+}
+
+static void cidr_free(struct php_can_server_cidr_node *node)
+{
+    if (node != NULL) {
+        cidr_free(node->child[0]);
+        cidr_free(node->child[1]);
+        efree(node);
+    }
+}
+
+void php_can_server_access_free(struct php_can_server_access *access)
+{
+    cidr_free(access->v4);
+    cidr_free(access->v6);
+    access->v4 = access->v6 = NULL;
+    access->allows = 0;
+    if (access->connections != NULL) {
+        zend_hash_destroy(access->connections);
+        FREE_HASHTABLE(access->connections);
+        zend_hash_destroy(access->clients);
+        FREE_HASHTABLE(access->clients);
+        access->connections = access->clients = NULL;
+    }
+}
@@ -0,0 +1,316 @@
+/*
+  +----------------------------------------------------------------------+
+  | PHP Version 5.3                                                      |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2002-2011 Dmitri Vinogradov                            |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Authors: Dmitri Vinogradov <dmitri.vinogradov@gmail.com>             |
+  +----------------------------------------------------------------------+
+*/
+
+#include "Server.h"
+
+#include <event.h>
+#include <evhttp.h>
+#include <zlib.h>
+
+/* output space reserved per deflate() call */
+#define COMPRESS_CHUNK 16384
+
+struct php_can_compress {
+    z_stream zs;
+};
+
+/**
+ * Media types compressed unless the server is given its own list
+ */
+static const char *default_types[] = {
+    "text/*",
+    "application/json",
+    "application/javascript",
+    "application/xml",
+    "image/svg+xml",
+    NULL
+};
+
+/**
+ * Build the lookup table of compressible media types, a type like
+ * text/* covers the whole major type
+ */
+HashTable *php_can_compress_types(zval *types TSRMLS_DC)
+{
+    HashTable *ht;
+    HashPosition pos;
+    zval **entry;
+    char *type;
+    int i;
+
+    ALLOC_HASHTABLE(ht);
+    zend_hash_init(ht, 8, NULL, NULL, 0);
+    if (types == NULL) {
+        for (i = 0; default_types[i] != NULL; i++) {
+            zend_hash_add_empty_element(ht, default_types[i], strlen(default_types[i]) + 1);
+        }
+        return ht;
+    }
+    for (zend_hash_internal_pointer_reset_ex(Z_ARRVAL_P(types), &pos);
+            zend_hash_get_current_data_ex(Z_ARRVAL_P(types), (void **)&entry, &pos) == SUCCESS;
+            zend_hash_move_forward_ex(Z_ARRVAL_P(types), &pos)) {
+        if (Z_TYPE_PP(entry) == IS_STRING && Z_STRLEN_PP(entry) > 0) {
+            type = zend_str_tolower_dup(Z_STRVAL_PP(entry), Z_STRLEN_PP(entry));
+            zend_hash_add_empty_element(ht, type, Z_STRLEN_PP(entry) + 1);
+            efree(type);
+        }
+    }
+    return ht;
+}
+
+/**
+ * Weight an Accept-Encoding header gives to a content coding, the
+ * weight of * if the coding is not listed and 0 if neither is. Older
+ * clients ask for gzip as x-gzip, the higher weight of both counts.
+ */
+double php_can_compress_qvalue(const char *accept, const char *coding)
+{
+    double q, listed = -1, any = -1;
+    const char *p = accept, *param;
+    size_t len, token, coding_len = strlen(coding);
+
+    while (p != NULL && *p != '\0') {
+        p += strspn(p, " \t,");
+        len = strcspn(p, ",");
+        token = strcspn(p, " \t;,");
+        q = 1;
+        param = memchr(p, ';', len);
+        while (param != NULL && param < p + len) {
+            param += 1 + strspn(param + 1, " \t");
+            if ((*param == 'q' || *param == 'Q') && param[1] == '=') {
+                q = strtod(param + 2, NULL);
+                break;
+            }
+            param = memchr(param, ';', p + len - param);
+        }
+        if ((token == coding_len && strncasecmp(p, coding, token) == 0)
+                || (token == sizeof("x-gzip") - 1 && strncasecmp(p, "x-gzip", token) == 0
+                    && strcasecmp(coding, "gzip") == 0)) {
+            if (q > listed) {
+                listed = q;
+            }
+        } else if (token == 1 && *p == '*') {
+            any = q;
+        }
+        p += len;
+    }
+    if (listed >= 0) {
+        return listed;
+    }
+    return any > 0 ? any : 0;
+}
+
+/**
+ * Pick the content coding from an Accept-Encoding header, gzip wins
+ * over deflate on equal weights and codings with q=0 are refused
+ */
+int php_can_compress_negotiate(const char *accept)
+{
+    double gzip, deflate;
+
+    if (accept == NULL) {
+        return 0;
+    }
+    gzip = php_can_compress_qvalue(accept, "gzip");
+    deflate = php_can_compress_qvalue(accept, "deflate");
+    if (gzip > 0 && gzip >= deflate) {
+        return PHP_CAN_COMPRESS_GZIP;
+    }
+    return deflate > 0 ? PHP_CAN_COMPRESS_DEFLATE : 0;
+}
+
+/**
+ * Whether responses of the content type are worth compressing, a
+ * response without one goes out as text/html
+ */
+static int type_allowed(HashTable *types, const char *content_type)
+{
+    char type[128], *slash;
+    size_t len;
+
+    if (content_type == NULL) {
+        content_type = "text/html";
+    }
+    len = strcspn(content_type, "; \t");
+    if (len == 0 || len >= sizeof(type) - 1) {
+        return 0;
+    }
+    memcpy(type, content_type, len);
+    type[len] = '\0';
+    zend_str_tolower(type, len);
+    if (zend_hash_exists(types, type, len + 1)) {
+        return 1;
+    }
+    if ((slash = strchr(type, '/')) == NULL) {
+        return 0;
+    }
+    slash[1] = '*';
+    slash[2] = '\0';
+    return zend_hash_exists(types, type, slash - type + 3);
+}
+
+/**
+ * Run deflate() once into newly reserved space of the output buffer
+ */
+static int deflate_step(z_stream *zs, struct evbuffer *out, int flush)
+{
+    struct evbuffer_iovec vec;
+    int ret;
+
+    if (evbuffer_reserve_space(out, COMPRESS_CHUNK, &vec, 1) < 1) {
+        return Z_MEM_ERROR;
+    }
+    zs->next_out = (Bytef *)vec.iov_base;
+    zs->avail_out = (uInt)vec.iov_len;
+    ret = deflate(zs, flush);
+    vec.iov_len -= zs->avail_out;
+    evbuffer_commit_space(out, &vec, 1);
+    return ret;
+}
+
+struct php_can_compress *php_can_compress_new(int encoding, int level)
+{
+    struct php_can_compress *c = ecalloc(1, sizeof(*c));
+
+    // 16 added to the window bits asks zlib for a gzip wrapper
+    if (deflateInit2(&c->zs, level, Z_DEFLATED, encoding == PHP_CAN_COMPRESS_GZIP ? 15 + 16 : 15,
+            8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        efree(c);
+        return NULL;
+    }
+    return c;
+}
+
+/**
+ * Compress the whole input buffer into the output buffer, the input is
+ * drained extent by extent without linearizing it. Z_SYNC_FLUSH makes
+ * the output decodable up to here, Z_FINISH ends the stream.
+ */
+int php_can_compress_data(struct php_can_compress *c, struct evbuffer *in, struct evbuffer *out, int flush)
+{
+    struct evbuffer_iovec vec;
+    int ret = Z_OK;
+
+    while (evbuffer_peek(in, -1, NULL, &vec, 1) > 0 && vec.iov_len > 0) {
+        c->zs.next_in = (Bytef *)vec.iov_base;
+        c->zs.avail_in = (uInt)vec.iov_len;
+        while (c->zs.avail_in > 0) {
+            if ((ret = deflate_step(&c->zs, out, Z_NO_FLUSH)) != Z_OK) {
+                return FAILURE;
+            }
+        }
+        evbuffer_drain(in, vec.iov_len);
+    }
+
+    if (flush != Z_NO_FLUSH) {
+        do {
+            ret = deflate_step(&c->zs, out, flush);
+        } while (ret == Z_OK && (flush == Z_FINISH || c->zs.avail_out == 0));
+        if (ret != Z_STREAM_END && ret != Z_OK && ret != Z_BUF_ERROR) {
+            return FAILURE;
+        }
+    }
+    return SUCCESS;
+}
+
+void php_can_compress_free(struct php_can_compress *c)
+{
+    deflateEnd(&c->zs);
+    efree(c);
+}
+
+/**
+ * Set up compression of a response of the given length, -1 if it is
+ * sent in chunks. Compressible responses vary on Accept-Encoding even
+ * if this client gets them as they are. Returns the encoder if the
+ * client takes a compressed response, its headers are set then.
+ */
+struct php_can_compress *php_can_server_compress_start(struct php_can_server_compression *cfg,
+        struct evhttp_request *req, HashTable **headers, long code, long len)
+{
+    const char *etag;
+    struct php_can_compress *c;
+    int encoding;
+    char *weak;
+
+    if (cfg->level == 0 || req->type == EVHTTP_REQ_HEAD || code < 200 || code == 204 || code == 304
+            || (len >= 0 && len < cfg->min_size)
+            || evhttp_find_header(req->output_headers, "Content-Encoding") != NULL
+            || !type_allowed(cfg->types, evhttp_find_header(req->output_headers, "Content-Type"))) {
+        return NULL;
+    }
+    php_can_server_add_vary(req->output_headers, "Accept-Encoding");
+
+    encoding = php_can_compress_negotiate(php_can_server_header(headers, req->input_headers,
+            PHP_CAN_HEADER_ACCEPT_ENCODING));
+    if (encoding == 0 || (c = php_can_compress_new(encoding, cfg->level)) == NULL) {
+        return NULL;
+    }
+
+    evhttp_add_header(req->output_headers, "Content-Encoding",
+            encoding == PHP_CAN_COMPRESS_GZIP ? "gzip" : "deflate");
+    evhttp_remove_header(req->output_headers, "Content-Length");
+    // the compressed body is a different representation of the resource
+    if ((etag = evhttp_find_header(req->output_headers, "ETag")) != NULL && strncmp(etag, "W/", 2) != 0) {
+        spprintf(&weak, 0, "W/%s", etag);
+        evhttp_remove_header(req->output_headers, "ETag");
+        evhttp_add_header(req->output_headers, "ETag", weak);
+        efree(weak);
+    }
+    return c;
+}
+
+/**
+ * Compress a chunk of a chunked response in place, it is flushed so
+ * the client can decode everything sent so far
+ */
+void php_can_server_compress_chunk(struct php_can_server_request *request, struct evbuffer *buffer)
+{
+    struct evbuffer *out;
+
+    if (request->compress == NULL) {
+        return;
+    }
+    out = evbuffer_new();
+    php_can_compress_data(request->compress, buffer, out, Z_SYNC_FLUSH);
+    evbuffer_drain(buffer, evbuffer_get_length(buffer));
+    evbuffer_add_buffer(buffer, out);
+    evbuffer_free(out);
+}
+
+/**
+ * Send the end of the compressed stream of a chunked response, to be
+ * called right before evhttp_send_reply_end()
+ */
+void php_can_server_compress_end(struct php_can_server_request *request)
+{
+    struct evbuffer *out, *in;
+
+    if (request->compress == NULL) {
+        return;
+    }
+    out = evbuffer_new();
+    in = evbuffer_new();
+    if (php_can_compress_data(request->compress, in, out, Z_FINISH) == SUCCESS && evbuffer_get_length(out) > 0) {
+        evhttp_send_reply_chunk(request->req, out);
+    }
+    evbuffer_free(in);
+    evbuffer_free(out);
+    php_can_compress_free(request->compress);
+    request->compress = NULL;
+}
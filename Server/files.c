@@ -0,0 +1,185 @@
+/*
+  +----------------------------------------------------------------------+
+  | PHP Version 5.3                                                      |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2002-2011 Dmitri Vinogradov                            |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Authors: Dmitri Vinogradov <dmitri.vinogradov@gmail.com>             |
+  +----------------------------------------------------------------------+
+*/
+
+#include "Server.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+static void unlink_file(struct php_can_server_file_cache *cache, struct php_can_server_file *file)
+{
+    if (file->prev) {
+        file->prev->next = file->next;
+    } else {
+        cache->head = file->next;
+    }
+    if (file->next) {
+        file->next->prev = file->prev;
+    } else {
+        cache->tail = file->prev;
+    }
+    file->prev = file->next = NULL;
+}
+
+static void link_file(struct php_can_server_file_cache *cache, struct php_can_server_file *file)
+{
+    file->prev = NULL;
+    file->next = cache->head;
+    if (cache->head) {
+        cache->head->prev = file;
+    } else {
+        cache->tail = file;
+    }
+    cache->head = file;
+}
+
+/**
+ * Drop a file from the cache, it stays open while a response uses it
+ */
+static void evict(struct php_can_server_file_cache *cache, struct php_can_server_file *file)
+{
+    unlink_file(cache, file);
+    zend_hash_del(cache->entries, file->path, file->path_len + 1);
+    php_can_server_file_release(file);
+}
+
+/**
+ * Whether the file at path is still the one that was opened
+ */
+static int unchanged(const struct php_can_server_file *file)
+{
+    struct stat st;
+
+    return stat(file->path, &st) == 0
+        && st.st_ino == file->st.st_ino
+        && st.st_dev == file->st.st_dev
+        && st.st_mode == file->st.st_mode
+        && st.st_size == file->st.st_size
+        && st.st_mtime == file->st.st_mtime;
+}
+
+/**
+ * Look up an open file by its resolved path. A file is checked for
+ * changes once the revalidation interval has passed, a changed file is
+ * dropped. The caller releases the file it gets.
+ */
+struct php_can_server_file *php_can_server_file_find(struct php_can_server_file_cache *cache,
+        const char *path, int path_len)
+{
+    struct php_can_server_file **found, *file;
+    time_t now;
+
+    if (cache == NULL || cache->entries == NULL
+        || zend_hash_find(cache->entries, path, path_len + 1, (void **)&found) == FAILURE
+    ) {
+        return NULL;
+    }
+    file = *found;
+
+    now = time(NULL);
+    if (now - file->checked >= cache->revalidate) {
+        if (!unchanged(file)) {
+            evict(cache, file);
+            return NULL;
+        }
+        file->checked = now;
+    }
+
+    if (cache->head != file) {
+        unlink_file(cache, file);
+        link_file(cache, file);
+    }
+    file->refcount++;
+    return file;
+}
+
+/**
+ * Wrap a newly opened file, taking over its descriptor, and cache it
+ * unless the cache is disabled. The least recently used file makes room
+ * for it. The caller releases the file it gets.
+ */
+struct php_can_server_file *php_can_server_file_add(struct php_can_server_file_cache *cache,
+        const char *path, int path_len, int fd, const struct stat *st)
+{
+    struct php_can_server_file *file = ecalloc(1, sizeof(*file));
+
+    file->path = estrndup(path, path_len);
+    file->path_len = path_len;
+    file->fd = fd;
+    file->st = *st;
+    file->etag_len = spprintf(&file->etag, 0, "\"%x-%x-%x\"", (int)st->st_ino, (int)st->st_mtime, (int)st->st_size);
+    file->last_modified = NULL;
+    file->mimetype = NULL;
+    file->checked = time(NULL);
+    file->refcount = 1;
+    file->prev = file->next = NULL;
+
+    if (cache == NULL || cache->max_entries <= 0) {
+        return file;
+    }
+    if (cache->entries == NULL) {
+        ALLOC_HASHTABLE(cache->entries);
+        zend_hash_init(cache->entries, 64, NULL, NULL, 0);
+    }
+    php_can_server_file_cache_trim(cache, cache->max_entries - 1);
+    if (zend_hash_add(cache->entries, file->path, path_len + 1, &file, sizeof(file), NULL) == SUCCESS) {
+        link_file(cache, file);
+        file->refcount++;
+    }
+    return file;
+}
+
+void php_can_server_file_release(struct php_can_server_file *file)
+{
+    if (--file->refcount > 0) {
+        return;
+    }
+    close(file->fd);
+    efree(file->path);
+    efree(file->etag);
+    if (file->last_modified) {
+        efree(file->last_modified);
+    }
+    if (file->mimetype) {
+        efree(file->mimetype);
+    }
+    efree(file);
+}
+
+/**
+ * Drop least recently used files until at most max_entries are left
+ */
+void php_can_server_file_cache_trim(struct php_can_server_file_cache *cache, long max_entries)
+{
+    if (max_entries < 0) {
+        max_entries = 0;
+    }
+    while (cache->tail != NULL && (long)zend_hash_num_elements(cache->entries) > max_entries) {
+        evict(cache, cache->tail);
+    }
+}
+
+void php_can_server_file_cache_free(struct php_can_server_file_cache *cache)
+{
+    if (cache->entries != NULL) {
+        php_can_server_file_cache_trim(cache, 0);
+        zend_hash_destroy(cache->entries);
+        FREE_HASHTABLE(cache->entries);
+        cache->entries = NULL;
+    }
+}
@@ -0,0 +1,170 @@
+/*
+  +----------------------------------------------------------------------+
+  | PHP Version 5.3                                                      |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2002-2011 Dmitri Vinogradov                            |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Authors: Dmitri Vinogradov <dmitri.vinogradov@gmail.com>             |
+  +----------------------------------------------------------------------+
+*/
+
+#include "Server.h"
+
+#include <event.h>
+#include <evhttp.h>
+
+#define HEADER_NAME(name) { name, sizeof(name) - 1, 0 }
+
+/**
+ * Lowercased names of the headers looked up internally, in the
+ * order of enum php_can_server_header. Hashes are computed once.
+ */
+static struct {
+    const char *name;
+    uint len;
+    ulong h;
+} known_headers[PHP_CAN_HEADER_COUNT] = {
+    HEADER_NAME("accept"),
+    HEADER_NAME("accept-encoding"),
+    HEADER_NAME("access-control-request-headers"),
+    HEADER_NAME("access-control-request-method"),
+    HEADER_NAME("authorization"),
+    HEADER_NAME("connection"),
+    HEADER_NAME("content-length"),
+    HEADER_NAME("content-type"),
+    HEADER_NAME("cookie"),
+    HEADER_NAME("host"),
+    HEADER_NAME("if-modified-since"),
+    HEADER_NAME("if-none-match"),
+    HEADER_NAME("origin"),
+    HEADER_NAME("range"),
+    HEADER_NAME("sec-websocket-key"),
+    HEADER_NAME("sec-websocket-key1"),
+    HEADER_NAME("sec-websocket-key2"),
+    HEADER_NAME("sec-websocket-origin"),
+    HEADER_NAME("sec-websocket-protocol"),
+    HEADER_NAME("sec-websocket-version"),
+    HEADER_NAME("upgrade"),
+};
+static int known_headers_hashed = 0;
+
+/**
+ * Index the headers by lowercased name in a single pass, the first
+ * occurrence of a header wins like with evhttp_find_header()
+ */
+static HashTable *build_index(struct evkeyvalq *headers)
+{
+    struct evkeyval *header;
+    char buf[64], *key;
+    HashTable *index;
+    int len, i, count = 0;
+
+    for (header = headers->tqh_first; header; header = header->next.tqe_next) {
+        count++;
+    }
+
+    ALLOC_HASHTABLE(index);
+    zend_hash_init(index, count, NULL, NULL, 0);
+
+    for (header = headers->tqh_first; header; header = header->next.tqe_next) {
+        len = strlen(header->key);
+        key = len < (int)sizeof(buf) ? buf : emalloc(len + 1);
+        for (i = 0; i < len; i++) {
+            key[i] = tolower((unsigned char)header->key[i]);
+        }
+        key[len] = '\0';
+        zend_hash_add(index, key, len + 1, (void *)&header->value, sizeof(char *), NULL);
+        if (key != buf) {
+            efree(key);
+        }
+    }
+    return index;
+}
+
+/**
+ * Find well known header, the index is built on the first lookup
+ */
+const char *php_can_server_header(HashTable **index, struct evkeyvalq *headers, int id)
+{
+    char **value;
+
+    if (*index == NULL) {
+        *index = build_index(headers);
+    }
+    if (!known_headers_hashed) {
+        int i;
+        for (i = 0; i < PHP_CAN_HEADER_COUNT; i++) {
+            known_headers[i].h = zend_inline_hash_func(known_headers[i].name, known_headers[i].len + 1);
+        }
+        known_headers_hashed = 1;
+    }
+    if (SUCCESS == zend_hash_quick_find(*index, known_headers[id].name, known_headers[id].len + 1,
+            known_headers[id].h, (void **)&value)) {
+        return *value;
+    }
+    return NULL;
+}
+
+/**
+ * Find header by name in any case
+ */
+const char *php_can_server_find_header(HashTable **index, struct evkeyvalq *headers, const char *name, int name_len)
+{
+    char **value, *key;
+    int found;
+
+    if (*index == NULL) {
+        *index = build_index(headers);
+    }
+    key = zend_str_tolower_dup(name, name_len);
+    found = zend_hash_find(*index, key, name_len + 1, (void **)&value);
+    efree(key);
+    return found == SUCCESS ? *value : NULL;
+}
+
+/**
+ * Drop the index, must be called whenever the indexed headers change
+ */
+void php_can_server_header_index_free(HashTable **index)
+{
+    if (*index != NULL) {
+        zend_hash_destroy(*index);
+        FREE_HASHTABLE(*index);
+        *index = NULL;
+    }
+}
+
+/**
+ * Add a request header name to the Vary header of the response unless
+ * it is listed already or the response varies on everything
+ */
+void php_can_server_add_vary(struct evkeyvalq *headers, const char *field)
+{
+    const char *vary = evhttp_find_header(headers, "Vary"), *p;
+    size_t len, field_len = strlen(field);
+    char *value;
+
+    if (vary == NULL) {
+        evhttp_add_header(headers, "Vary", field);
+        return;
+    }
+    for (p = vary; *p != '\0'; p += len) {
+        p += strspn(p, " \t,");
+        len = strcspn(p, " \t,");
+        if ((len == 1 && *p == '*') || (len == field_len && strncasecmp(p, field, len) == 0)) {
+            return;
+        }
+    }
+    spprintf(&value, 0, "%s, %s", vary, field);
+    evhttp_remove_header(headers, "Vary");
+    evhttp_add_header(headers, "Vary", value);
+    efree(value);
+}
@@ -0,0 +1,456 @@
+/*
+  +----------------------------------------------------------------------+
+  | PHP Version 5.3                                                      |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2002-2011 Dmitri Vinogradov                            |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Authors: Dmitri Vinogradov <dmitri.vinogradov@gmail.com>             |
+  +----------------------------------------------------------------------+
+*/
+
+#include "Server.h"
+
+#include <event.h>
+
+/* space reserved in the output buffer at once */
+#define RESERVE_SIZE 4096
+
+/* longest printed double, see php_gcvt() */
+#define DOUBLE_PRECISION_MAX 40
+
+/**
+ * Writes straight into space reserved at the end of the output
+ * buffer, so encoded values are never staged in a PHP string
+ */
+struct json_writer {
+    struct evbuffer *out;
+    struct evbuffer_iovec vec;
+    size_t used;
+    int reserved;
+    int error;
+};
+
+static zend_class_entry *json_serializable_ce = NULL;
+static zend_bool json_serializable_resolved = 0;
+
+static int encode(struct json_writer *w, zval *val, int depth TSRMLS_DC);
+
+static void writer_commit(struct json_writer *w)
+{
+    if (w->reserved) {
+        w->vec.iov_len = w->used;
+        evbuffer_commit_space(w->out, &w->vec, 1);
+        w->reserved = 0;
+    }
+}
+
+static int writer_grow(struct json_writer *w)
+{
+    writer_commit(w);
+    w->used = 0;
+    if (evbuffer_reserve_space(w->out, RESERVE_SIZE, &w->vec, 1) < 1) {
+        w->error = 1;
+        return FAILURE;
+    }
+    w->reserved = 1;
+    return SUCCESS;
+}
+
+static void put(struct json_writer *w, const char *s, size_t len)
+{
+    while (len > 0) {
+        size_t n;
+        if ((!w->reserved || w->used == w->vec.iov_len) && writer_grow(w) == FAILURE) {
+            return;
+        }
+        n = w->vec.iov_len - w->used;
+        if (n > len) {
+            n = len;
+        }
+        memcpy((char *)w->vec.iov_base + w->used, s, n);
+        w->used += n;
+        s += n;
+        len -= n;
+    }
+}
+
+static inline void put_char(struct json_writer *w, char c)
+{
+    if ((!w->reserved || w->used == w->vec.iov_len) && writer_grow(w) == FAILURE) {
+        return;
+    }
+    ((char *)w->vec.iov_base)[w->used++] = c;
+}
+
+/**
+ * Decode one UTF-8 sequence, returns its length or 0 if it is
+ * invalid, overlong, a surrogate or beyond U+10FFFF
+ */
+static int utf8_decode(const unsigned char *s, size_t len, unsigned int *cp)
+{
+    unsigned int c = s[0];
+    int n, i;
+
+    if (c < 0xc2) {
+        return 0;
+    } else if (c < 0xe0) {
+        n = 2; c &= 0x1f;
+    } else if (c < 0xf0) {
+        n = 3; c &= 0x0f;
+    } else if (c < 0xf5) {
+        n = 4; c &= 0x07;
+    } else {
+        return 0;
+    }
+    if (len < n) {
+        return 0;
+    }
+    for (i = 1; i < n; i++) {
+        if ((s[i] & 0xc0) != 0x80) {
+            return 0;
+        }
+        c = (c << 6) | (s[i] & 0x3f);
+    }
+    if ((n == 3 && c < 0x800) || (n == 4 && (c < 0x10000 || c > 0x10ffff))
+            || (c >= 0xd800 && c <= 0xdfff)) {
+        return 0;
+    }
+    *cp = c;
+    return n;
+}
+
+static void put_u(struct json_writer *w, unsigned int c)
+{
+    static const char digits[] = "0123456789abcdef";
+    char buf[6] = {'\\', 'u'};
+
+    buf[2] = digits[(c >> 12) & 0xf];
+    buf[3] = digits[(c >> 8) & 0xf];
+    buf[4] = digits[(c >> 4) & 0xf];
+    buf[5] = digits[c & 0xf];
+    put(w, buf, 6);
+}
+
+/**
+ * Escape a string the way json_encode() does without options,
+ * runs of plain ASCII are copied at once
+ */
+static void encode_string(struct json_writer *w, const char *str, size_t len)
+{
+    const unsigned char *s = (const unsigned char *)str, *end = s + len, *run;
+
+    put_char(w, '"');
+    while (s < end) {
+        run = s;
+        while (s < end && *s >= 0x20 && *s < 0x80 && *s != '"' && *s != '\\' && *s != '/') {
+            s++;
+        }
+        if (s > run) {
+            put(w, (const char *)run, s - run);
+            if (s == end) {
+                break;
+            }
+        }
+        switch (*s) {
+            case '"':  put(w, "\\\"", 2); break;
+            case '\\': put(w, "\\\\", 2); break;
+            case '/':  put(w, "\\/", 2); break;
+            case '\b': put(w, "\\b", 2); break;
+            case '\f': put(w, "\\f", 2); break;
+            case '\n': put(w, "\\n", 2); break;
+            case '\r': put(w, "\\r", 2); break;
+            case '\t': put(w, "\\t", 2); break;
+            default:
+                if (*s < 0x20) {
+                    put_u(w, *s);
+                } else {
+                    unsigned int cp;
+                    int n = utf8_decode(s, end - s, &cp);
+                    if (n == 0) {
+                        w->error = 1;
+                        return;
+                    }
+                    if (cp >= 0x10000) {
+                        cp -= 0x10000;
+                        put_u(w, 0xd800 | (cp >> 10));
+                        put_u(w, 0xdc00 | (cp & 0x3ff));
+                    } else {
+                        put_u(w, cp);
+                    }
+                    s += n;
+                    continue;
+                }
+        }
+        s++;
+    }
+    put_char(w, '"');
+}
+
+static void encode_double(struct json_writer *w, double d TSRMLS_DC)
+{
+    char buf[NUM_BUF_SIZE];
+    int precision = (int)EG(precision);
+
+    if (zend_isinf(d) || zend_isnan(d)) {
+        w->error = 1;
+        return;
+    }
+    if (precision < 1) {
+        precision = 1;
+    } else if (precision > DOUBLE_PRECISION_MAX) {
+        precision = DOUBLE_PRECISION_MAX;
+    }
+    php_gcvt(d, precision, '.', 'e', buf);
+    put(w, buf, strlen(buf));
+}
+
+/**
+ * Check whether the keys of the array are 0..n-1 in order,
+ * such arrays are encoded as JSON lists
+ */
+int php_can_json_is_list(HashTable *ht)
+{
+    HashPosition pos;
+    char *key;
+    uint key_len;
+    ulong index, expected = 0;
+
+    for (zend_hash_internal_pointer_reset_ex(ht, &pos);
+            zend_hash_has_more_elements_ex(ht, &pos) == SUCCESS;
+            zend_hash_move_forward_ex(ht, &pos)) {
+        if (zend_hash_get_current_key_ex(ht, &key, &key_len, &index, 0, &pos) != HASH_KEY_IS_LONG
+                || index != expected++) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Encode the element at pos, with its key for objects
+ */
+static void encode_element(struct json_writer *w, HashTable *ht, HashPosition *pos, int object,
+        int depth TSRMLS_DC)
+{
+    zval **item;
+    char *key;
+    uint key_len;
+    ulong index;
+
+    zend_hash_get_current_data_ex(ht, (void **)&item, pos);
+    if (object) {
+        if (zend_hash_get_current_key_ex(ht, &key, &key_len, &index, 0, pos) == HASH_KEY_IS_STRING) {
+            encode_string(w, key, key_len - 1);
+        } else {
+            char buf[MAX_LENGTH_OF_LONG + 2];
+            int len = snprintf(buf, sizeof(buf), "\"%ld\"", (long)index);
+            put(w, buf, len);
+        }
+        put_char(w, ':');
+    }
+    encode(w, *item, depth TSRMLS_CC);
+}
+
+/**
+ * Skip private and protected properties, their names are mangled
+ */
+static inline int skip_property(HashTable *ht, HashPosition *pos)
+{
+    char *key;
+    uint key_len;
+    ulong index;
+
+    return zend_hash_get_current_key_ex(ht, &key, &key_len, &index, 0, pos) == HASH_KEY_IS_STRING
+        && key_len > 1 && key[0] == '\0';
+}
+
+static void encode_hash(struct json_writer *w, HashTable *ht, int object, int properties,
+        int depth TSRMLS_DC)
+{
+    HashPosition pos;
+    int first = 1;
+
+    if (depth > PHP_CAN_SERVER_JSON_DEPTH) {
+        w->error = 1;
+        return;
+    }
+    if (++ht->nApplyCount > 1) {
+        // recursive reference
+        ht->nApplyCount--;
+        w->error = 1;
+        return;
+    }
+
+    put_char(w, object ? '{' : '[');
+    for (zend_hash_internal_pointer_reset_ex(ht, &pos);
+            zend_hash_has_more_elements_ex(ht, &pos) == SUCCESS && !w->error && !EG(exception);
+            zend_hash_move_forward_ex(ht, &pos)) {
+        if (properties && skip_property(ht, &pos)) {
+            continue;
+        }
+        if (!first) {
+            put_char(w, ',');
+        }
+        first = 0;
+        encode_element(w, ht, &pos, object, depth + 1 TSRMLS_CC);
+    }
+    put_char(w, object ? '}' : ']');
+    ht->nApplyCount--;
+}
+
+static void encode_object(struct json_writer *w, zval *val, int depth TSRMLS_DC)
+{
+    HashTable *props;
+
+    if (php_can_json_serializable(val TSRMLS_CC)) {
+        zval *retval = NULL;
+
+        zend_call_method_with_0_params(&val, Z_OBJCE_P(val), NULL, "jsonserialize", &retval);
+        if (retval == NULL || EG(exception)) {
+            if (retval) {
+                zval_ptr_dtor(&retval);
+            }
+            w->error = 1;
+            return;
+        }
+        if (Z_TYPE_P(retval) == IS_OBJECT && Z_OBJ_HANDLE_P(retval) == Z_OBJ_HANDLE_P(val)) {
+            // returned itself, encode its properties
+            props = Z_OBJPROP_P(val);
+            if (props) {
+                encode_hash(w, props, 1, 1, depth TSRMLS_CC);
+            } else {
+                put(w, "{}", 2);
+            }
+        } else {
+            encode(w, retval, depth TSRMLS_CC);
+        }
+        zval_ptr_dtor(&retval);
+        return;
+    }
+
+    props = Z_OBJPROP_P(val);
+    if (props) {
+        encode_hash(w, props, 1, 1, depth TSRMLS_CC);
+    } else {
+        put(w, "{}", 2);
+    }
+}
+
+static int encode(struct json_writer *w, zval *val, int depth TSRMLS_DC)
+{
+    char buf[MAX_LENGTH_OF_LONG + 1];
+    int len;
+
+    switch (Z_TYPE_P(val)) {
+        case IS_NULL:
+            put(w, "null", 4);
+            break;
+        case IS_BOOL:
+            if (Z_BVAL_P(val)) {
+                put(w, "true", 4);
+            } else {
+                put(w, "false", 5);
+            }
+            break;
+        case IS_LONG:
+            len = snprintf(buf, sizeof(buf), "%ld", Z_LVAL_P(val));
+            put(w, buf, len);
+            break;
+        case IS_DOUBLE:
+            encode_double(w, Z_DVAL_P(val) TSRMLS_CC);
+            break;
+        case IS_STRING:
+            encode_string(w, Z_STRVAL_P(val), Z_STRLEN_P(val));
+            break;
+        case IS_ARRAY:
+            encode_hash(w, Z_ARRVAL_P(val), !php_can_json_is_list(Z_ARRVAL_P(val)), 0, depth TSRMLS_CC);
+            break;
+        case IS_OBJECT:
+            encode_object(w, val, depth TSRMLS_CC);
+            break;
+        default:
+            // resources can not be represented
+            w->error = 1;
+            break;
+    }
+    return w->error || EG(exception) ? FAILURE : SUCCESS;
+}
+
+/**
+ * Check whether the value implements JsonSerializable, the class
+ * entry is looked up once and does not exist before PHP 5.4
+ */
+int php_can_json_serializable(zval *value TSRMLS_DC)
+{
+    if (Z_TYPE_P(value) != IS_OBJECT) {
+        return 0;
+    }
+    if (!json_serializable_resolved) {
+        zend_class_entry **cep;
+        if (zend_hash_find(CG(class_table), "jsonserializable", sizeof("jsonserializable"),
+                (void **)&cep) == SUCCESS) {
+            json_serializable_ce = *cep;
+        }
+        json_serializable_resolved = 1;
+    }
+    return json_serializable_ce != NULL && instanceof_function(Z_OBJCE_P(value), json_serializable_ce TSRMLS_CC);
+}
+
+/**
+ * Append the JSON representation of the value to the buffer,
+ * on failure the buffer holds a partial document
+ */
+int php_can_json_encode(struct evbuffer *out, zval *value TSRMLS_DC)
+{
+    struct json_writer w = {0};
+    int result;
+
+    w.out = out;
+    result = encode(&w, value, 1 TSRMLS_CC);
+    writer_commit(&w);
+    return result;
+}
+
+/**
+ * Append elements of a list or object from pos on until the buffer
+ * grew by limit bytes. Returns 1 if elements are left, 0 when done,
+ * -1 on failure. Brackets are up to the caller.
+ */
+int php_can_json_encode_slice(struct evbuffer *out, HashTable *ht, HashPosition *pos, int object,
+        int *first, size_t limit TSRMLS_DC)
+{
+    struct json_writer w = {0};
+    size_t start = evbuffer_get_length(out);
+
+    w.out = out;
+    ht->nApplyCount++;
+    while (zend_hash_has_more_elements_ex(ht, pos) == SUCCESS) {
+        if (!*first) {
+            put_char(&w, ',');
+        }
+        *first = 0;
+        encode_element(&w, ht, pos, object, 2 TSRMLS_CC);
+        zend_hash_move_forward_ex(ht, pos);
+        if (w.error || EG(exception)) {
+            break;
+        }
+        if (evbuffer_get_length(out) - start + w.used >= limit) {
+            break;
+        }
+    }
+    ht->nApplyCount--;
+    writer_commit(&w);
+
+    if (w.error || EG(exception)) {
+        return -1;
+    }
+    return zend_hash_has_more_elements_ex(ht, pos) == SUCCESS;
+}
@@ -0,0 +1,526 @@
+/*
+  +----------------------------------------------------------------------+
+  | PHP Version 5.3                                                      |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2002-2011 Dmitri Vinogradov                            |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Authors: Dmitri Vinogradov <dmitri.vinogradov@gmail.com>             |
+  +----------------------------------------------------------------------+
+*/
+
+#include "Server.h"
+
+#include <event.h>
+#include <stdint.h>
+
+/* space reserved in the output buffer at once */
+#define RESERVE_SIZE 4096
+
+/* strings up to this length are copied into reserved space */
+#define INLINE_STRING_SIZE 256
+
+/**
+ * Writes straight into space reserved at the end of the output
+ * buffer, long strings are appended to the buffer directly
+ */
+struct msgpack_writer {
+    struct evbuffer *out;
+    struct evbuffer_iovec vec;
+    size_t used;
+    int reserved;
+    int error;
+};
+
+struct msgpack_reader {
+    const unsigned char *p;
+    const unsigned char *end;
+};
+
+static void encode(struct msgpack_writer *w, zval *val, int depth TSRMLS_DC);
+
+static void writer_commit(struct msgpack_writer *w)
+{
+    if (w->reserved) {
+        w->vec.iov_len = w->used;
+        evbuffer_commit_space(w->out, &w->vec, 1);
+        w->reserved = 0;
+    }
+}
+
+/**
+ * Make sure len bytes fit into the reserved space, len is
+ * never more than a token header
+ */
+static unsigned char *reserve(struct msgpack_writer *w, size_t len)
+{
+    if (!w->reserved || w->vec.iov_len - w->used < len) {
+        writer_commit(w);
+        w->used = 0;
+        if (evbuffer_reserve_space(w->out, RESERVE_SIZE, &w->vec, 1) < 1) {
+            w->error = 1;
+            return NULL;
+        }
+        w->reserved = 1;
+    }
+    return (unsigned char *)w->vec.iov_base + w->used;
+}
+
+static void put_byte(struct msgpack_writer *w, unsigned char c)
+{
+    unsigned char *p = reserve(w, 1);
+    if (p) {
+        *p = c;
+        w->used++;
+    }
+}
+
+/**
+ * Type byte followed by a big endian value of size bytes
+ */
+static void put_typed(struct msgpack_writer *w, unsigned char type, uint64_t value, int size)
+{
+    unsigned char *p = reserve(w, size + 1);
+    int i;
+
+    if (p) {
+        p[0] = type;
+        for (i = size; i > 0; i--) {
+            p[i] = (unsigned char)value;
+            value >>= 8;
+        }
+        w->used += size + 1;
+    }
+}
+
+static void put_bytes(struct msgpack_writer *w, const char *s, size_t len)
+{
+    unsigned char *p;
+
+    if (len > INLINE_STRING_SIZE) {
+        writer_commit(w);
+        evbuffer_add(w->out, s, len);
+        return;
+    }
+    if ((p = reserve(w, len)) != NULL) {
+        memcpy(p, s, len);
+        w->used += len;
+    }
+}
+
+static void encode_long(struct msgpack_writer *w, long l)
+{
+    if (l >= 0) {
+        if (l < 128) {
+            put_byte(w, (unsigned char)l);
+        } else if (l < 0x100) {
+            put_typed(w, 0xcc, l, 1);
+        } else if (l < 0x10000) {
+            put_typed(w, 0xcd, l, 2);
+        } else if ((uint64_t)l < 0x100000000ULL) {
+            put_typed(w, 0xce, l, 4);
+        } else {
+            put_typed(w, 0xcf, l, 8);
+        }
+    } else {
+        if (l >= -32) {
+            put_byte(w, (unsigned char)(l & 0xff));
+        } else if (l >= -128) {
+            put_typed(w, 0xd0, (uint64_t)l, 1);
+        } else if (l >= -32768) {
+            put_typed(w, 0xd1, (uint64_t)l, 2);
+        } else if ((int64_t)l >= -2147483648LL) {
+            put_typed(w, 0xd2, (uint64_t)l, 4);
+        } else {
+            put_typed(w, 0xd3, (uint64_t)l, 8);
+        }
+    }
+}
+
+static void encode_double(struct msgpack_writer *w, double d)
+{
+    union { double d; uint64_t u; } v;
+
+    v.d = d;
+    put_typed(w, 0xcb, v.u, 8);
+}
+
+static void encode_string(struct msgpack_writer *w, const char *s, size_t len)
+{
+    if (len < 32) {
+        put_byte(w, 0xa0 | (unsigned char)len);
+    } else if (len < 0x100) {
+        put_typed(w, 0xd9, len, 1);
+    } else if (len < 0x10000) {
+        put_typed(w, 0xda, len, 2);
+    } else {
+        put_typed(w, 0xdb, len, 4);
+    }
+    put_bytes(w, s, len);
+}
+
+static void encode_container(struct msgpack_writer *w, int map, size_t count)
+{
+    if (count < 16) {
+        put_byte(w, (map ? 0x80 : 0x90) | (unsigned char)count);
+    } else if (count < 0x10000) {
+        put_typed(w, map ? 0xde : 0xdc, count, 2);
+    } else {
+        put_typed(w, map ? 0xdf : 0xdd, count, 4);
+    }
+}
+
+static inline int mangled(HashTable *ht, HashPosition *pos, char **key, uint *key_len, ulong *index)
+{
+    return zend_hash_get_current_key_ex(ht, key, key_len, index, 0, pos) == HASH_KEY_IS_STRING
+        && *key_len > 1 && (*key)[0] == '\0';
+}
+
+/**
+ * Lists become arrays, anything else a map. Private and protected
+ * properties of objects are left out.
+ */
+static void encode_hash(struct msgpack_writer *w, HashTable *ht, int properties, int depth TSRMLS_DC)
+{
+    HashPosition pos;
+    zval **item;
+    char *key;
+    uint key_len;
+    ulong index;
+    size_t count = zend_hash_num_elements(ht);
+    int map = properties || !php_can_json_is_list(ht);
+
+    if (depth > PHP_CAN_SERVER_JSON_DEPTH) {
+        w->error = 1;
+        return;
+    }
+    if (++ht->nApplyCount > 1) {
+        // recursive reference
+        ht->nApplyCount--;
+        w->error = 1;
+        return;
+    }
+
+    if (properties) {
+        for (zend_hash_internal_pointer_reset_ex(ht, &pos);
+                zend_hash_has_more_elements_ex(ht, &pos) == SUCCESS;
+                zend_hash_move_forward_ex(ht, &pos)) {
+            if (mangled(ht, &pos, &key, &key_len, &index)) {
+                count--;
+            }
+        }
+    }
+
+    encode_container(w, map, count);
+    for (zend_hash_internal_pointer_reset_ex(ht, &pos);
+            zend_hash_has_more_elements_ex(ht, &pos) == SUCCESS && !w->error && !EG(exception);
+            zend_hash_move_forward_ex(ht, &pos)) {
+        if (map) {
+            if (properties && mangled(ht, &pos, &key, &key_len, &index)) {
+                continue;
+            }
+            if (zend_hash_get_current_key_ex(ht, &key, &key_len, &index, 0, &pos) == HASH_KEY_IS_STRING) {
+                encode_string(w, key, key_len - 1);
+            } else {
+                encode_long(w, (long)index);
+            }
+        }
+        zend_hash_get_current_data_ex(ht, (void **)&item, &pos);
+        encode(w, *item, depth + 1 TSRMLS_CC);
+    }
+    ht->nApplyCount--;
+}
+
+static void encode_object(struct msgpack_writer *w, zval *val, int depth TSRMLS_DC)
+{
+    HashTable *props;
+
+    if (php_can_json_serializable(val TSRMLS_CC)) {
+        zval *retval = NULL;
+
+        zend_call_method_with_0_params(&val, Z_OBJCE_P(val), NULL, "jsonserialize", &retval);
+        if (retval == NULL || EG(exception)) {
+            if (retval) {
+                zval_ptr_dtor(&retval);
+            }
+            w->error = 1;
+            return;
+        }
+        if (Z_TYPE_P(retval) != IS_OBJECT || Z_OBJ_HANDLE_P(retval) != Z_OBJ_HANDLE_P(val)) {
+            encode(w, retval, depth TSRMLS_CC);
+            zval_ptr_dtor(&retval);
+            return;
+        }
+        // returned itself, encode its properties
+        zval_ptr_dtor(&retval);
+    }
+
+    props = Z_OBJPROP_P(val);
+    if (props) {
+        encode_hash(w, props, 1, depth TSRMLS_CC);
+    } else {
+        encode_container(w, 1, 0);
+    }
+}
+
+static void encode(struct msgpack_writer *w, zval *val, int depth TSRMLS_DC)
+{
+    switch (Z_TYPE_P(val)) {
+        case IS_NULL:
+            put_byte(w, 0xc0);
+            break;
+        case IS_BOOL:
+            put_byte(w, Z_BVAL_P(val) ? 0xc3 : 0xc2);
+            break;
+        case IS_LONG:
+            encode_long(w, Z_LVAL_P(val));
+            break;
+        case IS_DOUBLE:
+            encode_double(w, Z_DVAL_P(val));
+            break;
+        case IS_STRING:
+            encode_string(w, Z_STRVAL_P(val), Z_STRLEN_P(val));
+            break;
+        case IS_ARRAY:
+            encode_hash(w, Z_ARRVAL_P(val), 0, depth TSRMLS_CC);
+            break;
+        case IS_OBJECT:
+            encode_object(w, val, depth TSRMLS_CC);
+            break;
+        default:
+            // resources can not be represented
+            w->error = 1;
+            break;
+    }
+}
+
+/**
+ * Append the MessagePack representation of the value to the buffer,
+ * on failure the buffer holds a partial document
+ */
+int php_can_msgpack_encode(struct evbuffer *out, zval *value TSRMLS_DC)
+{
+    struct msgpack_writer w = {0};
+
+    w.out = out;
+    encode(&w, value, 1 TSRMLS_CC);
+    writer_commit(&w);
+    return w.error || EG(exception) ? FAILURE : SUCCESS;
+}
+
+static inline int need(struct msgpack_reader *r, size_t len)
+{
+    return (size_t)(r->end - r->p) >= len;
+}
+
+static uint64_t read_be(struct msgpack_reader *r, int size)
+{
+    uint64_t value = 0;
+    int i;
+
+    for (i = 0; i < size; i++) {
+        value = (value << 8) | r->p[i];
+    }
+    r->p += size;
+    return value;
+}
+
+static int decode(struct msgpack_reader *r, zval *val, int depth TSRMLS_DC);
+
+static int decode_string(struct msgpack_reader *r, zval *val, size_t len)
+{
+    if (!need(r, len)) {
+        return FAILURE;
+    }
+    ZVAL_STRINGL(val, (char *)r->p, len, 1);
+    r->p += len;
+    return SUCCESS;
+}
+
+static int decode_array(struct msgpack_reader *r, zval *val, size_t count, int depth TSRMLS_DC)
+{
+    size_t i;
+
+    // every element takes at least one byte
+    if (depth > PHP_CAN_SERVER_JSON_DEPTH || !need(r, count)) {
+        return FAILURE;
+    }
+    array_init_size(val, count);
+    for (i = 0; i < count; i++) {
+        zval *item;
+        MAKE_STD_ZVAL(item);
+        if (decode(r, item, depth + 1 TSRMLS_CC) == FAILURE) {
+            zval_ptr_dtor(&item);
+            return FAILURE;
+        }
+        add_next_index_zval(val, item);
+    }
+    return SUCCESS;
+}
+
+static int decode_map(struct msgpack_reader *r, zval *val, size_t count, int depth TSRMLS_DC)
+{
+    size_t i;
+
+    // every key and value takes at least one byte
+    if (depth > PHP_CAN_SERVER_JSON_DEPTH || !need(r, count * 2)) {
+        return FAILURE;
+    }
+    array_init_size(val, count);
+    for (i = 0; i < count; i++) {
+        zval key, *item;
+        INIT_ZVAL(key);
+        if (decode(r, &key, depth + 1 TSRMLS_CC) == FAILURE) {
+            zval_dtor(&key);
+            return FAILURE;
+        }
+        if (Z_TYPE(key) != IS_STRING && Z_TYPE(key) != IS_LONG) {
+            zval_dtor(&key);
+            return FAILURE;
+        }
+        MAKE_STD_ZVAL(item);
+        if (decode(r, item, depth + 1 TSRMLS_CC) == FAILURE) {
+            zval_ptr_dtor(&item);
+            zval_dtor(&key);
+            return FAILURE;
+        }
+        if (Z_TYPE(key) == IS_LONG) {
+            zend_hash_index_update(Z_ARRVAL_P(val), Z_LVAL(key), &item, sizeof(zval *), NULL);
+        } else {
+            zend_symtable_update(Z_ARRVAL_P(val), Z_STRVAL(key), Z_STRLEN(key) + 1, &item, sizeof(zval *), NULL);
+        }
+        zval_dtor(&key);
+    }
+    return SUCCESS;
+}
+
+/**
+ * Decode one value, on failure val holds whatever was decoded so far
+ * and must still be destroyed by the caller
+ */
+static int decode(struct msgpack_reader *r, zval *val, int depth TSRMLS_DC)
+{
+    unsigned char type;
+    uint64_t u;
+
+    ZVAL_NULL(val);
+    if (!need(r, 1)) {
+        return FAILURE;
+    }
+    type = *r->p++;
+
+    if (type < 0x80) {
+        ZVAL_LONG(val, type);
+        return SUCCESS;
+    } else if (type >= 0xe0) {
+        ZVAL_LONG(val, (signed char)type);
+        return SUCCESS;
+    } else if (type < 0x90) {
+        return decode_map(r, val, type & 0x0f, depth TSRMLS_CC);
+    } else if (type < 0xa0) {
+        return decode_array(r, val, type & 0x0f, depth TSRMLS_CC);
+    } else if (type < 0xc0) {
+        return decode_string(r, val, type & 0x1f);
+    }
+
+    switch (type) {
+        case 0xc0:
+            return SUCCESS;
+        case 0xc2:
+        case 0xc3:
+            ZVAL_BOOL(val, type == 0xc3);
+            return SUCCESS;
+        case 0xc4: case 0xd9:
+            return need(r, 1) ? decode_string(r, val, read_be(r, 1)) : FAILURE;
+        case 0xc5: case 0xda:
+            return need(r, 2) ? decode_string(r, val, read_be(r, 2)) : FAILURE;
+        case 0xc6: case 0xdb:
+            return need(r, 4) ? decode_string(r, val, read_be(r, 4)) : FAILURE;
+        case 0xca:
+            if (!need(r, 4)) {
+                return FAILURE;
+            } else {
+                union { float f; uint32_t u; } v;
+                v.u = (uint32_t)read_be(r, 4);
+                ZVAL_DOUBLE(val, v.f);
+            }
+            return SUCCESS;
+        case 0xcb:
+            if (!need(r, 8)) {
+                return FAILURE;
+            } else {
+                union { double d; uint64_t u; } v;
+                v.u = read_be(r, 8);
+                ZVAL_DOUBLE(val, v.d);
+            }
+            return SUCCESS;
+        case 0xcc: case 0xcd: case 0xce: case 0xcf:
+            if (!need(r, 1 << (type - 0xcc))) {
+                return FAILURE;
+            }
+            u = read_be(r, 1 << (type - 0xcc));
+            if (u > (uint64_t)LONG_MAX) {
+                // like PHP does with integer overflow
+                ZVAL_DOUBLE(val, (double)u);
+            } else {
+                ZVAL_LONG(val, (long)u);
+            }
+            return SUCCESS;
+        case 0xd0:
+            if (!need(r, 1)) return FAILURE;
+            ZVAL_LONG(val, (int8_t)read_be(r, 1));
+            return SUCCESS;
+        case 0xd1:
+            if (!need(r, 2)) return FAILURE;
+            ZVAL_LONG(val, (int16_t)read_be(r, 2));
+            return SUCCESS;
+        case 0xd2:
+            if (!need(r, 4)) return FAILURE;
+            ZVAL_LONG(val, (int32_t)read_be(r, 4));
+            return SUCCESS;
+        case 0xd3:
+            if (!need(r, 8)) return FAILURE;
+            u = read_be(r, 8);
+            if ((int64_t)u < LONG_MIN) {
+                ZVAL_DOUBLE(val, (double)(int64_t)u);
+            } else {
+                ZVAL_LONG(val, (long)(int64_t)u);
+            }
+            return SUCCESS;
+        case 0xdc:
+            return need(r, 2) ? decode_array(r, val, read_be(r, 2), depth TSRMLS_CC) : FAILURE;
+        case 0xdd:
+            return need(r, 4) ? decode_array(r, val, read_be(r, 4), depth TSRMLS_CC) : FAILURE;
+        case 0xde:
+            return need(r, 2) ? decode_map(r, val, read_be(r, 2), depth TSRMLS_CC) : FAILURE;
+        case 0xdf:
+            return need(r, 4) ? decode_map(r, val, read_be(r, 4), depth TSRMLS_CC) : FAILURE;
+    }
+
+    // extension types and the never used 0xc1
+    return FAILURE;
+}
+
+/**
+ * Decode a single MessagePack value spanning exactly len bytes
+ */
+int php_can_msgpack_decode(zval *value, const char *data, size_t len TSRMLS_DC)
+{
+    struct msgpack_reader r;
+
+    r.p = (const unsigned char *)data;
+    r.end = r.p + len;
+    if (decode(&r, value, 1 TSRMLS_CC) == FAILURE || r.p != r.end) {
+        zval_dtor(value);
+        ZVAL_NULL(value);
+        return FAILURE;
+    }
+    return SUCCESS;
+}
@@ -18,11 +18,22 @@
 
 #include "php.h"
 #include "Exception.h"
+#include "ext/standard/php_smart_str.h"
+#include "ext/standard/php_rand.h"
 #include <event.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#if defined(O_TMPFILE) && defined(AT_SYMLINK_FOLLOW)
+#define PHP_CAN_HAVE_O_TMPFILE 1
+#endif
 
 /* The longest anonymous name */
 #define MAX_SIZE_ANONNAME 33
 
+/* Longest headers block of a part */
+#define PHP_CAN_MULTIPART_MAX_HEADERS 8192
+
 #if PHP_VERSION_ID < 50399 && HAVE_MBSTRING && !defined(COMPILE_DL_MBSTRING)
 #include "ext/mbstring/mbstring.h"
 #endif
@@ -37,6 +48,35 @@ static int unlink_filename(zval **item TSRMLS_DC)
     return 0;
 }
 
+/**
+ * Describe a request body spilled to a temporary file, the file is
+ * removed with the description. The stream is rewound to the start.
+ */
+zval *php_can_body_file(const char *tmp_name, int fd, long size TSRMLS_DC)
+{
+    zval *file, *zstream;
+    php_stream *stream;
+
+    MAKE_STD_ZVAL(file);
+    ALLOC_HASHTABLE(Z_ARRVAL_P(file));
+    zend_hash_init(Z_ARRVAL_P(file), 4, NULL, (dtor_func_t)  unlink_filename, 0);
+    Z_TYPE_P(file) = IS_ARRAY;
+
+    add_assoc_string(file, "tmp_name", (char *)tmp_name, 1);
+    add_assoc_long(  file, "filesize", size);
+
+    lseek(fd, 0, SEEK_SET);
+    stream = php_stream_fopen_from_fd(fd, "rb", NULL);
+    if (stream != NULL) {
+        MAKE_STD_ZVAL(zstream);
+        php_stream_to_zval(stream, zstream);
+        add_assoc_zval(file, "stream", zstream);
+    } else {
+        close(fd);
+    }
+    return file;
+}
+
 static char * getword(char **line, char stop)
 {
     char *pos = *line, quote;
@@ -167,60 +207,170 @@ look_for_quote:
     return res;
 }
 
-static const char* my_memmem( const char * s1, size_t l1, const char * s2, size_t l2 )
+/**
+ * Parser state, a part is the headers followed by the body
+ */
+enum {
+    MULTIPART_PREAMBLE,
+    MULTIPART_BOUNDARY,
+    MULTIPART_HEADERS,
+    MULTIPART_BODY,
+    MULTIPART_DONE,
+    MULTIPART_ERROR
+};
+
+struct php_can_multipart {
+    /* data received but not consumed yet */
+    struct evbuffer *buf;
+    /* CRLF "--" boundary and its search skip table */
+    char *delim;
+    size_t delim_len;
+    size_t delim_skip[256];
+    /* skip table of the empty line ending the part headers */
+    size_t headers_skip[256];
+    /* bytes already searched for the end of the part headers */
+    size_t scanned;
+    int state;
+    int upload_cnt;
+    unsigned int anonindex;
+    /* files up to this size are kept in memory */
+    size_t memory_size;
+    zval *post;
+    zval *files;
+    /* callback getting the files instead of temporary files */
+    zval *handler;
+    zval *zrequest;
+    /* part being parsed */
+    char *param;
+    char *filename;
+    char *type;
+    smart_str value;
+    /* the file goes to the handler */
+    int streaming;
+    char *tmp_name;
+    int fd;
+    /* the file has no name yet */
+    int unnamed;
+    /* the file is kept in value so far */
+    int memory;
+    size_t size;
+};
+
+/**
+ * Fill the Boyer-Moore-Horspool bad character table of the needle
+ */
+static void multipart_skip_table(const char *needle, size_t len, size_t *skip)
 {
-    if( !l2 ) return s1;
-    while( l1 >= l2 )
-    {
-        l1--;
-        if( !memcmp( s1, s2, l2 ) )
-            return s1;
-        s1++;
-    }
-    return NULL;
+    size_t i;
+
+    for (i = 0; i < 256; i++) {
+        skip[i] = len;
+    }
+    for (i = 0; i + 1 < len; i++) {
+        skip[(unsigned char)needle[i]] = len - 1 - i;
+    }
 }
 
-static int unlink_uploaded_files(char **filename TSRMLS_DC)
+struct multipart_cursor {
+    struct evbuffer_iovec *vec;
+    int i;
+    size_t base;
+};
+
+/**
+ * Byte at the offset of the buffer, the cursor remembers the chunk
+ * last read from so that nearby offsets are found right away
+ */
+static inline unsigned char multipart_byte(struct multipart_cursor *c, size_t pos)
 {
-    VCWD_UNLINK(*filename);
-    return 0;
+    while (pos < c->base) {
+        c->i--;
+        c->base -= c->vec[c->i].iov_len;
+    }
+    while (pos >= c->base + c->vec[c->i].iov_len) {
+        c->base += c->vec[c->i].iov_len;
+        c->i++;
+    }
+    return ((unsigned char *)c->vec[c->i].iov_base)[pos - c->base];
 }
 
-void  php_can_parse_multipart(const char* content_type, struct evbuffer* buffer, zval* post, zval** files TSRMLS_DC)
+/**
+ * Boyer-Moore-Horspool search for the needle from the offset on, the
+ * buffer chunks are read where they are instead of being linearized.
+ * Returns the offset of the match or -1.
+ */
+static ev_ssize_t multipart_search(struct evbuffer *buf, const char *needle, size_t len,
+        const size_t *skip, size_t from)
 {
-    char *boundary      = NULL,
-         *boundary_end  = NULL,
-         *boundary_val  = NULL,
-         *temp_filename = NULL,
-         *max_uploads   = INI_STR("max_file_uploads");
-
-    int max_file_size = 0,
-        skip_upload   = 0,
-        upload_cnt    = 0,
-        fd            = -1;
-
-    size_t boundary_len     = 0,
-           boundary_val_len = 0,
-           anonindex        = 0,
-           is_anonymous     = 0;
+    struct evbuffer_iovec vec_stack[16], *vec = vec_stack;
+    struct multipart_cursor c;
+    size_t total = evbuffer_get_length(buf), pos, k;
+    unsigned char last = (unsigned char)needle[len - 1], byte;
+    ev_ssize_t found = -1;
+    int n;
+
+    if (total < from + len) {
+        return -1;
+    }
 
-    const char * in     = EVBUFFER_DATA( buffer );
-    size_t       inlen  = EVBUFFER_LENGTH( buffer );
+    n = evbuffer_peek(buf, -1, NULL, NULL, 0);
+    if (n > (int)(sizeof(vec_stack) / sizeof(vec_stack[0]))) {
+        vec = safe_emalloc(n, sizeof(*vec), 0);
+    }
+    n = evbuffer_peek(buf, -1, NULL, vec, n);
+
+    if (n == 1) {
+        // contiguous data, no need for the cursor
+        const unsigned char *data = (const unsigned char *)vec[0].iov_base;
+        for (pos = from + len - 1; pos < total; pos += skip[byte]) {
+            byte = data[pos];
+            if (byte == last && !memcmp(data + pos + 1 - len, needle, len - 1)) {
+                found = pos + 1 - len;
+                break;
+            }
+        }
+    } else {
+        c.vec = vec;
+        c.i = 0;
+        c.base = 0;
+        for (pos = from + len - 1; pos < total; pos += skip[byte]) {
+            byte = multipart_byte(&c, pos);
+            if (byte == last) {
+                for (k = 1; k < len && multipart_byte(&c, pos - k) == (unsigned char)needle[len - 1 - k]; k++);
+                if (k == len) {
+                    found = pos + 1 - len;
+                    break;
+                }
+            }
+        }
+    }
 
-    if (max_uploads && *max_uploads) {
-        upload_cnt = atoi(max_uploads);
+    if (vec != vec_stack) {
+        efree(vec);
     }
+    return found;
+}
+
+/**
+ * Create a parser adding fields to post and uploaded files to files,
+ * returns NULL if the content type has no boundary
+ */
+struct php_can_multipart *php_can_multipart_new(const char *content_type, zval *post, zval *files,
+        size_t memory_size TSRMLS_DC)
+{
+    struct php_can_multipart *mp;
+    const char *boundary, *boundary_end;
+    char *max_uploads = INI_STR("max_file_uploads");
+    size_t boundary_len;
 
     // Get the boundary
     boundary = strstr(content_type, "boundary");
     if (!boundary || !(boundary = strchr(boundary, '='))) {
         php_error_docref(NULL TSRMLS_CC, E_WARNING, "Missing boundary in multipart/form-data POST data");
-        return;
+        return NULL;
     }
 
     boundary++;
-    boundary_len = strlen(boundary);
-
     if (boundary[0] == '"') {
         boundary++;
         boundary_end = strchr(boundary, '"');
@@ -229,187 +379,599 @@ void  php_can_parse_multipart(const char* content_type, struct evbuffer* buffer,
                 ce_can_LogicException TSRMLS_CC,
                 "Invalid boundary in multipart/form-data POST data"
             );
-            return;
+            return NULL;
         }
     } else {
         // search for the end of the boundary
         boundary_end = strchr(boundary, ',');
     }
-    if (boundary_end) {
-        boundary_end[0] = '\0';
-        boundary_len = boundary_end - boundary;
+    boundary_len = boundary_end ? (size_t)(boundary_end - boundary) : strlen(boundary);
+
+    mp = ecalloc(1, sizeof(*mp));
+    mp->buf = evbuffer_new();
+    mp->delim_len = spprintf(&mp->delim, 0, "\r\n--%.*s", (int)boundary_len, boundary);
+    multipart_skip_table(mp->delim, mp->delim_len, mp->delim_skip);
+    multipart_skip_table("\r\n\r\n", 4, mp->headers_skip);
+    mp->state = MULTIPART_PREAMBLE;
+    mp->fd = -1;
+    mp->memory_size = memory_size;
+    if (max_uploads && *max_uploads) {
+        mp->upload_cnt = atoi(max_uploads);
     }
+    Z_ADDREF_P(post);
+    mp->post = post;
+    Z_ADDREF_P(files);
+    mp->files = files;
+    return mp;
+}
 
-    // set boundary value
-    spprintf(&boundary_val, 0, "--%s", boundary);
-    boundary_val_len = strlen(boundary_val);
-
-    const char * delim = my_memmem(in, inlen, (const char *) boundary_val, boundary_val_len );
-
-    MAKE_STD_ZVAL(*files);
-    array_init(*files);
+static const char *multipart_tmpdir(TSRMLS_D)
+{
+    if (PG(upload_tmp_dir) && *PG(upload_tmp_dir)) {
+        return PG(upload_tmp_dir);
+    }
+#if PHP_VERSION_ID >= 50500
+    return php_get_temporary_directory(TSRMLS_C);
+#else
+    return php_get_temporary_directory();
+#endif
+}
 
-    while( delim ) {
+/**
+ * Open the temporary file of an upload. Where the file system allows
+ * it the file has no name until the upload is complete, so uploads
+ * cut off never show up in the directory.
+ */
+static int multipart_tmpfile_open(struct php_can_multipart *mp TSRMLS_DC)
+{
+#ifdef PHP_CAN_HAVE_O_TMPFILE
+    mp->fd = open(multipart_tmpdir(TSRMLS_C), O_TMPFILE | O_RDWR, 0600);
+    if (mp->fd != -1) {
+        mp->unnamed = 1;
+        return mp->fd;
+    }
+#endif
+    mp->fd = php_open_temporary_fd_ex(PG(upload_tmp_dir), "phpcan", &mp->tmp_name, 1 TSRMLS_CC);
+    if (mp->fd == -1) { // create temporary file failed
+        php_error_docref(NULL TSRMLS_CC, E_WARNING,
+            "File upload error - unable to create a temporary file");
+    }
+    return mp->fd;
+}
 
-        size_t part_len;
-        const char * part = delim + boundary_val_len;
-        inlen -= ( part - in );
-        in = part;
+/**
+ * Give the temporary file of a complete upload its name
+ */
+static int multipart_tmpfile_link(struct php_can_multipart *mp TSRMLS_DC)
+{
+#ifdef PHP_CAN_HAVE_O_TMPFILE
+    char proc[sizeof("/proc/self/fd/") + MAX_LENGTH_OF_LONG];
+    int tries;
 
-        delim = my_memmem(in, inlen, (const char *) boundary_val, boundary_val_len );
-        part_len = delim ? (size_t)( delim - part ) : inlen;
+    if (!mp->unnamed) {
+        return SUCCESS;
+    }
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", mp->fd);
+    for (tries = 0; tries < 16; tries++) {
+        spprintf(&mp->tmp_name, 0, "%s/phpcan%08lx", multipart_tmpdir(TSRMLS_C),
+                (unsigned long)php_rand(TSRMLS_C) & 0xffffffffUL);
+        if (linkat(AT_FDCWD, proc, AT_FDCWD, mp->tmp_name, AT_SYMLINK_FOLLOW) == 0) {
+            mp->unnamed = 0;
+            return SUCCESS;
+        }
+        efree(mp->tmp_name);
+        mp->tmp_name = NULL;
+        if (errno != EEXIST) {
+            break;
+        }
+    }
+    return FAILURE;
+#else
+    return SUCCESS;
+#endif
+}
 
-        if( part_len ) {
+/**
+ * Close and remove the temporary file of the current part
+ */
+static void multipart_tmpfile_discard(struct php_can_multipart *mp)
+{
+    if (mp->fd != -1) {
+        close(mp->fd);
+        mp->fd = -1;
+    }
+    if (mp->tmp_name) {
+        VCWD_UNLINK(mp->tmp_name);
+        efree(mp->tmp_name);
+        mp->tmp_name = NULL;
+    }
+    mp->unnamed = 0;
+}
 
-            char *cd   = NULL,
-                 *pair = NULL,
-                 *text = estrndup(part, part_len);
+static void multipart_part_free(struct php_can_multipart *mp TSRMLS_DC)
+{
+    multipart_tmpfile_discard(mp);
+    mp->memory = 0;
+    mp->streaming = 0;
+    if (mp->type) {
+        efree(mp->type);
+        mp->type = NULL;
+    }
+    if (mp->param) {
+        efree(mp->param);
+        mp->param = NULL;
+    }
+    if (mp->filename) {
+        efree(mp->filename);
+        mp->filename = NULL;
+    }
+    smart_str_free(&mp->value);
+    mp->size = 0;
+}
 
-            if ( (cd = strstr(text, "Content-Disposition:")) != NULL) {
+/**
+ * Start a part from its headers, file parts go to a temporary file
+ * or are kept in memory if small files are
+ */
+static int multipart_part_begin(struct php_can_multipart *mp, const char *text, size_t len TSRMLS_DC)
+{
+    const char *line = text, *end = text + len, *eol, *value;
+    char *disposition = NULL, *cd, *pair;
+    size_t line_len;
+
+    // only the header values needed are copied out of the buffer
+    while (line < end) {
+        eol = memchr(line, '\n', end - line);
+        line_len = (eol ? eol : end) - line;
+        if (line_len > 0 && line[line_len - 1] == '\r') {
+            line_len--;
+        }
+        if (line_len > sizeof("Content-Disposition:") - 1
+                && !strncasecmp(line, "Content-Disposition:", sizeof("Content-Disposition:") - 1)) {
+            if (disposition == NULL) {
+                disposition = estrndup(line + sizeof("Content-Disposition:") - 1,
+                        line_len - (sizeof("Content-Disposition:") - 1));
+            }
+        } else if (line_len > sizeof("Content-Type:") - 1
+                && !strncasecmp(line, "Content-Type:", sizeof("Content-Type:") - 1) && mp->type == NULL) {
+            value = line + sizeof("Content-Type:") - 1;
+            while (value < line + line_len && isspace(*value)) ++value;
+            mp->type = estrndup(value, line + line_len - value);
+        }
+        line = eol ? eol + 1 : end;
+    }
 
-                char *param    = NULL,
-                     *value    = NULL,
-                     *filename = NULL;
+    if ((cd = disposition) != NULL) {
 
-                cd = strchr(text, ':');
-                cd++;
-                while (isspace(*cd)) ++cd;
+        while (isspace(*cd)) ++cd;
 
-                while (*cd && (pair = getword(&cd, ';'))) {
+        while (*cd && (pair = getword(&cd, ';'))) {
 
-                    char *key  = NULL,
-                         *word = pair;
+            char *key  = NULL,
+                 *word = pair;
 
-                    while (isspace(*cd)) ++cd;
+            while (isspace(*cd)) ++cd;
 
-                    if (strchr(pair, '=')) {
-                        key = getword(&pair, '=');
-                        if (!strcasecmp(key, "name")) {
-                            if (param) {
-                                efree(param);
-                            }
-                            param = getword_conf(&pair TSRMLS_CC);
-                        } else if (!strcasecmp(key, "filename")) {
-                            if (filename) {
-                                efree(filename);
-                            }
-                            filename = getword_conf(&pair TSRMLS_CC);
-                        }
+            if (strchr(pair, '=')) {
+                key = getword(&pair, '=');
+                if (!strcasecmp(key, "name")) {
+                    if (mp->param) {
+                        efree(mp->param);
                     }
-
-                    if (key) {
-                        efree(key);
+                    mp->param = getword_conf(&pair TSRMLS_CC);
+                } else if (!strcasecmp(key, "filename")) {
+                    if (mp->filename) {
+                        efree(mp->filename);
                     }
-                    efree(word);
+                    mp->filename = getword_conf(&pair TSRMLS_CC);
                 }
+            }
 
-                // If file_uploads=off, skip the file part
-                if (!PG(file_uploads)) {
-                    skip_upload = 1;
-                } else if (upload_cnt <= 0) {
-                    skip_upload = 1;
-                    php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                        "Maximum number of allowable file uploads has been exceeded");
-                }
+            if (key) {
+                efree(key);
+            }
+            efree(word);
+        }
+        efree(disposition);
+    }
 
-                if (skip_upload) {
-                    if (param) efree(param);
-                    if (filename) efree(filename);
-                    efree(text);
-                    continue;
-                }
+    // no name="" and no filename="" found
+    if (!mp->param && !mp->filename) {
+        php_error_docref(NULL TSRMLS_CC, E_WARNING,
+                            "File Upload Mime headers garbled");
+        return FAILURE;
+    }
 
-                // no name="" and no filename="" found
-                if (!param && !filename) {
-                    php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                                        "File Upload Mime headers garbled");
-                    efree(text);
-                    efree(boundary_val);
-                    return;
-                }
+    if (mp->filename) {
 
-                if (!filename && param) {
+        if (!mp->param) {
+            mp->param = emalloc(MAX_SIZE_ANONNAME);
+            snprintf(mp->param, MAX_SIZE_ANONNAME, "%u", mp->anonindex++);
+        }
 
-                    if ((value = strstr( text, "\r\n\r\n" )) != NULL) {
-                        value += 4; // skip CRLFs at the beginning
-                        int value_len = part_len - ( value - text ) - 2;
-                        add_assoc_stringl(post, param, value, value_len, 1);
-                    }
-                    efree(param);
-                    param = NULL;
-                }
+        // If file_uploads=off, skip the file part
+        if (!PG(file_uploads)) {
+            return SUCCESS;
+        } else if (mp->upload_cnt <= 0) {
+            php_error_docref(NULL TSRMLS_CC, E_WARNING,
+                "Maximum number of allowable file uploads has been exceeded");
+            return SUCCESS;
+        }
 
-                if (filename) {
+        // small files stay in memory unless they turn out to be larger
+        if (mp->handler) {
+            mp->streaming = 1;
+            mp->upload_cnt--;
+        } else if (mp->memory_size > 0) {
+            mp->memory = 1;
+            mp->upload_cnt--;
+        } else if (multipart_tmpfile_open(mp TSRMLS_CC) != -1) {
+            mp->upload_cnt--;
+        }
+    }
+    return SUCCESS;
+}
 
-                    char *s, *tmp=NULL;
-                    s = strrchr(filename, '\\');
-                    if ((tmp = strrchr(filename, '/')) > s) {
-                        s = tmp;
-                    }
+static const char *multipart_basename(const char *filename)
+{
+    const char *s, *tmp;
 
-                    if (!param) {
-                        is_anonymous = 1;
-                        param = emalloc(MAX_SIZE_ANONNAME);
-                        snprintf(param, MAX_SIZE_ANONNAME, "%u", anonindex++);
-                    } else {
-                        is_anonymous = 0;
-                    }
+    s = strrchr(filename, '\\');
+    if ((tmp = strrchr(filename, '/')) > s) {
+        s = tmp;
+    }
+    return s ? s + 1 : filename;
+}
+
+/**
+ * Add name, filename and type of the current file part to the array
+ */
+static void multipart_part_info(struct php_can_multipart *mp, zval *part)
+{
+    add_assoc_string(part, "name", mp->param, 1);
+    add_assoc_string(part, "filename", (char *)multipart_basename(mp->filename), 1);
+    add_assoc_string(part, "type", mp->type ? mp->type : "", 1);
+}
+
+/**
+ * Pass len bytes of the current file part to the upload callback as a
+ * string. Nothing more is read from the client meanwhile.
+ */
+static int multipart_part_stream(struct php_can_multipart *mp, size_t len, int last TSRMLS_DC)
+{
+    zval retval, *args[4];
+    char *data;
+
+    args[0] = mp->zrequest;
+    Z_ADDREF_P(args[0]);
+    MAKE_STD_ZVAL(args[1]);
+    array_init(args[1]);
+    multipart_part_info(mp, args[1]);
+    MAKE_STD_ZVAL(args[2]);
+    if (len > 0) {
+        data = emalloc(len + 1);
+        evbuffer_remove(mp->buf, data, len);
+        data[len] = '\0';
+        ZVAL_STRINGL(args[2], data, len, 0);
+    } else {
+        ZVAL_EMPTY_STRING(args[2]);
+    }
+    MAKE_STD_ZVAL(args[3]);
+    ZVAL_BOOL(args[3], last);
+    mp->size += len;
 
+    if (call_user_function(EG(function_table), NULL, mp->handler, &retval, 4, args TSRMLS_CC) == SUCCESS) {
+        zval_dtor(&retval);
+    }
+    Z_DELREF_P(args[0]);
+    zval_ptr_dtor(&args[1]);
+    zval_ptr_dtor(&args[2]);
+    zval_ptr_dtor(&args[3]);
+
+    return EG(exception) ? FAILURE : SUCCESS;
+}
 
-                    if ((value = strstr( text, "\r\n\r\n" )) != NULL) {
+/**
+ * Consume len bytes of the current part body, files are written out
+ * right away and skipped parts are dropped
+ */
+static int multipart_part_data(struct php_can_multipart *mp, size_t len TSRMLS_DC)
+{
+    size_t newlen;
+    int wlen;
+
+    if (mp->streaming) {
+        return len > 0 ? multipart_part_stream(mp, len, 0 TSRMLS_CC) : SUCCESS;
+    }
+
+    if (mp->memory && mp->value.len + len > mp->memory_size) {
+        // too large to be kept in memory after all
+        mp->memory = 0;
+        if (multipart_tmpfile_open(mp TSRMLS_CC) != -1) {
+            if (mp->value.len > 0 && write(mp->fd, mp->value.c, mp->value.len) != (ssize_t)mp->value.len) {
+                php_error_docref(NULL TSRMLS_CC, E_WARNING,
+                    "File upload error - unable to write to a temporary file");
+                multipart_tmpfile_discard(mp);
+            } else {
+                mp->size = mp->value.len;
+            }
+        }
+        smart_str_free(&mp->value);
+    }
 
-                        value += 4; // skip CRLFs at the beginning
-                        int value_len = part_len - ( value - text ) - 2;
+    if (mp->fd != -1) {
+        while (len > 0) {
+            wlen = evbuffer_write_atmost(mp->buf, mp->fd, len);
+            if (wlen <= 0) { // write failed
+                php_error_docref(NULL TSRMLS_CC, E_WARNING,
+                    "File upload error - unable to write to a temporary file");
+                multipart_tmpfile_discard(mp);
+                break;
+            }
+            len -= wlen;
+            mp->size += wlen;
+        }
+    } else if ((mp->memory || (mp->param && !mp->filename)) && len > 0) {
+        if (!mp->memory && mp->value.len + len > (size_t)PG(post_max_size)) {
+            php_error_docref(NULL TSRMLS_CC, E_WARNING,
+                "Field '%s' exceeds post_max_size of %ld bytes", mp->param, PG(post_max_size));
+            return FAILURE;
+        }
+        smart_str_alloc(&mp->value, len, 0);
+        evbuffer_remove(mp->buf, mp->value.c + mp->value.len, len);
+        mp->value.len += len;
+        return SUCCESS;
+    }
+    evbuffer_drain(mp->buf, len);
+    return SUCCESS;
+}
+
+/**
+ * Finish the current part and add it to the fields or files
+ */
+static int multipart_part_end(struct php_can_multipart *mp TSRMLS_DC)
+{
+    if (mp->streaming) {
+
+        zval *file;
+
+        if (multipart_part_stream(mp, 0, 1 TSRMLS_CC) == FAILURE) {
+            multipart_part_free(mp TSRMLS_CC);
+            return FAILURE;
+        }
+
+        // the file went to the handler, only its description is kept
+        MAKE_STD_ZVAL(file);
+        array_init(file);
+        multipart_part_info(mp, file);
+        add_assoc_long(file, "filesize", mp->size);
+        add_next_index_zval(mp->files, file);
+        multipart_part_free(mp TSRMLS_CC);
+        return SUCCESS;
+    }
+
+    if (mp->fd != -1 && mp->size > 0 && multipart_tmpfile_link(mp TSRMLS_CC) == FAILURE) {
+        php_error_docref(NULL TSRMLS_CC, E_WARNING,
+            "File upload error - unable to create a temporary file");
+        mp->size = 0;
+    }
+
+    if ((mp->fd != -1 && mp->size > 0) || (mp->memory && mp->value.len > 0)) {
+
+        zval *file;
+
+        MAKE_STD_ZVAL(file);
+        if (mp->memory) {
+            // no file to remove, the content must not be taken for one
+            array_init(file);
+        } else {
+            ALLOC_HASHTABLE(Z_ARRVAL_P(file));
+            zend_hash_init(Z_ARRVAL_P(file), 4, NULL, (dtor_func_t)  unlink_filename, 0);
+            Z_TYPE_P(file) = IS_ARRAY;
+        }
+
+        multipart_part_info(mp, file);
+        if (mp->memory) {
+            add_assoc_long(  file, "filesize", mp->value.len);
+            add_assoc_stringl(file, "content", mp->value.c, mp->value.len, 1);
+        } else {
+            add_assoc_long(  file, "filesize", mp->size);
+            add_assoc_string(file, "tmp_name", mp->tmp_name, 1);
+            // the file belongs to the request now
+            close(mp->fd);
+            mp->fd = -1;
+            efree(mp->tmp_name);
+            mp->tmp_name = NULL;
+        }
 
-                        if (value_len > 0) {
+        add_next_index_zval(mp->files, file);
 
-                            fd = php_open_temporary_fd_ex(PG(upload_tmp_dir), "phpcan", &temp_filename, 1 TSRMLS_CC);
-                            if (fd == -1) { // create temporary file failed
-                                php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                                    "File upload error - unable to create a temporary file");
-                            } else {
+    } else if (mp->param && !mp->filename) {
+        // NUL bytes are dropped from fields like from any other input
+        char *value = emalloc(mp->value.len + 1);
+        size_t i, len = 0;
 
-                                size_t wlen = write(fd, value, value_len);
-                                if (wlen == -1) { // write failed
-                                    php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                                        "File upload error - unable to write to a temporary file");
-                                } else {
+        for (i = 0; i < mp->value.len; i++) {
+            if (mp->value.c[i] != '\0') {
+                value[len++] = mp->value.c[i];
+            }
+        }
+        value[len] = '\0';
+        add_assoc_stringl(mp->post, mp->param, value, len, 0);
+    }
+    multipart_part_free(mp TSRMLS_CC);
+    return SUCCESS;
+}
 
-                                    zval *file;
-                                    MAKE_STD_ZVAL(file);
-                                    ALLOC_HASHTABLE(Z_ARRVAL_P(file));
-                                    zend_hash_init(Z_ARRVAL_P(file), 4, NULL, (dtor_func_t)  unlink_filename, 0);
-                                    Z_TYPE_P(file) = IS_ARRAY;
+/**
+ * Parse as much of the received data as possible, what remains is at
+ * most a partial delimiter or the headers of a part
+ */
+static void multipart_parse(struct php_can_multipart *mp TSRMLS_DC)
+{
+    struct evbuffer_ptr found;
+    size_t len, eol_len, skip[256];
+    ev_ssize_t pos;
+    char crlf[2];
 
-                                    add_assoc_string(file, "name", param, 1);
-                                    if (s && s > filename) {
-                                        add_assoc_string(file, "filename", s+1, 1);
-                                    } else {
-                                        add_assoc_string(file, "filename", filename, 1);
-                                    }
-                                    add_assoc_long(  file, "filesize", wlen);
-                                    add_assoc_string(file, "tmp_name", temp_filename, 1);
+    for (;;) {
 
-                                    add_next_index_zval(*files, file);
+        len = evbuffer_get_length(mp->buf);
 
-                                }
+        switch (mp->state) {
 
-                                efree(temp_filename);
-                                close(fd);
-                            }
-                        }
+            case MULTIPART_PREAMBLE:
+                // the first boundary may open the body without a CRLF
+                multipart_skip_table(mp->delim + 2, mp->delim_len - 2, skip);
+                pos = multipart_search(mp->buf, mp->delim + 2, mp->delim_len - 2, skip, 0);
+                if (pos == -1) {
+                    if (len > mp->delim_len) {
+                        evbuffer_drain(mp->buf, len - mp->delim_len);
                     }
+                    return;
+                }
+                evbuffer_drain(mp->buf, pos + mp->delim_len - 2);
+                mp->state = MULTIPART_BOUNDARY;
+                break;
 
-                    efree(filename);
-                    filename = NULL;
+            case MULTIPART_BOUNDARY:
+                // "--" closes the body, anything else up to the CRLF is padding
+                if (len < 2) {
+                    return;
+                }
+                evbuffer_copyout(mp->buf, crlf, 2);
+                if (crlf[0] == '-' && crlf[1] == '-') {
+                    mp->state = MULTIPART_DONE;
+                    break;
+                }
+                found = evbuffer_search_eol(mp->buf, NULL, &eol_len, EVBUFFER_EOL_CRLF_STRICT);
+                if (found.pos == -1) {
+                    if (len > PHP_CAN_MULTIPART_MAX_HEADERS) {
+                        mp->state = MULTIPART_ERROR;
+                        break;
+                    }
+                    return;
+                }
+                evbuffer_drain(mp->buf, found.pos + eol_len);
+                mp->state = MULTIPART_HEADERS;
+                mp->scanned = 0;
+                break;
 
-                    efree(param);
-                    param = NULL;
+            case MULTIPART_HEADERS:
+                if (len < 2) {
+                    return;
+                }
+                // a part without headers starts with the empty line
+                evbuffer_copyout(mp->buf, crlf, 2);
+                if (crlf[0] == '\r' && crlf[1] == '\n') {
+                    pos = 0;
+                    eol_len = 2;
+                } else {
+                    pos = multipart_search(mp->buf, "\r\n\r\n", 4, mp->headers_skip, mp->scanned);
+                    eol_len = 4;
                 }
+                if (pos == -1) {
+                    if (len > PHP_CAN_MULTIPART_MAX_HEADERS) {
+                        php_error_docref(NULL TSRMLS_CC, E_WARNING,
+                            "Multipart part headers exceed %d bytes", PHP_CAN_MULTIPART_MAX_HEADERS);
+                        mp->state = MULTIPART_ERROR;
+                        break;
+                    }
+                    // resume where the empty line may start
+                    mp->scanned = len > 3 ? len - 3 : 0;
+                    return;
+                }
+                // the headers are parsed where they are, made contiguous if split
+                mp->state = multipart_part_begin(mp, pos ? (const char *)evbuffer_pullup(mp->buf, pos) : "",
+                        pos TSRMLS_CC) == SUCCESS ? MULTIPART_BODY : MULTIPART_ERROR;
+                evbuffer_drain(mp->buf, pos + eol_len);
+                break;
+
+            case MULTIPART_BODY:
+                pos = multipart_search(mp->buf, mp->delim, mp->delim_len, mp->delim_skip, 0);
+                if (pos == -1) {
+                    // keep what may be the start of the delimiter
+                    if (len >= mp->delim_len
+                            && multipart_part_data(mp, len - mp->delim_len + 1 TSRMLS_CC) == FAILURE) {
+                        mp->state = MULTIPART_ERROR;
+                        break;
+                    }
+                    return;
+                }
+                if (multipart_part_data(mp, pos TSRMLS_CC) == FAILURE) {
+                    mp->state = MULTIPART_ERROR;
+                    break;
+                }
+                evbuffer_drain(mp->buf, mp->delim_len);
+                mp->state = multipart_part_end(mp TSRMLS_CC) == SUCCESS ? MULTIPART_BOUNDARY : MULTIPART_ERROR;
+                break;
+
+            default:
+                // epilogue or garbage after an error
+                multipart_part_free(mp TSRMLS_CC);
+                evbuffer_drain(mp->buf, len);
+                return;
+        }
+    }
+}
 
-            }
-            efree(text);
+/**
+ * Take over the data of the buffer and parse it, the buffer is left empty
+ */
+void php_can_multipart_feed(struct php_can_multipart *mp, struct evbuffer *data TSRMLS_DC)
+{
+    evbuffer_add_buffer(mp->buf, data);
+    multipart_parse(mp TSRMLS_CC);
+}
+
+/**
+ * Hand file parts to the callback as they arrive instead of writing
+ * them to temporary files, the callback gets the request too
+ */
+void php_can_multipart_set_handler(struct php_can_multipart *mp, zval *handler, zval *zrequest)
+{
+    Z_ADDREF_P(handler);
+    mp->handler = handler;
+    Z_ADDREF_P(zrequest);
+    mp->zrequest = zrequest;
+}
+
+/**
+ * Free the parser, a part not finished by its delimiter is discarded
+ */
+void php_can_multipart_free(struct php_can_multipart *mp TSRMLS_DC)
+{
+    multipart_part_free(mp TSRMLS_CC);
+    evbuffer_free(mp->buf);
+    efree(mp->delim);
+    zval_ptr_dtor(&mp->post);
+    zval_ptr_dtor(&mp->files);
+    if (mp->handler) {
+        zval_ptr_dtor(&mp->handler);
+        zval_ptr_dtor(&mp->zrequest);
+    }
+    efree(mp);
+}
+
+/**
+ * Parse a complete multipart body, the buffer is referenced rather
+ * than copied and stays as it is
+ */
+void  php_can_parse_multipart(const char* content_type, struct evbuffer* buffer, zval* post, zval** files,
+        size_t memory_size, zval *handler, zval *zrequest TSRMLS_DC)
+{
+    struct php_can_multipart *mp;
+
+    MAKE_STD_ZVAL(*files);
+    array_init(*files);
+
+    mp = php_can_multipart_new(content_type, post, *files, memory_size TSRMLS_CC);
+    if (mp != NULL) {
+        if (handler != NULL) {
+            php_can_multipart_set_handler(mp, handler, zrequest);
         }
+        evbuffer_add_buffer_reference(mp->buf, buffer);
+        multipart_parse(mp TSRMLS_CC);
+        php_can_multipart_free(mp TSRMLS_CC);
     }
-    efree(boundary_val);
 }
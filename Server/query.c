@@ -0,0 +1,217 @@
+/*
+  +----------------------------------------------------------------------+
+  | PHP Version 5.3                                                      |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2002-2011 Dmitri Vinogradov                            |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Authors: Dmitri Vinogradov <dmitri.vinogradov@gmail.com>             |
+  +----------------------------------------------------------------------+
+*/
+
+#include "php.h"
+#include "php_variables.h"
+#include "php_can.h"
+#include <stdint.h>
+
+/* decoded names up to this length do not need a heap buffer */
+#define NAME_BUF_SIZE 256
+
+/* SWAR helpers, test eight bytes at once for a given byte value */
+#define SWAR_ONES  0x0101010101010101ULL
+#define SWAR_HIGHS 0x8080808080808080ULL
+#define SWAR_HASZERO(v)    (((v) - SWAR_ONES) & ~(v) & SWAR_HIGHS)
+#define SWAR_HASBYTE(v, c) SWAR_HASZERO((v) ^ (SWAR_ONES * (unsigned char)(c)))
+
+static inline int hexval(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/**
+ * Percent-decode len bytes of src into dst, '+' becomes a space and
+ * NUL bytes are dropped. Runs without any of those are copied eight
+ * bytes at a time. Returns the decoded length, never more than len.
+ */
+static size_t decode(char *dst, const char *src, size_t len)
+{
+    const char *end = src + len;
+    char *out = dst;
+    int hi, lo;
+
+    while (src < end) {
+        while (end - src >= 8) {
+            uint64_t v;
+            memcpy(&v, src, 8);
+            if (SWAR_HASBYTE(v, '%') | SWAR_HASBYTE(v, '+') | SWAR_HASZERO(v)) {
+                break;
+            }
+            memcpy(out, src, 8);
+            out += 8;
+            src += 8;
+        }
+        if (src >= end) {
+            break;
+        }
+        switch (*src) {
+            case '%':
+                if (end - src > 2 && (hi = hexval(src[1])) >= 0 && (lo = hexval(src[2])) >= 0) {
+                    if ((hi | lo) != 0) {
+                        *out++ = (char)((hi << 4) | lo);
+                    }
+                    src += 3;
+                } else {
+                    *out++ = *src++;
+                }
+                break;
+            case '+':
+                *out++ = ' ';
+                src++;
+                break;
+            case '\0':
+                src++;
+                break;
+            default:
+                *out++ = *src++;
+                break;
+        }
+    }
+    *out = '\0';
+    return out - dst;
+}
+
+/**
+ * Names PHP would not rewrite, no array syntax and nothing mangled
+ */
+static inline int plain_name(const char *name, size_t len)
+{
+    if (name[0] == ' ') {
+        return 0;
+    }
+    while (len--) {
+        char c = *name++;
+        if (c == '[' || c == '.' || c == ' ') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static inline const char *find_separator(const char *p, const char *end, const char *separators, int count)
+{
+    if (count == 1) {
+        const char *found = memchr(p, separators[0], end - p);
+        return found ? found : end;
+    }
+    for (; p < end; p++) {
+        if (memchr(separators, *p, count)) {
+            return p;
+        }
+    }
+    return end;
+}
+
+/**
+ * Split, decode and register variables of a query string, urlencoded
+ * form or cookie header in a single pass, arg is PARSE_GET, PARSE_POST
+ * or PARSE_COOKIE. Values are decoded straight into the strings stored
+ * in the target array, after the SAPI input filter had its say. Plain
+ * names are added directly, names with array syntax are registered the
+ * way PHP does it for GET and POST. Cookies keep their names as is, and
+ * like the PHP GPC handling at most max_input_vars variables are accepted.
+ */
+void php_can_parse_query(const char *data, size_t len, int arg, zval *target TSRMLS_DC)
+{
+    int cookie = arg == PARSE_COOKIE;
+    const char *p = data, *end = data + len, *separators;
+    char name_buf[NAME_BUF_SIZE];
+    long max_vars = INI_INT("max_input_vars"), count = 0;
+    int separators_len;
+
+    if (cookie) {
+        separators = ";";
+    } else {
+        separators = PG(arg_separator).input;
+        if (separators == NULL || *separators == '\0') {
+            separators = "&";
+        }
+    }
+    separators_len = strlen(separators);
+    if (max_vars <= 0) {
+        max_vars = 1000;
+    }
+
+    while (p < end) {
+        const char *segment_end = find_separator(p, end, separators, separators_len);
+        const char *eq, *value;
+        size_t name_len;
+        unsigned int value_len;
+        char *name, *decoded;
+
+        if (cookie) {
+            // multi cookie headers separate pairs with "; "
+            while (p < segment_end && isspace((unsigned char)*p)) {
+                p++;
+            }
+        }
+        if (p == segment_end) {
+            p = segment_end + 1;
+            continue;
+        }
+
+        eq = memchr(p, '=', segment_end - p);
+        if (eq == p) {
+            p = segment_end + 1;
+            continue;
+        }
+        if (eq == NULL) {
+            eq = segment_end;
+            value = segment_end;
+        } else {
+            value = eq + 1;
+        }
+
+        if (++count > max_vars) {
+            php_error_docref(NULL TSRMLS_CC, E_WARNING,
+                "Input variables exceeded %ld. To increase the limit change max_input_vars in php.ini.",
+                max_vars);
+            break;
+        }
+
+        name = (eq - p) < NAME_BUF_SIZE ? name_buf : emalloc(eq - p + 1);
+        name_len = decode(name, p, eq - p);
+
+        decoded = emalloc(segment_end - value + 1);
+        value_len = decode(decoded, value, segment_end - value);
+
+        // filtered as a plain string like php_default_treat_data does for
+        // PARSE_STRING, ext/filter would keep a copy of GET, POST and COOKIE
+        // variables for the whole lifetime of the server else
+        if (name_len == 0 || !sapi_module.input_filter(PARSE_STRING, name, &decoded, value_len, &value_len TSRMLS_CC)) {
+            efree(decoded);
+        } else if (cookie || plain_name(name, name_len)) {
+            zval *zvalue;
+            MAKE_STD_ZVAL(zvalue);
+            ZVAL_STRINGL(zvalue, decoded, value_len, 0);
+            zend_symtable_update(Z_ARRVAL_P(target), name, name_len + 1, &zvalue, sizeof(zval *), NULL);
+        } else {
+            php_register_variable_safe(name, decoded, value_len, target TSRMLS_CC);
+            efree(decoded);
+        }
+
+        if (name != name_buf) {
+            efree(name);
+        }
+        p = segment_end + 1;
+    }
+}
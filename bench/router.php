@@ -0,0 +1,70 @@
+<?php
+/**
+ * Routing microbenchmark
+ *
+ * Measures Router::match() throughput for routers with 10, 100 and 1000
+ * routes of each pattern kind. Paths are picked uniformly over all routes
+ * of the router, so dynamic lookups hit early and late routes alike.
+ *
+ * Usage: php -d extension=can.so bench/router.php [seconds per case]
+ */
+
+use Can\Server\Route;
+use Can\Server\Router;
+
+if (!extension_loaded('can')) {
+    fwrite(STDERR, "can extension is not loaded\n");
+    exit(1);
+}
+
+$duration = isset($argv[1]) ? (float)$argv[1] : 1.0;
+$handler  = function ($request) {};
+
+$kinds = array(
+    'static' => function ($i) {
+        return array("/static/$i/resource", "/static/$i/resource");
+    },
+    'typed'  => function ($i) {
+        return array("/typed/$i/<id:int>/<name>", "/typed/$i/" . mt_rand(1, 99999) . "/name");
+    },
+    're'     => function ($i) {
+        return array("/re/$i/<slug:re:[a-z]+-[0-9]+>", "/re/$i/slug-" . mt_rand(1, 99999));
+    },
+);
+
+printf("%-8s %6s %14s %10s\n", 'kind', 'routes', 'matches/sec', 'usec/match');
+
+foreach ($kinds as $kind => $make) {
+    foreach (array(10, 100, 1000) as $count) {
+        $routes = array();
+        $paths  = array();
+        for ($i = 0; $i < $count; $i++) {
+            list($uri, $path) = $make($i);
+            $routes[] = new Route($uri, $handler);
+            $paths[]  = $path;
+        }
+        $router = new Router($routes);
+
+        // sanity check, every path must resolve
+        foreach ($paths as $path) {
+            $match = $router->match('GET', $path);
+            if ($match['status'] != 200) {
+                fwrite(STDERR, "no route for $path\n");
+                exit(1);
+            }
+        }
+
+        $n     = 0;
+        $last  = count($paths) - 1;
+        $start = microtime(true);
+        do {
+            for ($i = 0; $i < 1000; $i++) {
+                $router->match('GET', $paths[mt_rand(0, $last)]);
+            }
+            $n += 1000;
+            $elapsed = microtime(true) - $start;
+        } while ($elapsed < $duration);
+
+        printf("%-8s %6d %14.0f %10.2f\n", $kind, $count, $n / $elapsed, $elapsed / $n * 1000000);
+    }
+}
@@ -50,6 +50,22 @@ if test "$PHP_CAN" != "no"; then
     -L$LIBEVENT_DIR/$PHP_LIBDIR
   ])
 
+  dnl zlib compresses responses
+  PHP_CHECK_LIBRARY(z,deflateInit2_,
+  [
+    PHP_ADD_LIBRARY(z, 1, CAN_SHARED_LIBADD)
+  ],[
+    AC_MSG_ERROR([zlib not found])
+  ])
+
+  dnl libevent 2.2+ lets request bodies be streamed to route body handlers
+  PHP_CHECK_LIBRARY($LIBNAME,evhttp_set_newreqcb,
+  [
+    AC_DEFINE(HAVE_EVHTTP_SET_NEWREQCB, 1, [Whether libevent has evhttp_set_newreqcb])
+  ],[],[
+    -L$LIBEVENT_DIR/$PHP_LIBDIR
+  ])
+
   PHP_ADD_EXTENSION_DEP(can, sockets, true)
   PHP_SUBST(CAN_SHARED_LIBADD)
   PHP_NEW_EXTENSION(can, \
@@ -60,6 +76,16 @@ if test "$PHP_CAN" != "no"; then
     Server/Route.c \
     Server/WebSocketRoute.c \
     Server/Request.c \
+    Server/Middleware.c \
+    Server/RateLimit.c \
+    Server/Cors.c \
+    Server/headers.c \
+    Server/query.c \
+    Server/json.c \
+    Server/msgpack.c \
     Server/multipart.c \
+    Server/access.c \
+    Server/compress.c \
+    Server/files.c \
     , $ext_shared)
 fi
@@ -0,0 +1,52 @@
+--TEST--
+\Can\Server\Cors class tests
+--SKIPIF--
+<?php if(!extension_loaded("can")) print "skip"; ?>
+--FILE--
+<?php
+use Can\Server\Cors;
+use Can\Server\Route;
+use Can\Server\Router;
+try { $cors = new Cors('foo'); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
+try { $cors = new Cors(array('origins' => 'foo')); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
+try { $cors = new Cors(array('origins' => array(1))); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
+try { $cors = new Cors(array('methods' => 'GET')); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
+try { $cors = new Cors(array('headers' => 'X-Foo')); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
+try { $cors = new Cors(array('expose' => '*')); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
+try { $cors = new Cors(array('max_age' => -1)); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
+try { $cors = new Cors(array('credentials' => true)); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
+try { $cors = new Cors(array('origins' => '*', 'credentials' => true)); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
+var_dump(new Cors() instanceof Cors);
+$cors = new Cors(array(
+    'origins'     => array('https://example.com', 'https://app.example.com'),
+    'methods'     => Route::METHOD_GET | Route::METHOD_PUT | Route::METHOD_DELETE,
+    'headers'     => array('Content-Type', 'X-Requested-With'),
+    'expose'      => array('X-Request-Id'),
+    'max_age'     => 600,
+    'credentials' => true,
+));
+var_dump($cors instanceof Cors);
+$route = new Route('/', function ($request) {});
+try { $route->setCors('foo'); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
+$route->setCors($cors);
+$router = new Router(array($route));
+try { $router->setCors(false); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
+$router->setCors(new Cors(array('origins' => '*', 'headers' => '*')));
+$router->commit();
+echo "Done\n";
+?>
+--EXPECT--
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+Done
@@ -0,0 +1,67 @@
+--TEST--
+\Can\Server\Middleware class tests
+--SKIPIF--
+<?php if(!extension_loaded("can")) print "skip"; ?>
+--FILE--
+<?php
+use Can\Server\Middleware;
+use Can\Server\Router;
+try { $middleware = new Middleware(); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
+try { $middleware = new Middleware('foo'); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidCallbackException); }
+try { $middleware = new Middleware\Headers('foo'); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
+try { $middleware = new Middleware\Headers(array('foo')); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
+try { $middleware = new Middleware\RequestId(''); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
+try { $middleware = new Middleware\BasicAuth(array('admin')); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
+$router = new Router();
+try { $router->addMiddleware(); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
+try { $router->addMiddleware('foo'); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidCallbackException); }
+try { $router->addMiddleware(new Middleware\RequestId(), function () {}); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
+$headers = new Middleware\Headers(array('X-Frame-Options' => 'DENY'));
+var_dump($headers instanceof Middleware);
+var_dump(new Middleware\RequestId() instanceof Middleware);
+var_dump(new Middleware\BasicAuth(array('admin' => 'secret'), 'Admin area') instanceof Middleware);
+$router->addMiddleware($headers);
+$router->addMiddleware(function ($request, $params) {}, function ($request) {});
+$router->commit();
+function auth_status($authorization, $uri = 'test')
+{
+    $fp = stream_socket_client("tcp://127.0.0.1:45679", $errno, $errstr, 30);
+    fwrite($fp, "GET /$uri HTTP/1.0\r\n" . ($authorization ? "Authorization: $authorization\r\n" : "") . "\r\n");
+    $status = fgets($fp);
+    fclose($fp);
+    return (int)substr($status, 9, 3);
+}
+$code = '$s=new Can\Server("127.0.0.1", 45679);' .
+        '$r=new Can\Server\Router(array(new Can\Server\Route("/<uri>", function($r, $a) {' .
+        'global $s; if ($a["uri"] === "quit") $s->stop(); return "ok";})));' .
+        '$r->addMiddleware(new Can\Server\Middleware\BasicAuth(array("admin" => "secret")));' .
+        '$s->start($r);';
+exec($_SERVER['_'] . " -r '" . $code . "' >/dev/null &");
+sleep(1);
+var_dump(auth_status(null) === 401);
+var_dump(auth_status("basic " . base64_encode("admin:secret")) === 200);
+var_dump(auth_status("Basic  " . base64_encode("admin:secret")) === 200);
+var_dump(auth_status("Basic " . base64_encode("admin:secreT")) === 401);
+var_dump(auth_status("Bearer " . base64_encode("admin:secret")) === 401);
+auth_status("Basic " . base64_encode("admin:secret"), 'quit');
+echo "Done\n";
+?>
+--EXPECT--
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+Done
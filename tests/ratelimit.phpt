@@ -0,0 +1,70 @@
+--TEST--
+\Can\Server\RateLimit class tests
+--SKIPIF--
+<?php if(!extension_loaded("can")) print "skip"; ?>
+--FILE--
+<?php
+use Can\Server\RateLimit;
+use Can\Server\Route;
+use Can\Server\Router;
+try { $limit = new RateLimit(); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
+try { $limit = new RateLimit(0, 10); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
+try { $limit = new RateLimit(10, 0); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
+try { $limit = new RateLimit(10, 20, 'X-Forwarded-For', 0); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
+try { $limit = new RateLimit(10, 20, null, (1 << 24) + 1); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
+$limit = new RateLimit(0.5, 10);
+var_dump($limit instanceof RateLimit);
+$limit = new RateLimit(100, 200, 'X-Api-Key', 1024);
+var_dump($limit instanceof RateLimit);
+$route = new Route('/', function ($request) {});
+try { $route->setRateLimit('foo'); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
+$route->setRateLimit($limit);
+$route->setRateLimit(null);
+$router = new Router(array($route));
+try { $router->setRateLimit(new Route('/')); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
+$router->setRateLimit($limit);
+$router->commit();
+function limited_status($request)
+{
+    $fp = stream_socket_client("tcp://127.0.0.1:45681", $errno, $errstr, 30);
+    fwrite($fp, $request . "\r\n");
+    $status = fgets($fp);
+    fclose($fp);
+    return (int)substr($status, 9, 3);
+}
+// the router limit throttles requests without a route and preflights too
+$code = '$s=new Can\Server("127.0.0.1", 45681);' .
+        '$r=new Can\Server\Router(array(new Can\Server\Route("/test/<uri>", function($r, $a) {' .
+        'global $s; if ($a["uri"] === "quit") $s->stop(); return "ok";})));' .
+        '$r->setRateLimit(new Can\Server\RateLimit(0.01, 3, "X-Client"));' .
+        '$s->start($r);';
+exec($_SERVER['_'] . " -r '" . $code . "' >/dev/null &");
+sleep(1);
+var_dump(limited_status("GET /nope HTTP/1.0\r\nX-Client: a\r\n") === 404);
+var_dump(limited_status("POST /test/x HTTP/1.0\r\nX-Client: a\r\nContent-Length: 0\r\n") === 405);
+var_dump(limited_status("OPTIONS /test/x HTTP/1.0\r\nX-Client: a\r\nOrigin: http://example.com\r\n"
+    . "Access-Control-Request-Method: GET\r\n") === 405);
+var_dump(limited_status("GET /nope HTTP/1.0\r\nX-Client: a\r\n") === 429);
+var_dump(limited_status("OPTIONS /test/x HTTP/1.0\r\nX-Client: a\r\nOrigin: http://example.com\r\n"
+    . "Access-Control-Request-Method: GET\r\n") === 429);
+var_dump(limited_status("GET /test/x HTTP/1.0\r\nX-Client: b\r\n") === 200);
+limited_status("GET /test/quit HTTP/1.0\r\n");
+echo "Done\n";
+?>
+--EXPECT--
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+Done
@@ -4,7 +4,7 @@
 <?php if(!extension_loaded("can")) print "skip"; ?>
 --FILE--
 <?php
-function test($code, $expected, $meth = 'GET', $rHdrs = null, $headers = '')
+function test($code, $expected, $meth = 'GET', $rHdrs = null, $headers = '', $content = 'foobar')
 {
     $str = '$s=new Can\Server("127.0.0.1", 45678);' . 
            '$s->start(new Can\Server\Router(array(' . 
@@ -24,14 +24,16 @@ function test($code, $expected, $meth = 'GET', $rHdrs = null, $headers = '')
     if (!$fp) {
         echo "$errstr ($errno)\n";
     } else {
-        $headers .= "Content-Type: text/plain\r\n";
-        $content = '';
+        if (stripos($headers, 'Content-Type:') === false) {
+            $headers .= "Content-Type: text/plain\r\n";
+        }
         switch($meth) {
             case 'POST':
             case 'PUT':
-                $content = "foobar";
                 $headers .= "Content-Length: " . strlen($content) . "\r\n";
                 break;
+            default:
+                $content = '';
         }
         fwrite($fp, $meth . " /test HTTP/1.0\r\n$headers\r\n" . $content);
         $r = '';
@@ -87,6 +89,62 @@ function test($code, $expected, $meth = 'GET', $rHdrs = null, $headers = '')
         
     }
 }
+/**
+ * Start a server with $setup run on $s and $route before it starts,
+ * $handler answers the request. Returns the raw response, or the raw
+ * responses of an array of requests sent one after the other.
+ */
+function serve($setup, $request, $port = 45678, $options = '')
+{
+    $str = '$s=new Can\Server("127.0.0.1", %d);' .
+           '$handler=function($r){};' .
+           '$route=new Can\Server\Route("/<uri>", function($r, $a) {' .
+           'global $s, $handler; if (strpos($a["uri"],"quit")===0) {$s->stop(); return;} ' .
+           'try {return $handler($r);} catch(\Exception $e){return get_class($e).":".$e->getMessage();}}' .
+           ',Can\Server\Route::METHOD_ALL);' .
+           '%s;' .
+           '$s->start(new Can\Server\Router(array($route)));';
+    exec("timeout 5 " . $_SERVER['_'] . " $options -r '" . sprintf($str, $port, $setup) . "' >/dev/null &");
+    sleep(1);
+
+    $responses = array();
+    foreach ((array)$request as $raw) {
+        $response = '';
+        if ($fp = stream_socket_client("tcp://127.0.0.1:$port", $errno, $errstr, 30)) {
+            fwrite($fp, $raw);
+            $response = stream_get_contents($fp);
+            fclose($fp);
+        }
+        $responses[] = $response;
+    }
+    if ($fp = @stream_socket_client("tcp://127.0.0.1:$port", $errno, $errstr, 30)) {
+        fwrite($fp, "GET /quit HTTP/1.0\r\n\r\n");
+        stream_get_contents($fp);
+        fclose($fp);
+    }
+    return is_array($request) ? $responses : $responses[0];
+}
+function status($response)
+{
+    return (int)substr($response, 9, 3);
+}
+function body($response)
+{
+    return (string)substr($response, strpos($response, "\r\n\r\n") + 4);
+}
+function response_header($response, $name)
+{
+    $head = substr($response, 0, strpos($response, "\r\n\r\n"));
+    foreach (explode("\r\n", $head) as $line) {
+        if (strpos($line, ':') !== false) {
+            list($key, $value) = explode(':', $line, 2);
+            if (strcasecmp(trim($key), $name) == 0) {
+                return trim($value);
+            }
+        }
+    }
+    return null;
+}
 /**/
 test('$r->responseCode = 500;', "Can\InvalidOperationException:Cannot update readonly property Can\Server\Request::\$responseCode");
 test('return $r->findRequestHeader(false);', "Can\InvalidParametersException:Can\Server\Request::findRequestHeader(string \$header)");
@@ -96,6 +154,18 @@ test('return var_export($r->findRequestHeader("nada"),1);', "false");
 test('return var_export($r->findRequestHeader("nada"),1);', "false");
 test('return var_export($r->getRequestBody(),1);', "false");
 test('return var_export($r->getRequestBody(),1);', '\'foobar\'', 'PUT');
+test('return $r->getJson(array());', 'Can\\InvalidParametersException:Can\\Server\\Request::getJson([bool $assoc = true[, int $depth = 512[, int $max_size]]])');
+test('return var_export($r->getJson(),1);', 'NULL');
+test('return $r->getJson();', 'Can\\HTTPError:Malformed JSON request body', 'PUT');
+test('return $r->getJson(true, 512, 3);', 'Can\\HTTPError:JSON request body exceeds 3 bytes', 'PUT');
+test('return $r->json["a"];', "x", 'PUT', null, '', '{"a":"x","b":[1,2]}');
+test('$j = $r->getJson(); return count($r->json["b"]) . ":" . $j["a"];', "2:x", 'PUT', null, '', '{"a":"x","b":[1,2]}');
+test('$o = $r->getJson(false); return get_class($o) . ":" . $o->a . ":" . get_class($o->c);', "stdClass:x:stdClass", 'PUT', null, '',
+    '{"a":"x","c":{}}');
+test('$a = $r->getJson(); $a["a"] = "changed"; $o = $r->getJson(false); $b = $r->getJson(); return $b["a"] . $o->a;', "xx", 'PUT', null, '',
+    '{"a":"x"}');
+test('return $r->getJson(true, 1);', 'Can\\HTTPError:Malformed JSON request body', 'PUT', null, '', '{"a":{"b":"y"}}');
+test('$j = $r->getJson(true, 3); return $j["a"]["b"];', "y", 'PUT', null, '', '{"a":{"b":"y"}}');
 test('return $r->addResponseHeader();', 'Can\\InvalidParametersException:Can\\Server\\Request::addResponseHeader(string $header, string $value)');
 test('return $r->addResponseHeader(false);', 'Can\\InvalidParametersException:Can\\Server\\Request::addResponseHeader(string $header, string $value)');
 test('return $r->addResponseHeader(null, false);', 'Can\\InvalidParametersException:Can\\Server\\Request::addResponseHeader(string $header, string $value)');
@@ -176,11 +246,165 @@ if (PHP_MINOR_VERSION < 4) {
 } else {
     test('class a implements JsonSerializable {public function jsonSerialize() {return array(1,2,3,4);}} return new a;', "[1,2,3,4]");
 }
+test('$r->addResponseHeader("Content-Type", "application/json"); return array(1, "a/b", array("x" => true, "y" => null), 1.5);', '[1,"a\\/b",{"x":true,"y":null},1.5]');
+test('$r->addResponseHeader("Content-Type", "application/json"); return range(1, 20000);', '[' . implode(',', range(1, 20000)) . ']');
+test('$r->addResponseHeader("Content-Type", "application/json"); return array(fopen("php://memory", "r"));', "");
+test('return array(1, "foo" => "bar");', "\x82\x00\x01\xa3foo\xa3bar", 'GET', array('Content-Type' => 'application/msgpack', 'Vary' => 'Accept'), "Accept: text/html, application/msgpack\r\n");
+if (PHP_MINOR_VERSION < 4) {
+    test('return array(1,2);', "", 'GET', array('Vary' => 'Accept'), "Accept: application/json\r\n");
+} else {
+    test('class a implements JsonSerializable {public function jsonSerialize() {return array(1,2);}} return new a;', "[1,2]", 'GET',
+        array('Content-Type' => 'application/json', 'Vary' => 'Accept'), "Accept: application/json\r\n");
+}
+test('return array(1, "foo" => "bar");', "", 'GET', null, "Accept: application/msgpack;q=0\r\n");
+test('return var_export($r->msgpack, 1);', 'Can\\HTTPError:Malformed MessagePack request body', 'PUT');
+test('$m = $r->msgpack; return $m["a"][0] . ":" . $m["a"][1] . ":" . strlen($m["s"]) . ":" . $m["f"] . ":" . gettype($m["f"]);',
+    "1:-5:40:1.5:double", 'PUT', null, "Content-Type: application/msgpack\r\n",
+    "\x83\xa1a\x92\x01\xfb\xa1s\xd9\x28" . str_repeat("x", 40) . "\xa1f\xcb\x3f\xf8\x00\x00\x00\x00\x00\x00");
+test('return array(1, "foo" => "bar");', "\x82\x00\x01\xa3foo\xa3bar", 'GET',
+    array('Content-Type' => 'application/msgpack', 'Vary' => 'Accept'), "Accept: application/x-msgpack\r\n");
+test('$r->addResponseHeader("Content-Type", "application/msgpack"); return array("a" => -1, "b" => 1.5);',
+    "\x82\xa1a\xff\xa1b\xcb\x3f\xf8\x00\x00\x00\x00\x00\x00", 'GET', array('Content-Type' => 'application/msgpack'));
+test('return $r->post["a"] . ":" . count($r->files) . ":" . file_get_contents($r->files[0]["tmp_name"]);', '1:1:hello', 'POST', null,
+    "Content-Type: multipart/form-data; boundary=xyz\r\n",
+    "preamble\r\n--xyz\r\nContent-Disposition: form-data; name=\"a\"\r\n\r\n1\r\n"
+    . "--xyz\r\nContent-Disposition: form-data; name=\"f\"; filename=\"h.txt\"\r\nContent-Type: text/plain\r\n\r\nhello\r\n--xyz--\r\n");
+// a body of many 4 kB reads, parts of growing size put delimiters across the chunk edges
+$boundary = str_repeat("b", 60);
+$multipart = "";
+for ($i = 1; $i <= 200; $i++) {
+    $multipart .= "--$boundary\r\nContent-Disposition: form-data; name=\"f$i\"\r\n\r\n" . str_repeat("x", $i) . "\r\n";
+}
+$multipart .= "--$boundary\r\nContent-Disposition: form-data; name=\"f\"; filename=\"big.txt\"\r\n\r\n"
+    . str_repeat("--" . substr($boundary, 1) . "\r\n", 200) . "\r\n--$boundary--\r\n";
+test('return implode(",", array_map("strlen", $r->post)) . "|" . filesize($r->files[0]["tmp_name"]);',
+    implode(",", range(1, 200)) . "|" . (200 * 63), 'POST', null,
+    "Content-Type: multipart/form-data; boundary=$boundary\r\n", $multipart);
+test('global $s; $s->setCompression(6, 16); return str_repeat("compressible ", 100);', null, 'GET',
+    array('Content-Encoding' => 'gzip', 'Vary' => 'Accept-Encoding'), "Accept-Encoding: deflate;q=0.5, gzip\r\n");
+test('global $s; $s->setCompression(6, 16); return str_repeat("compressible ", 100);', str_repeat("compressible ", 100), 'GET',
+    array('Vary' => 'Accept-Encoding'), "Accept-Encoding: gzip;q=0\r\n");
+test('global $s; $s->setCompression(6, 16); return str_repeat("compressible ", 100);', null, 'GET',
+    array('Content-Encoding' => 'gzip', 'Vary' => 'Accept-Encoding'), "Accept-Encoding: x-gzip\r\n");
 test('file_put_contents(__DIR__ . "/test.txt", "qwertzuiopasdfghjklyxcvbnm");return $r->sendFile("test.txt", __DIR__);', "qwertzuiopasdfghjklyxcvbnm");
 test('file_put_contents(__DIR__ . "/test.txt", "qwertzuiopasdfghjklyxcvbnm");return $r->sendFile("test.txt", __DIR__);', "wertz", "GET", null, "Range: bytes=1-5\r\n");
 test('file_put_contents(__DIR__ . "/test.txt", "qwertzuiopasdfghjklyxcvbnm");return $r->sendFile("test.txt", __DIR__);', "xcvbnm", "GET", null, "Range: bytes=-6\r\n");
 test('file_put_contents(__DIR__ . "/test.txt", "qwertzuiopasdfghjklyxcvbnm");return $r->sendFile("test.txt", __DIR__);', "asdfghjklyxcvbnm", "GET", null, "Range: bytes=10-\r\n");
-test('unlink(__DIR__ . "/test.txt");"";', "");
+test('file_put_contents(__DIR__ . "/test.txt", "qwertzuiopasdfghjklyxcvbnm");file_put_contents(__DIR__ . "/test.txt.gz", "precompressed");return $r->sendFile("test.txt", __DIR__);', "precompressed", "GET",
+    array('Content-Encoding' => 'gzip', 'Vary' => 'Accept-Encoding'), "Accept-Encoding: br;q=0, gzip\r\n");
+test('return $r->sendFile("test.txt", __DIR__);', "qwertzuiopasdfghjklyxcvbnm", "GET",
+    array('Vary' => 'Accept-Encoding'), "Accept-Encoding: identity\r\n");
+test('return $r->sendFile("test.txt", __DIR__);', "precompressed", "GET",
+    array('Content-Encoding' => 'gzip', 'Vary' => 'Accept-Encoding'), "Accept-Encoding: x-gzip\r\n");
+test('unlink(__DIR__ . "/test.txt");unlink(__DIR__ . "/test.txt.gz");"";', "");
+test('return $r->post["a"] . "|" . $r->post["b"] . "|" . $r->post["c"]["d"] . $r->post["c"][0];', "xy|1 2|12", 'POST', null,
+    "Content-Type: application/x-www-form-urlencoded\r\n", "a=x%00y&b=1+2&c[d]=1&c[]=2");
+test('return $r->post["a"] . ":" . strlen($r->post["a"]);', "xy:2", 'POST', null, "Content-Type: multipart/form-data; boundary=xyz\r\n",
+    "--xyz\r\nContent-Disposition: form-data; name=\"a\"\r\n\r\nx\x00y\r\n--xyz--\r\n");
+$response = serve('$handler=function($r){return $r->get["a"] . "|" . $r->get["b"] . "|" . $r->get["c"]["d"] . $r->get["c"][0];}',
+    "GET /q?a=x%00y&b=1+2&c[d]=1&c[]=2 HTTP/1.0\r\n\r\n");
+var_dump(body($response) === "xy|1 2|12");
+$response = serve('$handler=function($r){return $r->cookies["a"] . $r->cookies["b"] . $r->cookies["c"] . $r->cookies["d"];}',
+    "GET /q HTTP/1.0\r\nCookie: a=1; b=2;c=3;  d=%34\r\n\r\n");
+var_dump(body($response) === "1234");
+$response = serve('$handler=function($r){return count($r->get) . count($r->cookies);}',
+    "GET /q?a=1&b=2&c=3 HTTP/1.0\r\nCookie: a=1; b=2; c=3\r\n\r\n", 45678, "-d max_input_vars=2");
+var_dump(body($response) === "22");
+$multipart = "--xyz\r\nContent-Disposition: form-data; name=\"a\"; filename=\"a.txt\"\r\n\r\nfirst\r\n"
+    . "--xyz\r\nContent-Disposition: form-data; name=\"b\"; filename=\"b.txt\"\r\n\r\nsecond\r\n--xyz--\r\n";
+$response = serve('$GLOBALS["parts"]="";' .
+    '$route->setUploadHandler(function($r, $part, $chunk, $last) {' .
+    '$GLOBALS["parts"] .= $part["name"] . "/" . $part["filename"] . ":" . $chunk . ($last ? ";" : "");});' .
+    '$handler=function($r){return $GLOBALS["parts"] . count($r->files);}',
+    "POST /upload HTTP/1.0\r\nContent-Type: multipart/form-data; boundary=xyz\r\nContent-Length: "
+    . strlen($multipart) . "\r\n\r\n" . $multipart);
+var_dump(body($response) === "a/a.txt:first;b/b.txt:second;2");
+$response = serve('$GLOBALS["body"]="";' .
+    '$route->setBodyHandler(function($r, $chunk) {$GLOBALS["body"] .= $chunk;});' .
+    '$handler=function($r){return $GLOBALS["body"] . ":" . strlen($GLOBALS["body"]);}',
+    "POST /body HTTP/1.0\r\nContent-Type: text/plain\r\nContent-Length: 6\r\n\r\nfoobar");
+var_dump(body($response) === "foobar:6");
+$response = serve('$s->setBodyFileThreshold(4);' .
+    '$handler=function($r){return $r->bodyFile["filesize"] . ":" . stream_get_contents($r->bodyFile["stream"]);}',
+    "PUT /file HTTP/1.0\r\nContent-Length: 6\r\n\r\nfoobar");
+var_dump(body($response) === "6:foobar");
+$response = serve('$s->setBodyFileThreshold(16);' .
+    '$handler=function($r){return var_export($r->bodyFile, true);}',
+    "PUT /file HTTP/1.0\r\nContent-Length: 6\r\n\r\nfoobar");
+var_dump(body($response) === "NULL");
+$multipart = "--xyz\r\nContent-Disposition: form-data; name=\"small\"; filename=\"s.txt\"\r\n\r\nhello\r\n"
+    . "--xyz\r\nContent-Disposition: form-data; name=\"large\"; filename=\"l.txt\"\r\n\r\n" . str_repeat("x", 100) . "\r\n--xyz--\r\n";
+$response = serve('$s->setUploadMemoryThreshold(64);' .
+    '$handler=function($r){return $r->files[0]["content"] . ":" . (int)isset($r->files[0]["tmp_name"])' .
+    ' . ":" . (int)isset($r->files[1]["content"]) . ":" . filesize($r->files[1]["tmp_name"]);}',
+    "POST /upload HTTP/1.0\r\nContent-Type: multipart/form-data; boundary=xyz\r\nContent-Length: "
+    . strlen($multipart) . "\r\n\r\n" . $multipart);
+var_dump(body($response) === "hello:0:0:100");
+$response = serve(
+    '$route->setBeforeBody(function($r, $params) {if ($params["uri"] === "secret") throw new Can\HTTPError(401, "Unauthorized");});' .
+    '$handler=function($r){return "called";}',
+    "POST /secret HTTP/1.0\r\nContent-Type: text/plain\r\nContent-Length: 6\r\n\r\nfoobar");
+var_dump(status($response) === 401);
+var_dump(strpos($response, "called") === false);
+$response = serve('$s->setLimits(0, 4);$handler=function($r){return "called";}',
+    "POST /limited HTTP/1.0\r\nContent-Type: text/plain\r\nContent-Length: 6\r\n\r\nfoobar");
+var_dump(status($response) === 413);
+$response = serve('$route->setLimits(0, 4);$handler=function($r){return "called";}',
+    "POST /limited HTTP/1.0\r\nContent-Type: text/plain\r\nContent-Length: 6\r\n\r\nfoobar");
+var_dump(status($response) === 413);
+$response = serve('$route->setLimits(0, 6);$handler=function($r){return "called";}',
+    "POST /limited HTTP/1.0\r\nContent-Type: text/plain\r\nContent-Length: 6\r\n\r\nfoobar");
+var_dump(body($response) === "called");
+$response = serve('$s->deny("127.0.0.0/8");$s->allow("127.0.0.1");$handler=function($r){return "allowed";}',
+    "GET /access HTTP/1.0\r\n\r\n");
+var_dump(body($response) === "allowed");
+// without revalidation delay a changed file is never served from the cache
+$response = serve('$s->setFileCache(4, 0);' .
+    '$handler=function($r){$file = __DIR__ . "/cache.txt";' .
+    'if ($r->uri === "/done") {unlink($file); return "";}' .
+    'file_put_contents($file, $r->uri === "/first" ? "one" : "three"); return $r->sendFile("cache.txt", __DIR__);}',
+    array("GET /first HTTP/1.0\r\n\r\n", "GET /second HTTP/1.0\r\n\r\n", "GET /done HTTP/1.0\r\n\r\n"));
+var_dump(body($response[0]) === "one");
+var_dump(body($response[1]) === "three");
+// requests refused on their headers are released, the server goes on serving
+$response = serve(
+    '$route->setBeforeBody(function($r, $params) {if ($params["uri"] === "secret") throw new Can\HTTPError(401, "Unauthorized");});' .
+    '$handler=function($r){return "called";}',
+    array_merge(array_fill(0, 50, "POST /secret HTTP/1.1\r\nHost: localhost\r\nExpect: 100-continue\r\nContent-Type: text/plain\r\n"
+        . "Content-Length: 6\r\nConnection: close\r\n\r\nfoobar"), array("GET /open HTTP/1.0\r\n\r\n")));
+var_dump(count(array_filter(array_map('status', $response), function ($code) {return $code === 401;})) === 50);
+var_dump(body($response[50]) === "called");
+$preflight = "OPTIONS /api HTTP/1.0\r\nAccess-Control-Request-Method: PUT\r\nAccess-Control-Request-Headers: X-Token\r\n";
+$response = serve('$route->setCors(new Can\Server\Cors(array("origins" => array("https://example.com"),' .
+    '"methods" => Can\Server\Route::METHOD_GET | Can\Server\Route::METHOD_PUT, "headers" => array("X-Token"),' .
+    '"expose" => array("X-Request-Id"), "max_age" => 600, "credentials" => true)));' .
+    '$handler=function($r){return "ok";}',
+    array($preflight . "Origin: https://example.com\r\n\r\n",
+        $preflight . "Origin: https://evil.example.com\r\n\r\n",
+        "GET /api HTTP/1.0\r\nOrigin: https://example.com\r\n\r\n",
+        "GET /api HTTP/1.0\r\nOrigin: https://evil.example.com\r\n\r\n"));
+var_dump(status($response[0]) === 204);
+var_dump(response_header($response[0], 'Access-Control-Allow-Origin') === 'https://example.com');
+var_dump(response_header($response[0], 'Access-Control-Allow-Methods') === 'GET, PUT');
+var_dump(response_header($response[0], 'Access-Control-Allow-Headers') === 'X-Token');
+var_dump(response_header($response[0], 'Access-Control-Max-Age') === '600');
+var_dump(response_header($response[0], 'Access-Control-Allow-Credentials') === 'true');
+var_dump(response_header($response[0], 'Vary') === 'Origin');
+var_dump(status($response[1]) === 403);
+var_dump(response_header($response[1], 'Access-Control-Allow-Origin') === null);
+var_dump(response_header($response[1], 'Vary') === 'Origin');
+var_dump(body($response[2]) === "ok");
+var_dump(response_header($response[2], 'Access-Control-Allow-Origin') === 'https://example.com');
+var_dump(response_header($response[2], 'Access-Control-Allow-Credentials') === 'true');
+var_dump(response_header($response[2], 'Access-Control-Expose-Headers') === 'X-Request-Id');
+var_dump(response_header($response[2], 'Vary') === 'Origin');
+var_dump(body($response[3]) === "ok");
+var_dump(response_header($response[3], 'Access-Control-Allow-Origin') === null);
+var_dump(response_header($response[3], 'Vary') === 'Origin');
+// a denied client cannot stop the server, timeout does
+$response = serve('$s->deny("127.0.0.1");$handler=function($r){return "allowed";}',
+    "GET /access HTTP/1.0\r\n\r\n", 45680);
+var_dump(status($response) === 403);
 ?>
 --EXPECT--
 bool(true)
@@ -272,3 +496,77 @@ bool(true)
 bool(true)
 bool(true)
 bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
@@ -10,7 +10,23 @@ try { $route = new Route('/', 'nada'); } catch (\Exception $e) { var_dump($e ins
 try { $route = new Route('/', function () {}, 'asd'); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
 try { $route = new Route('/', function () {}, false); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
 try { $route = new Route(false, function () {}, Route::METHOD_ALL); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
+try { $route = new Route('/<x:re:>/y', function () {}); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
+$route = new Route('/<x:re:[a-z]+>/y', function () {});
+var_dump($route->getUri(true) === '^/(?<x>[a-z]+)/y$');
 $route = new Route('/', function () {}, Route::METHOD_ALL);
+try { $route->setBodyHandler('nada'); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidCallbackException); }
+try { $route->setBodyHandler(); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
+$route->setBodyHandler(function ($request, $chunk) {});
+$route->setBodyHandler(null);
+try { $route->setUploadHandler('nada'); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidCallbackException); }
+$route->setUploadHandler(function ($request, $part, $chunk, $last) {});
+try { $route->setUploadHandler(fopen('php://memory', 'w')); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidCallbackException); }
+$route->setUploadHandler(null);
+try { $route->setBeforeBody('nada'); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidCallbackException); }
+$route->setBeforeBody(function ($request, $params) {});
+$route->setBeforeBody(null);
+try { $route->setLimits(1024); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
+$route->setLimits(0, 104857600, 60);
 try { $uri = $route->getUri(1); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
 try { $uri = $route->getUri(''); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
 try { $uri = $route->getUri(null); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
@@ -49,6 +65,14 @@ bool(true)
 bool(true)
 bool(true)
 bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
 string(1) "/"
 bool(false)
 bool(true)
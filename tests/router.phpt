@@ -13,6 +13,8 @@ $router = new Router();
 try { $router->addRoute(); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
 try { $router->addRoute(false); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
 try { $router->addRoute('test'); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
+try { $router->addRoute(new Route('/'), false); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
+try { $router = new Router(array('api.example.com' => array('bar'))); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
 unset($router);
 $router = new Router(array(
     new Route('/', function ($request) {}),
@@ -30,6 +32,44 @@ while($router->valid()) {
     echo $router->key() . ' => ' . $router->current()->getUri() . PHP_EOL;
     $router->next();
 }
+$router = new Router(array(
+    new Route('/', function ($request) {}),
+    new Route('/user/<id:int>', function ($request) {}, Route::METHOD_GET|Route::METHOD_POST),
+    new Route('/user/<name>', function ($request) {}),
+    'api.example.com' => array(new Route('/v1/<id:float>', function ($request) {})),
+    '*.example.org' => array(new Route('/', function ($request) {})),
+));
+$m = $router->match('GET', '/user/42'); var_dump($m['status'], $m['route']->getUri(), $m['params']);
+$m = $router->match('get', '/user/joe'); var_dump($m['status'], $m['params']);
+$m = $router->match('PUT', '/user/42'); var_dump($m['status'], $m['route']);
+$m = $router->match('GET', '/nope'); var_dump($m['status']);
+$m = $router->match('GET', '/v1/1.5', 'API.example.com:8080'); var_dump($m['status'], $m['params']);
+// paths the host does not route fall back to the default routes
+$m = $router->match('GET', '/user/42', 'api.example.com'); var_dump($m['status'], $m['route']->getUri());
+$m = $router->match('PUT', '/user/42', 'api.example.com'); var_dump($m['status']);
+$m = $router->match('GET', '/nope', 'api.example.com'); var_dump($m['status']);
+$m = $router->match('GET', '/', 'www.example.org'); var_dump($m['route']->getUri());
+try { $router->match('FOO', '/'); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
+// literal regexp metacharacters overlap, the first route keeps winning however hot the second gets
+$router = new Router(array(
+    new Route('/a.c/<id:int>', function ($request) {}),
+    new Route('/abc/<name>', function ($request) {}),
+));
+for ($i = 0; $i < 2048; $i++) { $router->match('GET', '/abc/joe'); }
+$m = $router->match('GET', '/abc/42'); var_dump($m['route']->getUri());
+// disjoint literals may be reordered without changing matches
+$router = new Router(array(
+    new Route('/abc/<id:int>', function ($request) {}),
+    new Route('/abd/<name>', function ($request) {}),
+));
+for ($i = 0; $i < 2048; $i++) { $router->match('GET', '/abd/joe'); }
+$m = $router->match('GET', '/abc/42'); var_dump($m['route']->getUri());
+$m = $router->match('GET', '/abd/42'); var_dump($m['route']->getUri());
+// pcre.backtrack_limit applies to re: placeholders, a runaway match is no match
+ini_set('pcre.backtrack_limit', 1000);
+$router = new Router(array(new Route('/<x:re:(a+)+b>', function ($request) {})));
+$m = $router->match('GET', '/aab'); var_dump($m['status']);
+$m = $router->match('GET', '/' . str_repeat('a', 40) . 'c'); var_dump($m['status']);
 ?>
 --EXPECT--
 bool(true)
@@ -38,6 +78,8 @@ bool(true)
 bool(true)
 bool(true)
 bool(true)
+bool(true)
+bool(true)
 string(1) "/"
 bool(false)
 int(1)
@@ -54,3 +96,33 @@ int(18)
 1 => /<id:int>
 2 => /<id:float>
 3 => /<file:path>
+int(200)
+string(14) "/user/<id:int>"
+array(1) {
+  ["id"]=>
+  int(42)
+}
+int(200)
+array(1) {
+  ["name"]=>
+  string(3) "joe"
+}
+int(405)
+NULL
+int(404)
+int(200)
+array(1) {
+  ["id"]=>
+  float(1.5)
+}
+int(200)
+string(14) "/user/<id:int>"
+int(405)
+int(404)
+string(1) "/"
+bool(true)
+string(13) "/a.c/<id:int>"
+string(13) "/abc/<id:int>"
+string(11) "/abd/<name>"
+int(200)
+int(404)
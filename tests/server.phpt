@@ -21,6 +21,42 @@ try { $s = new Server('0.0.0.0', 45678, "x-error"); } catch (\Exception $e) { va
 try { $s = new Server('0.0.0.0', 45679, "x-error", false); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
 $s = new Server('0.0.0.0', 45679, "x-error", fopen("/dev/null", "w"));
 try { $s->stop(); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidOperationException); }
+try { $s->setRouter(false); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
+try { $s->setBodyFileThreshold(-1); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
+$s->setBodyFileThreshold(1048576);
+try { $s->setUploadMemoryThreshold("x"); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
+$s->setUploadMemoryThreshold(4096);
+try { $s->setLimits(8192, -1); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
+$s->setLimits(8192, 10485760);
+try { $s->setTimeouts(5, 0, 30); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
+$s->setTimeouts(5, 20, 30);
+try { $s->allow('10.0.0.0/33'); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
+try { $s->deny('nada'); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
+$s->allow('10.0.0.0/8');
+$s->allow('2001:db8::/32');
+$s->deny('10.1.2.3');
+try { $s->setMaxConnectionsPerIp(-1); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
+$s->setMaxConnectionsPerIp(16);
+try { $s->setCompression(10); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
+$s->setCompression(6, 256, array('text/*', 'application/json'));
+$s->setCompression(0);
+try { $s->setFileCache(64, -1); } catch (\Exception $e) { var_dump($e instanceof Can\InvalidParametersException); }
+$s->setFileCache(64, 5);
+$s->setFileCache(0);
+var_dump($s->getConnectionStats() === array('connections' => 0, 'clients' => 0, 'denied' => 0, 'capped' => 0));
+$router = new Can\Server\Router();
+$router->addRoute(new Can\Server\Route('/', function ($request) {}));
+$s->setRouter($router);
+$router->addRoute(new Can\Server\Route('/foo', function ($request) {}));
+$router->addRoute(new Can\Server\Route('/foo/<id:int>', function ($request) {}));
+// staged routes stay invisible until they are committed
+$m = $router->match('GET', '/'); var_dump($m['status'] === 200);
+$m = $router->match('GET', '/foo'); var_dump($m['status'] === 404);
+$m = $router->match('GET', '/foo/1'); var_dump($m['status'] === 404);
+$router->commit();
+$m = $router->match('GET', '/foo'); var_dump($m['status'] === 200 && $m['route']->getUri() === '/foo');
+$m = $router->match('GET', '/foo/1'); var_dump($m['status'] === 200 && $m['params'] === array('id' => 1));
+echo count(iterator_to_array($router)) . PHP_EOL;
 ?>
 --EXPECT--
 bool(true)
@@ -29,6 +65,18 @@ bool(true)
 bool(true)
 bool(true)
 bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
 Can\Server
 bool(true)
 bool(true)
@@ -36,3 +84,8 @@ bool(true)
 bool(true)
 bool(true)
 bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+3